@@ -0,0 +1,35 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte stream over a possibly compressed file. The format is taken from the
+// magic bytes. xz is decoded in-process when built with XZ=1 (liblzma);
+// otherwise xz, gzip and zstd data is piped through the matching command-line
+// decoder. Anything else is read as is.
+typedef struct ArchiveStream ArchiveStream;
+
+ArchiveStream *open_archive_stream(const char *path);
+// Reads up to len bytes; a short count means end of data or an error.
+size_t archive_stream_read(ArchiveStream *stream, uint8_t *buf, size_t len);
+// Returns 0 when the data decoded cleanly.
+int close_archive_stream(ArchiveStream *stream);
+
+// Called for each regular member of a tar archive. member_start returns where
+// to put the member's size bytes, or NULL to skip it; member_end follows every
+// member that was not skipped.
+typedef struct {
+  uint8_t *(*member_start)(void *ctx, const char *name, uint64_t size);
+  void (*member_end)(void *ctx, uint64_t size);
+  void *ctx;
+} TarVisitor;
+
+// True for .tar, .tar.xz, .txz, .tar.gz, .tgz, .tar.zst and .tar.bz2 names.
+int is_tar_path(const char *path);
+// Streams a tar archive, plain or compressed, member by member without
+// writing anything to disk. Understands ustar prefixes, GNU long names and
+// pax path/size records. Returns 0 on success.
+int read_tar(const char *path, const TarVisitor *visitor);
+
+#endif  // ARCHIVE_H
@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Trainer memory. One mmap reservation is cut into equal slices, one per
+// array. Pages are only backed once touched, so an array grows in place up to
+// its slice without copying, and the whole range asks for transparent
+// hugepages. A NULL arena, a failed reservation, a request larger than a
+// slice or running out of slices all fall back to malloc/realloc.
+#define ARENA_SLICE_BYTES ((size_t)1 << 36)
+#define ARENA_SLICES 48
+
+typedef struct {
+  unsigned char *base;
+  size_t slice_bytes;
+  int slice_count;
+  int next_slice;
+  int free_slices[ARENA_SLICES];
+  int free_count;
+} Arena;
+
+int arena_init(Arena *arena);
+void arena_free(Arena *arena);
+void *arena_alloc(Arena *arena, size_t bytes);
+void *arena_realloc(Arena *arena, void *ptr, size_t old_bytes, size_t new_bytes);
+void arena_release(Arena *arena, void *ptr);
+
+#endif  // ARENA_H
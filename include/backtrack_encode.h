@@ -0,0 +1,31 @@
+#ifndef BACKTRACK_ENCODE_H
+#define BACKTRACK_ENCODE_H
+
+#include <stdint.h>
+
+#include "merge_rules.h"
+#include "sequence.h"
+#include "vocab.h"
+
+// Linear-time encoder that produces exactly what encode() does. It walks the
+// text left to right taking the longest vocabulary token that a byte trie
+// matches, and falls back to shorter prefixes, or backtracks, whenever the
+// token cannot follow the previous one in a BPE encoding. Whether two tokens
+// may be neighbours is decided by replaying their merges backwards.
+typedef struct BacktrackEncoder BacktrackEncoder;
+
+// Requires the layout training produces: 256 byte tokens followed by one
+// token per merge rule, in rule order, with no pair merged twice. Returns
+// NULL otherwise. rules must outlive the encoder.
+BacktrackEncoder *create_backtrack_encoder(const Vocabulary *vocab, MergeRules *rules);
+void free_backtrack_encoder(BacktrackEncoder *encoder);
+
+// Safe to call from many threads on one encoder. Pretokenized rules are
+// applied one pre-tokenizer chunk at a time, as encode() does.
+TokenSequence backtrack_encode(const BacktrackEncoder *encoder, const uint8_t *text, SeqIndex text_len);
+
+// True when right may directly follow left in the encoding of some text,
+// i.e. encoding their bytes back to back yields exactly left, right.
+int backtrack_valid_pair(const BacktrackEncoder *encoder, int left, int right);
+
+#endif  // BACKTRACK_ENCODE_H
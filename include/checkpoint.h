@@ -0,0 +1,23 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "merge_rules.h"
+#include "trainer_state.h"
+#include "vocab.h"
+
+// A training run frozen between two merges: the tokenizer learned so far and
+// the compacted live sequence, enough to carry on without the corpus. Whether
+// it trained with --pretokenize is on the embedded tokenizer's rules.
+typedef struct {
+  int target_vocab_size;
+  TrainerSnapshot snapshot;
+} Checkpoint;
+
+// Written to path.tmp and renamed over path, so an interrupted write never
+// clobbers the previous checkpoint.
+int save_checkpoint(const char *path, const Vocabulary *vocab, const MergeRules *rules,
+                    const TrainerState *state, int target_vocab_size, SeqIndex initial_length);
+int load_checkpoint(const char *path, Vocabulary *vocab_out, MergeRules *rules_out, Checkpoint *checkpoint);
+void free_checkpoint(Checkpoint *checkpoint);
+
+#endif  // CHECKPOINT_H
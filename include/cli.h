@@ -1,11 +1,33 @@
 #ifndef CLI_H
 #define CLI_H
 
+#include "pair_queue.h"
+
+#define MAX_SNAPSHOTS 64
+
 typedef struct {
   int target_vocab_size;
   const char *input_path;
+  const char *input_list_path;
   const char *load_path;
   const char *save_path;
+  int pretokenize;
+  int threads;
+  PairQueueKind queue;
+  const char *checkpoint_path;
+  int checkpoint_every;
+  int checkpoint_seconds;
+  const char *resume_path;
+  int snapshot_sizes[MAX_SNAPSHOTS];  // ascending, no duplicates
+  int snapshot_count;
+  double sample_fraction;  // train on this share of the corpus; 1 is exact
+  int sample_checks;       // merges of a sampled run checked on the full corpus
+  const char *compare_path;
+  int batch_merges;
+  int verify_batches;
+  int use_arena;
+  const char *stats_path;
+  const char *merge_log_path;
 } CliOptions;
 
 void print_usage(const char *progname);
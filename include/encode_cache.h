@@ -0,0 +1,37 @@
+#ifndef ENCODE_CACHE_H
+#define ENCODE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "merge_rules.h"
+#include "sequence.h"
+
+// Pieces longer than this are always encoded afresh.
+#define ENCODE_CACHE_MAX_PIECE 256
+
+// Piece bytes -> tokens, split into independently locked shards so encoder
+// threads rarely contend. Each shard evicts with a CLOCK sweep once its share
+// of the byte budget is used up. A cache belongs to the rules it was created
+// with, which must outlive it.
+typedef struct EncodeCache EncodeCache;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t entries;
+  uint64_t bytes;  // keys, tokens and per-entry overhead
+} EncodeCacheStats;
+
+EncodeCache *create_encode_cache(MergeRules *rules, size_t budget_bytes);
+void free_encode_cache(EncodeCache *cache);
+void encode_cache_stats(EncodeCache *cache, EncodeCacheStats *stats);
+
+// Encodes text one piece at a time, reusing cached pieces. Pieces end where
+// encode() cuts the text (see TextCutter), so the tokens are the same as
+// encode()'s. Most pieces are short, and so worth caching, only for
+// --pretokenize tokenizers. Safe to call from many threads on one cache.
+TokenSequence encode_cached(EncodeCache *cache, const uint8_t *text, SeqIndex text_len);
+
+#endif  // ENCODE_CACHE_H
@@ -0,0 +1,48 @@
+#ifndef ENCODE_POOL_H
+#define ENCODE_POOL_H
+
+#include <stdint.h>
+
+#include "encode_cache.h"
+#include "merge_rules.h"
+#include "seq_index.h"
+#include "sequence.h"
+
+// Persistent encoder threads. A job is a number of tasks handed out by work
+// stealing: each thread starts on its own contiguous share and, when that
+// runs dry, takes the upper half of the largest share left.
+typedef struct EncodePool EncodePool;
+
+typedef void (*EncodeTaskFn)(void *ctx, int lane, SeqIndex task);
+
+// Returns NULL if the threads could not be started.
+EncodePool *create_encode_pool(int threads);
+void free_encode_pool(EncodePool *pool);
+int encode_pool_threads(const EncodePool *pool);
+// Runs fn for every task in [0, task_count) and returns when all are done.
+// lane is the running thread's index, below encode_pool_threads().
+void encode_pool_run(EncodePool *pool, SeqIndex task_count, EncodeTaskFn fn, void *ctx);
+
+// Ragged token arrays in one allocation: document d's tokens are
+// tokens[offsets[d]] up to tokens[offsets[d + 1]].
+typedef struct {
+  SeqIndex *offsets;
+  int *tokens;
+  SeqIndex count;
+} TokenBatch;
+
+// Encodes count documents on the pool. Work is split into tasks of similar
+// byte cost, so one long document does not hold up a batch of short ones.
+// With a cache, documents are encoded as by encode_cached(), else exactly as
+// by encode().
+void encode_batch(EncodePool *pool, const uint8_t *const *texts, const SeqIndex *lengths, SeqIndex count,
+                  MergeRules *rules, EncodeCache *cache, TokenBatch *out);
+void free_token_batch(TokenBatch *batch);
+
+// Encodes one long text on the pool, exactly as encode() does. The text is
+// cut where no merge can cross (see TextCutter) and the pieces are
+// encoded as a batch, so speedup depends on the tokenizer leaving such
+// boundaries in the text.
+TokenSequence encode_parallel(EncodePool *pool, const uint8_t *text, SeqIndex text_len, MergeRules *rules);
+
+#endif  // ENCODE_POOL_H
@@ -1,8 +1,30 @@
 #ifndef IO_H
 #define IO_H
 
+#include <stddef.h>
 #include <stdint.h>
 
-uint8_t* read_file(const char *filename, int *file_size);
+#include "seq_index.h"
+
+// Training text made of one or more documents laid out back to back.
+// doc_ends holds the ascending end offset of each document, the last one
+// being length. Empty documents are dropped. When mapped_bytes is nonzero,
+// text is a read-only mapping of the input file and must not be written.
+typedef struct {
+  uint8_t *text;
+  SeqIndex length;
+  SeqIndex *doc_ends;
+  SeqIndex doc_count;
+  size_t mapped_bytes;
+} Corpus;
+
+// input is a file, a directory (read recursively, skipping dot files) or a
+// glob pattern; list_path names a file with one path per line. Either may be
+// NULL. Every file becomes one document, in sorted order within a directory
+// or glob. Tar archives (see is_tar_path) are streamed instead, one document
+// per member, in archive order. A single plain file is memory-mapped rather
+// than copied. Returns 0 on success.
+int read_corpus(const char *input, const char *list_path, Corpus *corpus);
+void free_corpus(Corpus *corpus);
 
 #endif  // IO_H
@@ -1,20 +1,47 @@
 #ifndef MERGE_RULES_H
 #define MERGE_RULES_H
 
+#include <stdint.h>
+
 typedef struct {
   int token1;
   int token2;
   int result_token;
 } MergeRule;
 
+// Open-addressed (token1, token2) -> rank lookup built from the rule list.
+// next_same chains rules that repeat an earlier pair so lookups can skip
+// ranks that are no longer reachable. joins is a 256 x 256 bit set of the
+// byte pairs (last byte of token1, first byte of token2) that some merge
+// puts side by side inside one token; no token ever spans any other pair.
+typedef struct {
+  uint64_t *keys;
+  int *ranks;
+  int *next_same;
+  uint64_t *joins;
+  int capacity;
+} MergeRankMap;
+
 typedef struct {
   MergeRule *rules;
   int num_rules;
   int capacity;
+  MergeRankMap rank_map;
+  int pretokenize;  // trained with --pretokenize: no merge crosses a chunk
 } MergeRules;
 
 MergeRules create_merge_rules(int capacity);
 void free_merge_rules(MergeRules *rules);
 void add_merge_rule(MergeRules *rules, int token1, int token2, int result);
+void reserve_merge_rules(MergeRules *rules, int capacity);
+void build_merge_ranks(MergeRules *rules);
+int merge_rank_after(const MergeRules *rules, int token1, int token2, int after_rank);
+
+// False when no merge can join byte a to a following byte b, so every
+// encoding has a token boundary between them. Needs build_merge_ranks().
+static inline int merge_can_join(const MergeRules *rules, uint8_t a, uint8_t b) {
+  unsigned pair = (unsigned)a << 8 | b;
+  return (int)(rules->rank_map.joins[pair >> 6] >> (pair & 63) & 1);
+}
 
 #endif  // MERGE_RULES_H
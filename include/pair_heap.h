@@ -3,12 +3,15 @@
 
 #include <stddef.h>
 
+#include "arena.h"
+#include "seq_index.h"
+
 typedef struct PairEntry {
   int token_left;
   int token_right;
-  int count;
+  SeqIndex count;
   int heap_index;
-  int occ_head;
+  SeqIndex occ_head;
   int next_free;
   int in_use;
 } PairEntry;
@@ -17,10 +20,12 @@ typedef struct PairHeap {
   int *data;
   int size;
   int capacity;
+  Arena *arena;
 } PairHeap;
 
-void pair_heap_init(PairHeap *heap, int capacity_hint);
+void pair_heap_init(PairHeap *heap, int capacity_hint, Arena *arena);
 void pair_heap_free(PairHeap *heap);
+void pair_heap_build(PairHeap *heap, PairEntry *entries, int entry_count);
 void pair_heap_update(PairHeap *heap, PairEntry *entries, int pair_index);
 int pair_heap_pop_max(PairHeap *heap, PairEntry *entries);
 void pair_heap_remove(PairHeap *heap, PairEntry *entries, int pair_index);
@@ -0,0 +1,64 @@
+#ifndef PAIR_QUEUE_H
+#define PAIR_QUEUE_H
+
+#include <stdint.h>
+
+#include "pair_heap.h"
+#include "seq_index.h"
+
+typedef enum {
+  PAIR_QUEUE_HEAP,
+  PAIR_QUEUE_BUCKETS
+} PairQueueKind;
+
+// Counts below this get a bucket; larger counts live in the overflow heap,
+// which always outranks the buckets.
+#define PAIR_BUCKET_LIMIT (1 << 16)
+
+typedef struct {
+  uint64_t key;
+  int pair_index;
+} BucketKey;
+
+// Count-bucketed max queue. Each count below PAIR_BUCKET_LIMIT has a doubly
+// linked list of pairs. Ties within the top bucket are broken by a min-heap
+// on the (left, right) key, built when the bucket first becomes the top and
+// pruned lazily, so pops follow the same order as PairHeap.
+typedef struct {
+  int *head;
+  SeqIndex top;
+
+  int *prev;
+  int *next;
+  SeqIndex *filed;  // bucket each pair is linked into, 0 when unlinked
+  int capacity;
+
+  BucketKey *keys;
+  int key_count;
+  int key_capacity;
+  SeqIndex key_bucket;
+  int key_live;
+
+  PairHeap overflow;
+  Arena *arena;
+} PairBuckets;
+
+typedef struct {
+  PairQueueKind kind;
+  PairHeap heap;
+  PairBuckets buckets;
+
+  // Operation counts for training telemetry.
+  uint64_t pops;
+  uint64_t updates;
+  uint64_t removes;
+} PairQueue;
+
+void pair_queue_init(PairQueue *queue, PairQueueKind kind, int capacity_hint, Arena *arena);
+void pair_queue_free(PairQueue *queue);
+void pair_queue_build(PairQueue *queue, PairEntry *entries, int entry_count);
+void pair_queue_update(PairQueue *queue, PairEntry *entries, int pair_index);
+int pair_queue_pop_max(PairQueue *queue, PairEntry *entries);
+void pair_queue_remove(PairQueue *queue, PairEntry *entries, int pair_index);
+
+#endif  // PAIR_QUEUE_H
@@ -0,0 +1,21 @@
+#ifndef PARALLEL_MERGE_H
+#define PARALLEL_MERGE_H
+
+#include "trainer_state.h"
+
+// Merges with fewer sites than this stay on the calling thread; below it the
+// phase barriers cost more than the rewrite itself.
+#define PARALLEL_MERGE_MIN_SITES 4096
+
+typedef struct MergeWorkers MergeWorkers;
+
+MergeWorkers* merge_workers_create(TrainerState *state, int threads);
+void merge_workers_free(MergeWorkers *workers);
+
+// Applies one merge at the given left nodes (sorted ascending for self-pairs).
+// Produces the same sequence, pair counts and heap contents as merging the
+// sites one at a time on the calling thread.
+void parallel_merge_sites(MergeWorkers *workers, int pair_index, int new_token_id,
+                          const SeqIndex *sites, SeqIndex site_count);
+
+#endif  // PARALLEL_MERGE_H
@@ -0,0 +1,18 @@
+#ifndef PRETOKENIZE_H
+#define PRETOKENIZE_H
+
+#include <stdint.h>
+
+#include "seq_index.h"
+
+// Byte-level approximation of the GPT-2 pre-tokenizer: contractions, an
+// optional leading space followed by a run of letters, digits or punctuation,
+// and whitespace runs. Bytes >= 0x80 count as letters so UTF-8 sequences stay
+// inside one chunk. Returns the end offset of the chunk starting at pos.
+SeqIndex pretokenize_next(const uint8_t *text, SeqIndex len, SeqIndex pos);
+// True when the text cut off at pos, a chunk end, splits into the same chunks
+// as before. A whitespace run at the end of the text keeps its last byte, so
+// this fails right after whitespace.
+int pretokenize_can_end(const uint8_t *text, SeqIndex pos);
+
+#endif  // PRETOKENIZE_H
@@ -0,0 +1,44 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stdint.h>
+
+#include "io.h"
+#include "merge_rules.h"
+#include "seq_index.h"
+#include "sequence.h"
+#include "vocab.h"
+
+// Corpus sampling for approximate training. The sample is made of evenly
+// spaced SAMPLE_BLOCK-byte blocks, so it is deterministic and spread over the
+// whole corpus. Each block ends a document, as do the documents inside it.
+#define SAMPLE_BLOCK (1 << 16)
+
+void sample_corpus(const Corpus *corpus, double fraction, Corpus *sample);
+
+// Checks the merges picked on a sample against the full corpus, as
+// TrainOptions.check_pairs. A merge is checked only when the sample counts of
+// its two leading candidates are within SAMPLE_CHECK_MARGIN of each other,
+// and at most max_checks times, since each check encodes the whole corpus.
+#define SAMPLE_CHECK_MARGIN 0.2
+
+typedef struct {
+  const Corpus *corpus;
+  int max_checks;
+  int checks;
+  int reranked;  // checks where the exact counts picked another candidate
+  EncoderContext ctx;
+} SampleChecker;
+
+SampleChecker create_sample_checker(const Corpus *corpus, int max_checks);
+void free_sample_checker(SampleChecker *checker);
+int sample_check_pairs(void *checker, MergeRules *rules, const uint64_t *pairs, const SeqIndex *sample_counts,
+                       int count, SeqIndex *exact);
+
+// Reports where a merge list first departs from a reference one and how many
+// learned tokens the two share. Tokens are compared by bytes, since ids shift
+// after the first difference.
+void report_merge_divergence(const Vocabulary *vocab, const MergeRules *rules, const Vocabulary *ref_vocab,
+                             const MergeRules *ref_rules);
+
+#endif  // SAMPLE_H
@@ -0,0 +1,18 @@
+#ifndef SEQ_INDEX_H
+#define SEQ_INDEX_H
+
+#include <stdint.h>
+
+// Positions in the corpus and in token sequences, plus counts that can grow
+// with the corpus. Token ids, vocab sizes and merge ranks stay int. Build with
+// LARGE_CORPUS=1 (-DBPE_LARGE_CORPUS) to train on or encode inputs of 2 GiB
+// and more; the default build keeps these 32-bit to halve the link arrays.
+#ifdef BPE_LARGE_CORPUS
+typedef int64_t SeqIndex;
+#define SEQ_INDEX_MAX INT64_MAX
+#else
+typedef int SeqIndex;
+#define SEQ_INDEX_MAX INT32_MAX
+#endif
+
+#endif  // SEQ_INDEX_H
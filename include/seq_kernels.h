@@ -0,0 +1,28 @@
+#ifndef SEQ_KERNELS_H
+#define SEQ_KERNELS_H
+
+#include <stdint.h>
+
+#include "seq_index.h"
+
+// Token sequence kernels with SSE4.1, AVX2 and AVX-512 versions. The widest
+// one the CPU supports is picked on first use; every version gives the same
+// output as the scalar one. encode() widens each piece of text through them.
+typedef enum {
+  SEQ_ISA_SCALAR,
+  SEQ_ISA_SSE41,
+  SEQ_ISA_AVX2,
+  SEQ_ISA_AVX512,
+  SEQ_ISA_COUNT
+} SeqIsa;
+
+const char *seq_isa_name(SeqIsa isa);
+int seq_isa_supported(SeqIsa isa);
+SeqIsa seq_kernels_isa(void);
+// Forces a version, e.g. for benchmarks. Returns -1 if the CPU lacks it.
+int seq_kernels_use(SeqIsa isa);
+
+// dst[i] = src[i] for n bytes.
+void widen_bytes(const uint8_t *src, int *dst, SeqIndex n);
+
+#endif  // SEQ_KERNELS_H
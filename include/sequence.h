@@ -4,20 +4,68 @@
 #include <string.h>
 #include <stdint.h>
 #include "merge_rules.h"
+#include "seq_index.h"
 #include "vocab.h"
 
 typedef struct {
   int *tokens;
-  int length;
-  int capacity;
+  SeqIndex length;
+  SeqIndex capacity;
 } TokenSequence;
 
-TokenSequence create_sequence(int capacity);
+TokenSequence create_sequence(SeqIndex capacity);
 void free_sequence(TokenSequence *seq);
-TokenSequence text_to_sequence(uint8_t *text, int text_len);
+TokenSequence text_to_sequence(const uint8_t *text, SeqIndex text_len);
 void print_sequence(TokenSequence *seq, Vocabulary *vocab);
 void merge_pair_in_sequence(TokenSequence *seq, int token1, int token2, int new_token);
-TokenSequence encode(uint8_t *text, int text_len, MergeRules *rules);
-uint8_t* decode(TokenSequence *seq, Vocabulary *vocab, int *output_len);
+TokenSequence encode(const uint8_t *text, SeqIndex text_len, MergeRules *rules);
+
+// Scratch space for encode() kept between calls. It only grows, so once it
+// has seen the longest input, encoding allocates nothing. One per thread.
+typedef struct {
+  int *tokens;
+  SeqIndex *next;
+  SeqIndex *prev;
+  int *pair_rank;
+  uint64_t *heap;
+  SeqIndex capacity;
+  SeqIndex heap_capacity;
+} EncoderContext;
+
+EncoderContext create_encoder_context(SeqIndex capacity);
+void free_encoder_context(EncoderContext *ctx);
+void encoder_context_reserve(EncoderContext *ctx, SeqIndex capacity);
+// Same tokens as encode(), left in ctx->tokens. Returns their count.
+SeqIndex encode_in_context(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules);
+// Write the tokens to out and return their count. When that is more than
+// out_capacity, nothing is written and the caller can retry with a buffer of
+// that size. The 16-bit form returns -1 for vocabularies over 65536 tokens.
+SeqIndex encode_into_u32(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules,
+                         uint32_t *out, SeqIndex out_capacity);
+SeqIndex encode_into_u16(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules,
+                         uint16_t *out, SeqIndex out_capacity);
+// Walks the places where text can be cut without changing its encoding:
+// byte pairs no merge joins or, for pretokenized rules, pre-tokenizer chunk
+// ends. Needs build_merge_ranks().
+typedef struct {
+  const MergeRules *rules;
+  const uint8_t *text;
+  SeqIndex text_len;
+  SeqIndex chunk_end;
+} TextCutter;
+
+void text_cutter_init(TextCutter *cutter, const MergeRules *rules, const uint8_t *text, SeqIndex text_len);
+// First cut at or after from, or text_len. from must not go backwards
+// between calls.
+SeqIndex text_cutter_next(TextCutter *cutter, SeqIndex from);
+// Number of tokens encode() would return, without producing them. Scratch
+// space stays at a few pieces however long the text is.
+SeqIndex count_tokens(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules);
+// The first max_tokens tokens of encode(), left in ctx->tokens, encoding only
+// as much text as they need. cut_offset is set to the number of bytes they
+// cover, which is text_len when nothing was cut. Returns their count.
+SeqIndex encode_truncated(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules,
+                          SeqIndex max_tokens, SeqIndex *cut_offset);
+uint8_t* decode(TokenSequence *seq, Vocabulary *vocab, SeqIndex *output_len);
 
 #endif  // SEQUENCE_H
@@ -1,10 +1,16 @@
 #ifndef TOKENIZER_IO_H
 #define TOKENIZER_IO_H
 
+#include <stdio.h>
+
 #include "merge_rules.h"
 #include "vocab.h"
 
 int save_tokenizer(const char *path, const Vocabulary *vocab, const MergeRules *rules);
 int load_tokenizer(const char *path, Vocabulary *vocab_out, MergeRules *rules_out);
 
+// Stream variants, for files that embed a tokenizer (e.g. checkpoints).
+int write_tokenizer(FILE *fp, const Vocabulary *vocab, const MergeRules *rules);
+int read_tokenizer(FILE *fp, Vocabulary *vocab_out, MergeRules *rules_out);
+
 #endif  // TOKENIZER_IO_H
@@ -4,7 +4,59 @@
 #include "vocab.h"
 #include "sequence.h"
 #include "merge_rules.h"
+#include "pair_queue.h"
 
-void train_bpe(Vocabulary *vocab, TokenSequence *seq, int target_vocab_size, MergeRules *merge_rules);
+// Fills exact[i] with the full corpus count of the pair with key pairs[i]
+// (left << 32 | right) once the merges in rules are applied. sample_counts
+// are the trainer's own counts. Returns 0 to leave the pairs unchecked.
+typedef int (*PairCheckFn)(void *ctx, MergeRules *rules, const uint64_t *pairs, const SeqIndex *sample_counts,
+                           int count, SeqIndex *exact);
+
+typedef struct {
+  int pretokenize;  // train on unique pre-tokenizer chunks weighted by frequency
+  int threads;      // worker threads for the parallel training phases
+  PairQueueKind queue;  // structure that picks the most frequent pair
+
+  const char *checkpoint_path;  // NULL disables checkpoints
+  int checkpoint_every;         // merges between checkpoints, 0 for none
+  int checkpoint_seconds;       // seconds between checkpoints, 0 for none
+  const struct TrainerSnapshot *resume;  // continue from this state instead of the text
+
+  // Ascending vocab sizes at which to also save the tokenizer, to
+  // snapshot_path with the size spliced in before the extension.
+  const int *snapshot_sizes;
+  int snapshot_count;
+  const char *snapshot_path;
+
+  int batch_merges;  // most non-interacting top pairs merged per iteration
+  int use_arena;     // grow trainer tables in place in one mmap reservation
+
+  // Ascending end offsets of the corpus documents in the text; no pair spans
+  // two documents. NULL or a single document trains on it as one text.
+  const SeqIndex *document_ends;
+  SeqIndex document_count;
+
+  // Approximate training on a sample: the top candidates of each step go to
+  // check_pairs, and the one with the highest exact count is merged. Steps
+  // merge one pair while it is set.
+  PairCheckFn check_pairs;
+  void *check_ctx;
+
+  struct TrainStats *stats;    // filled in with telemetry when not NULL
+  const char *merge_log_path;  // JSON line per merge when not NULL
+} TrainOptions;
+
+TrainOptions default_train_options(void);
+// seq holds raw bytes. Rules already in merge_rules are applied to it first
+// and new merges are appended after them; options->pretokenize must then match
+// merge_rules->pretokenize. Returns 1 if training stopped early
+// on SIGINT/SIGTERM after writing a checkpoint, else 0.
+int train_bpe(Vocabulary *vocab, TokenSequence *seq, int target_vocab_size, MergeRules *merge_rules,
+               const TrainOptions *options);
+// Same as train_bpe() but reads the corpus bytes in place, e.g. from a
+// mapped file, and keeps no copy of the final tokens. With options->resume
+// set, text may be NULL.
+int train_bpe_text(Vocabulary *vocab, const uint8_t *text, SeqIndex length, int target_vocab_size,
+                   MergeRules *merge_rules, const TrainOptions *options);
 
 #endif  // TRAIN_H
@@ -0,0 +1,64 @@
+#ifndef TRAIN_STATS_H
+#define TRAIN_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "seq_index.h"
+
+// Merges done by a point in the merge loop, for merges per second over time.
+typedef struct {
+  double seconds;
+  int merges;
+} MergeRateSample;
+
+// Training telemetry, filled in by train_bpe when TrainOptions.stats is set
+// and written out as JSON. Phase times are wall-clock seconds.
+typedef struct TrainStats {
+  double read_seconds;  // set by the caller
+  double sequence_init_seconds;
+  double pair_init_seconds;
+  double merge_seconds;
+  double writeback_seconds;
+
+  MergeRateSample *rate;
+  int rate_count;
+  int rate_capacity;
+
+  int merges;
+  int vocab_size;
+  SeqIndex initial_length;
+  SeqIndex final_length;
+
+  uint64_t queue_pops;
+  uint64_t queue_updates;
+  uint64_t queue_removes;
+
+  uint64_t map_lookups;
+  uint64_t map_probes;
+  int map_longest_probe;
+  int map_rehashes;
+  int map_capacity;
+  int map_size;
+
+  int pair_entries_high_water;
+  int pair_capacity;
+  SeqIndex occ_slots;
+  SeqIndex occ_live_high_water;
+  SeqIndex merge_sites_high_water;
+
+  long peak_rss_kb;
+} TrainStats;
+
+void train_stats_init(TrainStats *stats);
+void free_train_stats(TrainStats *stats);
+double train_stats_clock(void);
+void train_stats_add_rate(TrainStats *stats, double seconds, int merges);
+int write_train_stats(const char *path, const TrainStats *stats);
+
+// One JSON object per line: rank, pair ids, new id, its bytes, the pair's
+// count and seconds into the merge loop.
+void write_merge_log_entry(FILE *log, int rank, int left, int right, int token, const uint8_t *bytes,
+                           int length, SeqIndex count, double seconds);
+
+#endif  // TRAIN_STATS_H
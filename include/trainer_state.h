@@ -0,0 +1,149 @@
+#ifndef TRAINER_STATE_H
+#define TRAINER_STATE_H
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "merge_rules.h"
+#include "pair_heap.h"
+#include "pair_queue.h"
+#include "sequence.h"
+#include "train.h"
+
+// A node merged into its left neighbour has prev == NODE_DEAD; the head of a
+// list has prev == -1.
+#define NODE_DEAD ((SeqIndex)-2)
+
+// Lookup, probe and rehash counts are kept for training telemetry; only
+// pair_map_lookup() leaves them alone, so it is safe from worker threads.
+typedef struct {
+  uint64_t *keys;
+  int *values;
+  int capacity;
+  int size;
+  Arena *arena;
+
+  uint64_t lookups;
+  uint64_t probes;
+  int longest_probe;
+  int rehashes;
+} PairMap;
+
+typedef struct {
+  SeqIndex *first_node;
+  SeqIndex count;
+  SeqIndex *order;
+  SeqIndex order_len;
+} ChunkIndex;
+
+// Live training state as saved by a checkpoint. Plain mode keeps the live
+// sequence as one chunk with no weights; pre-tokenized mode keeps each unique
+// chunk with its weight, plus the corpus order.
+typedef struct TrainerSnapshot {
+  int *tokens;
+  SeqIndex token_count;
+  SeqIndex *chunk_lengths;
+  SeqIndex *chunk_weights;
+  SeqIndex chunk_count;
+  SeqIndex *order;
+  SeqIndex order_len;
+  SeqIndex live_count;
+  SeqIndex initial_length;
+} TrainerSnapshot;
+
+// Nodes are stored column-wise so each merge step only streams the columns it
+// reads. Token ids are 16-bit while the target vocab fits, else tokens32 is
+// used. Occurrence slot i describes the pair whose left node is i, and
+// occ_pair[i] is -1 when node i starts no pair. The columns and pair tables
+// live in arena, so a state must not be moved once initialised.
+typedef struct {
+  Arena arena;
+  SeqIndex node_count;
+  uint16_t *tokens16;
+  int *tokens32;
+  SeqIndex *prev;
+  SeqIndex *next;
+  SeqIndex *weights;
+  SeqIndex head;
+  SeqIndex live_count;
+
+  int *occ_pair;
+  SeqIndex *occ_prev;
+  SeqIndex *occ_next;
+
+  // Pre-tokenized mode: nodes hold each unique chunk once, and order lists the
+  // unique chunk behind every chunk of the corpus.
+  ChunkIndex chunks;
+
+  PairEntry *pairs;
+  int pair_count;
+  int pair_capacity;
+  int pair_free_head;
+
+  PairMap map;
+  PairQueue queue;
+
+  // Serial merges leave count changes pending until trainer_flush_counts(),
+  // so a pair touched by many occurrences moves in the queue once.
+  SeqIndex *count_delta;
+  uint8_t *dirty_mark;
+  int *dirty;
+  int dirty_count;
+
+  SeqIndex *merge_sites;
+  SeqIndex merge_sites_capacity;
+  SeqIndex merge_sites_peak;
+  struct MergeWorkers *workers;
+} TrainerState;
+
+static inline uint64_t make_pair_key(int left, int right) {
+  return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
+}
+
+static inline uint64_t hash64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline int node_token(const TrainerState *state, SeqIndex node_index) {
+  return state->tokens16 ? state->tokens16[node_index] : state->tokens32[node_index];
+}
+
+static inline void node_set_token(TrainerState *state, SeqIndex node_index, int token_id) {
+  if (state->tokens16)
+    state->tokens16[node_index] = (uint16_t)token_id;
+  else
+    state->tokens32[node_index] = token_id;
+}
+
+static inline int node_active(const TrainerState *state, SeqIndex node_index) {
+  return state->prev[node_index] != NODE_DEAD;
+}
+
+static inline SeqIndex node_weight(const TrainerState *state, SeqIndex node_index) {
+  return state->weights ? state->weights[node_index] : 1;
+}
+
+// Nodes are built straight from the corpus bytes in text, which is only read
+// here. With seed_rules holding merges, the text is first encoded by them so
+// training continues after the existing merges.
+void trainer_state_init(TrainerState *state, const uint8_t *text, SeqIndex length, int vocab_limit,
+                        MergeRules *seed_rules, const TrainOptions *options);
+void trainer_state_restore(TrainerState *state, const TrainerSnapshot *snapshot, int vocab_limit,
+                           const TrainOptions *options);
+void trainer_state_free(TrainerState *state);
+void free_trainer_snapshot(TrainerSnapshot *snapshot);
+void trainer_merge_pair(TrainerState *state, int pair_index, int new_token_id);
+void trainer_flush_counts(TrainerState *state);
+int trainer_acquire_pair_entry(TrainerState *state);
+void trainer_release_pair_entry(TrainerState *state, int index);
+int pair_map_get(PairMap *map, uint64_t key);
+int pair_map_lookup(const PairMap *map, uint64_t key);
+void pair_map_set(PairMap *map, uint64_t key, int value);
+void pair_map_remove(PairMap *map, uint64_t key);
+
+#endif  // TRAINER_STATE_H
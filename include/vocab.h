@@ -1,17 +1,56 @@
 #ifndef VOCAB_H
 #define VOCAB_H
 
-#include "token.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Tokens up to VOCAB_INLINE_BYTES long are stored in their table entry; the
+// rest live back to back in one byte buffer shared by the vocabulary.
+#define VOCAB_INLINE_BYTES 12
+
+typedef struct {
+  uint32_t length;
+  union {
+    uint8_t bytes[VOCAB_INLINE_BYTES];  // length <= VOCAB_INLINE_BYTES
+    uint32_t offset;                    // into Vocabulary.bytes otherwise
+  };
+} VocabEntry;
 
 typedef struct {
-  Token *tokens;
+  VocabEntry *entries;
+  uint8_t *bytes;
+  size_t bytes_used;
+  size_t bytes_capacity;
   int size;
   int capacity;
 } Vocabulary;
 
 Vocabulary create_vocab(int max_size);
 void free_vocab(Vocabulary *vocab);
-int add_token(Vocabulary *vocab, uint8_t *bytes, int length);
+int add_token(Vocabulary *vocab, const uint8_t *bytes, int length);
+// Adds a token of length bytes and returns where to write them.
+uint8_t *append_token(Vocabulary *vocab, int length);
+// Adds count tokens whose bytes follow each other in bytes, sizing the
+// storage once.
+void add_tokens(Vocabulary *vocab, const uint32_t *lengths, int count, const uint8_t *bytes);
+// Adds the token spelled by left followed by right.
+int add_merged_token(Vocabulary *vocab, int left, int right);
+void reserve_vocab(Vocabulary *vocab, int capacity);
 void init_base_vocab(Vocabulary *vocab);
 
+static inline int vocab_token_length(const Vocabulary *vocab, int token) {
+  return (int)vocab->entries[token].length;
+}
+
+// Valid until the next token is added.
+static inline const uint8_t *vocab_token_bytes(const Vocabulary *vocab, int token) {
+  const VocabEntry *entry = &vocab->entries[token];
+  return entry->length <= VOCAB_INLINE_BYTES ? entry->bytes : vocab->bytes + entry->offset;
+}
+
+// Writes the token as [text] with unprintable bytes as \xNN, at most
+// 4 * length + 2 chars, and returns how many were written.
+size_t format_token(const Vocabulary *vocab, int token, char *out);
+void print_token(const Vocabulary *vocab, int token);
+
 #endif  // VOCAB_H
@@ -116,10 +116,7 @@ for (( i=0; i<NUM_SHARDS; i++ )); do
   else
     echo "Shard $shard_name already exists, skipping download"
   fi
-  echo "Extracting $shard_name..."
-  tar -xf "$shard_name"
  done
 
-echo "Concatenating extracted text files into ../openwebtext2.txt..."
-find . -type f -name '*.txt' -print0 | sort -z | xargs -0 cat > ../openwebtext2.txt
-echo "Done. Combined corpus available at $(cd .. && pwd)/openwebtext2.txt"
+# bpe streams documents straight out of the shards, so nothing is extracted.
+echo "Done. Train with: bpe -i '$(pwd)/*.tar.xz'"
@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+usage() {
+  cat <<EOT
+Usage: $0 [-w WORK_DIR]
+  -w WORK_DIR   Directory for the build, corpus and tokenizers (default: a fresh temp dir)
+
+Checks that encoding one long document across threads (interact --threads)
+gives the same token count as encoding it serially, for a plain and a
+--pretokenize tokenizer. The tools are built from a copy of the tree, so the
+checked-in objects are left alone.
+EOT
+}
+
+WORK_DIR=""
+
+while getopts "hw:" opt; do
+  case "$opt" in
+    h)
+      usage
+      exit 0
+      ;;
+    w)
+      WORK_DIR="$OPTARG"
+      ;;
+    *)
+      usage
+      exit 1
+      ;;
+  esac
+done
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+if [ -z "$WORK_DIR" ]; then
+  WORK_DIR="$(mktemp -d)"
+  trap 'rm -rf "$WORK_DIR"' EXIT
+else
+  mkdir -p "$WORK_DIR"
+fi
+BUILD_DIR="$WORK_DIR/build"
+CORPUS="$WORK_DIR/lines.txt"
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+echo "Building in $BUILD_DIR..."
+rm -rf "$BUILD_DIR"
+mkdir -p "$BUILD_DIR"
+cp -R "$ROOT/Makefile" "$ROOT/include" "$ROOT/src" "$BUILD_DIR/"
+make -C "$BUILD_DIR" -B bpe interact >/dev/null
+
+# Short lines joined by newline-tab runs put many piece cuts right after
+# whitespace, where a pre-tokenizer restarted on a piece would chunk
+# differently from one run over the whole text.
+echo "Generating $CORPUS..."
+awk 'BEGIN {
+  srand(3)
+  split("the prologue s of and x dog", words, " ")
+  for (line = 0; line < 400000; line++) {
+    n = 1 + int(rand() * 6)
+    for (i = 0; i < n; i++)
+      printf "%s%s", (i ? " " : ""), words[1 + int(rand() * 7)]
+    printf "\n\t"
+  }
+}' > "$CORPUS"
+
+token_count() {
+  "$BUILD_DIR/interact" "$@" | sed -n 's/^Token count: //p'
+}
+
+for mode in plain pretokenize; do
+  TOKENIZER="$WORK_DIR/$mode.bin"
+  FLAGS=()
+  if [ "$mode" = pretokenize ]; then
+    FLAGS=(-p)
+  fi
+  "$BUILD_DIR/bpe" -i "$CORPUS" -v 1000 ${FLAGS[@]+"${FLAGS[@]}"} -s "$TOKENIZER" >/dev/null 2>&1
+  SERIAL=$(token_count --load "$TOKENIZER" --encode "$CORPUS")
+  for threads in 2 3 4 7; do
+    PARALLEL=$(token_count --load "$TOKENIZER" --encode "$CORPUS" --threads "$threads")
+    if [ -z "$SERIAL" ] || [ "$SERIAL" != "$PARALLEL" ]; then
+      fail "$mode tokenizer: $SERIAL tokens serially, $PARALLEL with --threads $threads"
+    fi
+  done
+  echo "$mode: $SERIAL tokens serially and with 2, 3, 4 and 7 threads"
+done
+
+echo "PASS"
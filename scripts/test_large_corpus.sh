@@ -0,0 +1,134 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+usage() {
+  cat <<EOT
+Usage: $0 [-n] [-s SIZE] [-w WORK_DIR]
+  -n            Skip the exact training run on random bytes
+  -s SIZE       Size of the generated corpora, as accepted by head -c (default: 2200M)
+  -w WORK_DIR   Directory for the builds, corpora and tokenizers (default: a fresh temp dir)
+
+Checks that the default build refuses a corpus over 2 GiB with a hint to
+rebuild, then that a LARGE_CORPUS=1 build reads it, trains on a sample of it
+and encodes all of it. Then it trains exactly (no -p) with a tiny vocabulary on
+SIZE of random bytes, so the trainer holds more than 2^31 positions, and checks
+that encoding the corpus ends where training did. That run needs about 40
+bytes of memory per corpus byte, over 80 GB at the default size; the script
+stops early when less is available.
+
+Needs SIZE of free disk space. Both builds are made from copies of the tree,
+so the checked-in objects and your own build are left alone.
+EOT
+}
+
+SIZE="2200M"
+WORK_DIR=""
+EXACT=1
+
+while getopts "hns:w:" opt; do
+  case "$opt" in
+    h)
+      usage
+      exit 0
+      ;;
+    n)
+      EXACT=0
+      ;;
+    s)
+      SIZE="$OPTARG"
+      ;;
+    w)
+      WORK_DIR="$OPTARG"
+      ;;
+    *)
+      usage
+      exit 1
+      ;;
+  esac
+done
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+if [ -z "$WORK_DIR" ]; then
+  WORK_DIR="$(mktemp -d)"
+  trap 'rm -rf "$WORK_DIR"' EXIT
+else
+  mkdir -p "$WORK_DIR"
+fi
+CORPUS="$WORK_DIR/large.txt"
+TOKENIZER="$WORK_DIR/large.bin"
+EXACT_CORPUS="$WORK_DIR/random.bin"
+EXACT_TOKENIZER="$WORK_DIR/random-tokenizer.bin"
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# build DIR [MAKE ARGS...] builds bpe and interact from a copy of the tree.
+build() {
+  local dir="$1"
+  shift
+  rm -rf "$dir"
+  mkdir -p "$dir"
+  cp -R "$ROOT/Makefile" "$ROOT/include" "$ROOT/src" "$dir/"
+  make -C "$dir" -B "$@" bpe interact >/dev/null
+}
+
+# Repeated prose rather than a sparse file, so pre-tokenized chunks stay
+# short and the full-corpus pass encodes it a chunk at a time. yes dies of
+# SIGPIPE once head has enough.
+echo "Generating $SIZE corpus in $CORPUS..."
+{ yes "The quick brown fox jumps over the lazy dog, then naps in the sun." || true; } | head -c "$SIZE" > "$CORPUS"
+BYTES=$(stat -c %s "$CORPUS")
+if [ "$BYTES" -le 2147483647 ]; then
+  fail "corpus is $BYTES bytes; it has to be over 2 GiB"
+fi
+
+# Exact training keeps about 38 bytes per position (token, links and pair
+# slots), so check before spending time on the builds.
+if [ "$EXACT" = 1 ]; then
+  NEED_KB=$((BYTES / 1024 * 40))
+  AVAIL_KB=$(awk '/^MemAvailable:/ { print $2 }' /proc/meminfo)
+  if [ "$AVAIL_KB" -lt "$NEED_KB" ]; then
+    fail "the exact run needs about $((NEED_KB >> 20)) GiB of memory but $((AVAIL_KB >> 20)) GiB is available; pass -n to skip it"
+  fi
+fi
+
+echo "Default build: expecting the corpus to be refused..."
+build "$WORK_DIR/build"
+if OUTPUT=$("$WORK_DIR/build/bpe" -i "$CORPUS" -v 300 2>&1); then
+  fail "default build trained on a $BYTES byte corpus"
+fi
+echo "$OUTPUT" | grep -q "too large for this build; rebuild with LARGE_CORPUS=1" ||
+  fail "default build failed without the rebuild hint: $OUTPUT"
+
+echo "LARGE_CORPUS=1 build: training on a 1% sample..."
+LARGE_BUILD="$WORK_DIR/build-large"
+build "$LARGE_BUILD" LARGE_CORPUS=1
+# Every line repeats, so the leading sample counts tie and the first merge is
+# checked by encoding the whole corpus.
+OUTPUT=$("$LARGE_BUILD/bpe" -i "$CORPUS" -v 300 -p --sample 0.01 --sample-checks 1 -s "$TOKENIZER" 2>&1) ||
+  fail "LARGE_CORPUS=1 build could not train: $OUTPUT"
+echo "$OUTPUT" | grep -q "Text length: $BYTES bytes" || fail "corpus was not read in full: $OUTPUT"
+echo "$OUTPUT" | grep -q "Checked 1 close merge picks" || fail "the full corpus was not encoded: $OUTPUT"
+
+if [ "$EXACT" = 1 ]; then
+  echo "LARGE_CORPUS=1 build: exact training on $SIZE of random bytes..."
+  rm -f "$CORPUS"
+  # Random bytes leave nothing for -p to fold, and two merges keep the run
+  # short while every position stays in the trainer.
+  head -c "$SIZE" /dev/urandom > "$EXACT_CORPUS"
+  OUTPUT=$("$LARGE_BUILD/bpe" -i "$EXACT_CORPUS" -v 258 -s "$EXACT_TOKENIZER" 2>&1) ||
+    fail "LARGE_CORPUS=1 build could not train exactly: $OUTPUT"
+  echo "$OUTPUT" | grep -q "Trainer nodes: $BYTES x" || fail "the trainer did not hold every position: $OUTPUT"
+  FINAL=$(echo "$OUTPUT" | sed -n 's/^Final sequence length: //p')
+  ENCODED=$("$LARGE_BUILD/interact" --load "$EXACT_TOKENIZER" --encode "$EXACT_CORPUS" | sed -n 's/^Token count: //p')
+  if [ -z "$FINAL" ] || [ "$FINAL" != "$ENCODED" ]; then
+    fail "exact training ended with $FINAL tokens but encoding gives $ENCODED"
+  fi
+fi
+
+echo "PASS: $BYTES byte corpus refused by the default build, read and encoded with LARGE_CORPUS=1"
+if [ "$EXACT" = 1 ]; then
+  echo "PASS: exact training over $BYTES positions matches encoding"
+fi
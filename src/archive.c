@@ -0,0 +1,379 @@
+#define _POSIX_C_SOURCE 200809L
+#include "archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#ifdef BPE_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#define ARCHIVE_BUFFER (1 << 16)
+#define TAR_BLOCK 512
+#define TAR_MAX_NAME (1 << 20)
+
+typedef enum {
+  STREAM_PLAIN,
+  STREAM_PIPE,
+  STREAM_XZ
+} StreamKind;
+
+struct ArchiveStream {
+  StreamKind kind;
+  FILE *file;
+  int failed;
+#ifdef BPE_HAVE_LZMA
+  lzma_stream lzma;
+  uint8_t *in;
+  int finished;
+#endif
+};
+
+static const char *decoder_command(const uint8_t *magic, size_t len) {
+  if (len >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+    return "xz -dc";
+  if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    return "gzip -dc";
+  if (len >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+    return "zstd -dc";
+  if (len >= 3 && memcmp(magic, "BZh", 3) == 0)
+    return "bzip2 -dc";
+  return NULL;
+}
+
+// Single-quotes path for the shell.
+static char *pipe_command(const char *decoder, const char *path) {
+  size_t len = strlen(decoder) + 8;
+  for (const char *p = path; *p; p++)
+    len += *p == '\'' ? 4 : 1;
+  char *command = malloc(len);
+  if (command == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  char *out = command + sprintf(command, "%s -- '", decoder);
+  for (const char *p = path; *p; p++) {
+    if (*p == '\'') {
+      memcpy(out, "'\\''", 4);
+      out += 4;
+    } else {
+      *out++ = *p;
+    }
+  }
+  *out++ = '\'';
+  *out = '\0';
+  return command;
+}
+
+ArchiveStream *open_archive_stream(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", path);
+    return NULL;
+  }
+  uint8_t magic[6];
+  size_t magic_len = fread(magic, 1, sizeof(magic), file);
+  rewind(file);
+
+  ArchiveStream *stream = calloc(1, sizeof(ArchiveStream));
+  if (stream == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  stream->kind = STREAM_PLAIN;
+  stream->file = file;
+
+  const char *decoder = decoder_command(magic, magic_len);
+  if (decoder == NULL)
+    return stream;
+
+#ifdef BPE_HAVE_LZMA
+  if (strcmp(decoder, "xz -dc") == 0) {
+    lzma_stream init = LZMA_STREAM_INIT;
+    stream->lzma = init;
+    stream->in = malloc(ARCHIVE_BUFFER);
+    if (stream->in == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    if (lzma_stream_decoder(&stream->lzma, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+      fprintf(stderr, "Could not start xz decoder for %s\n", path);
+      fclose(file);
+      free(stream->in);
+      free(stream);
+      return NULL;
+    }
+    stream->kind = STREAM_XZ;
+    return stream;
+  }
+#endif
+
+  fclose(file);
+  char *command = pipe_command(decoder, path);
+  stream->kind = STREAM_PIPE;
+  stream->file = popen(command, "r");
+  free(command);
+  if (stream->file == NULL) {
+    fprintf(stderr, "Could not start decoder for %s\n", path);
+    free(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+#ifdef BPE_HAVE_LZMA
+static size_t xz_read(ArchiveStream *stream, uint8_t *buf, size_t len) {
+  lzma_stream *lzma = &stream->lzma;
+  lzma->next_out = buf;
+  lzma->avail_out = len;
+  while (lzma->avail_out > 0 && !stream->finished && !stream->failed) {
+    if (lzma->avail_in == 0 && !feof(stream->file)) {
+      lzma->next_in = stream->in;
+      lzma->avail_in = fread(stream->in, 1, ARCHIVE_BUFFER, stream->file);
+      if (ferror(stream->file))
+        stream->failed = 1;
+    }
+    lzma_ret ret = lzma_code(lzma, feof(stream->file) ? LZMA_FINISH : LZMA_RUN);
+    if (ret == LZMA_STREAM_END)
+      stream->finished = 1;
+    else if (ret != LZMA_OK)
+      stream->failed = 1;
+  }
+  return len - lzma->avail_out;
+}
+#endif
+
+size_t archive_stream_read(ArchiveStream *stream, uint8_t *buf, size_t len) {
+#ifdef BPE_HAVE_LZMA
+  if (stream->kind == STREAM_XZ)
+    return xz_read(stream, buf, len);
+#endif
+  size_t total = 0;
+  while (total < len) {
+    size_t got = fread(buf + total, 1, len - total, stream->file);
+    if (got == 0)
+      break;
+    total += got;
+  }
+  if (ferror(stream->file))
+    stream->failed = 1;
+  return total;
+}
+
+int close_archive_stream(ArchiveStream *stream) {
+  int result = stream->failed ? -1 : 0;
+  if (stream->kind == STREAM_PIPE) {
+    int status = pclose(stream->file);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      result = -1;
+  } else {
+    fclose(stream->file);
+  }
+#ifdef BPE_HAVE_LZMA
+  if (stream->kind == STREAM_XZ) {
+    if (!stream->finished)
+      result = -1;
+    lzma_end(&stream->lzma);
+    free(stream->in);
+  }
+#endif
+  free(stream);
+  return result;
+}
+
+static int ends_with(const char *s, const char *suffix) {
+  size_t len = strlen(s);
+  size_t suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+int is_tar_path(const char *path) {
+  static const char *suffixes[] = {".tar", ".tar.xz", ".txz", ".tar.gz", ".tgz", ".tar.zst", ".tar.bz2"};
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    if (ends_with(path, suffixes[i]))
+      return 1;
+  }
+  return 0;
+}
+
+// Octal, or base-256 when the top bit of the first byte is set.
+static uint64_t tar_number(const uint8_t *field, size_t len) {
+  uint64_t value = 0;
+  if (field[0] & 0x80) {
+    value = field[0] & 0x7f;
+    for (size_t i = 1; i < len; i++)
+      value = (value << 8) | field[i];
+    return value;
+  }
+  size_t i = 0;
+  while (i < len && field[i] == ' ')
+    i++;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    value = (value << 3) | (uint64_t)(field[i] - '0');
+  return value;
+}
+
+static int tar_checksum_ok(const uint8_t *block) {
+  uint64_t sum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++)
+    sum += (i >= 148 && i < 156) ? ' ' : block[i];
+  return sum == tar_number(block + 148, 8);
+}
+
+static int tar_skip(ArchiveStream *stream, uint64_t bytes) {
+  uint8_t scratch[4096];
+  while (bytes > 0) {
+    size_t chunk = bytes < sizeof(scratch) ? (size_t)bytes : sizeof(scratch);
+    if (archive_stream_read(stream, scratch, chunk) != chunk)
+      return -1;
+    bytes -= chunk;
+  }
+  return 0;
+}
+
+static char *tar_read_text(ArchiveStream *stream, uint64_t size) {
+  if (size > TAR_MAX_NAME)
+    return NULL;
+  uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+  char *text = malloc((size_t)padded + 1);
+  if (text == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  if (archive_stream_read(stream, (uint8_t *)text, (size_t)padded) != padded) {
+    free(text);
+    return NULL;
+  }
+  text[size] = '\0';
+  return text;
+}
+
+// pax records are "<len> <key>=<value>\n"; only path and size matter here.
+static void tar_parse_pax(const char *records, size_t len, char **path, uint64_t *size) {
+  const char *p = records;
+  const char *end = records + len;
+  while (p < end) {
+    char *space;
+    unsigned long record_len = strtoul(p, &space, 10);
+    if (record_len == 0 || *space != ' ' || p + record_len > end)
+      return;
+    const char *key = space + 1;
+    const char *value_end = p + record_len - 1;
+    const char *eq = memchr(key, '=', (size_t)(value_end - key));
+    if (eq != NULL) {
+      size_t key_len = (size_t)(eq - key);
+      if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+        size_t value_len = (size_t)(value_end - eq - 1);
+        free(*path);
+        *path = malloc(value_len + 1);
+        if (*path == NULL) {
+          fprintf(stderr, "Memory allocation failed\n");
+          exit(1);
+        }
+        memcpy(*path, eq + 1, value_len);
+        (*path)[value_len] = '\0';
+      } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+        *size = strtoull(eq + 1, NULL, 10);
+      }
+    }
+    p += record_len;
+  }
+}
+
+static int read_tar_stream(ArchiveStream *stream, const char *path, const TarVisitor *visitor) {
+  uint8_t block[TAR_BLOCK];
+  char name[256 + 1];
+  char *long_name = NULL;
+  uint64_t pax_size = UINT64_MAX;
+  int result = 0;
+
+  while (result == 0) {
+    if (archive_stream_read(stream, block, TAR_BLOCK) != TAR_BLOCK) {
+      fprintf(stderr, "Truncated tar archive: %s\n", path);
+      result = -1;
+      break;
+    }
+    int zero = 1;
+    for (int i = 0; i < TAR_BLOCK && zero; i++)
+      zero = block[i] == 0;
+    if (zero)
+      break;
+    if (!tar_checksum_ok(block)) {
+      fprintf(stderr, "Not a tar archive or corrupt header: %s\n", path);
+      result = -1;
+      break;
+    }
+
+    uint64_t size = pax_size != UINT64_MAX ? pax_size : tar_number(block + 124, 12);
+    uint64_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    char type = (char)block[156];
+
+    if (type == 'L' || type == 'x') {
+      char *text = tar_read_text(stream, size);
+      if (text == NULL) {
+        fprintf(stderr, "Bad extended header in tar archive: %s\n", path);
+        result = -1;
+        break;
+      }
+      if (type == 'L') {
+        free(long_name);
+        long_name = text;
+      } else {
+        tar_parse_pax(text, (size_t)size, &long_name, &pax_size);
+        free(text);
+      }
+      continue;
+    }
+
+    const char *member = long_name;
+    if (member == NULL) {
+      int ustar = memcmp(block + 257, "ustar", 5) == 0;
+      if (ustar && block[345] != '\0')
+        snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)block + 345, (const char *)block);
+      else
+        snprintf(name, sizeof(name), "%.100s", (const char *)block);
+      member = name;
+    }
+
+    uint8_t *dest = NULL;
+    if (type == '0' || type == '\0' || type == '7')
+      dest = visitor->member_start(visitor->ctx, member, size);
+    if (dest != NULL) {
+      if (archive_stream_read(stream, dest, (size_t)size) != size) {
+        fprintf(stderr, "Truncated tar member %s in %s\n", member, path);
+        result = -1;
+        break;
+      }
+      visitor->member_end(visitor->ctx, size);
+      result = tar_skip(stream, padding);
+    } else {
+      result = tar_skip(stream, size + padding);
+    }
+    if (result != 0)
+      fprintf(stderr, "Truncated tar archive: %s\n", path);
+
+    free(long_name);
+    long_name = NULL;
+    pax_size = UINT64_MAX;
+  }
+  free(long_name);
+
+  // Drain the trailer so a piped decoder exits cleanly.
+  uint8_t scratch[4096];
+  while (result == 0 && archive_stream_read(stream, scratch, sizeof(scratch)) == sizeof(scratch)) {
+  }
+  return result;
+}
+
+int read_tar(const char *path, const TarVisitor *visitor) {
+  ArchiveStream *stream = open_archive_stream(path);
+  if (stream == NULL)
+    return -1;
+  int result = read_tar_stream(stream, path, visitor);
+  if (close_archive_stream(stream) != 0 && result == 0) {
+    fprintf(stderr, "Failed to decode %s\n", path);
+    result = -1;
+  }
+  return result;
+}
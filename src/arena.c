@@ -0,0 +1,86 @@
+#define _DEFAULT_SOURCE
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+int arena_init(Arena *arena) {
+  memset(arena, 0, sizeof(*arena));
+  if (sizeof(size_t) < 8)
+    return -1;
+
+  size_t bytes = ARENA_SLICE_BYTES * ARENA_SLICES;
+  void *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    return -1;
+#ifdef MADV_HUGEPAGE
+  madvise(base, bytes, MADV_HUGEPAGE);
+#endif
+
+  arena->base = base;
+  arena->slice_bytes = ARENA_SLICE_BYTES;
+  arena->slice_count = ARENA_SLICES;
+  return 0;
+}
+
+void arena_free(Arena *arena) {
+  if (arena->base != NULL)
+    munmap(arena->base, arena->slice_bytes * arena->slice_count);
+  memset(arena, 0, sizeof(*arena));
+}
+
+static int arena_slice_of(const Arena *arena, const void *ptr) {
+  if (arena == NULL || arena->base == NULL || ptr == NULL)
+    return -1;
+  uintptr_t offset = (uintptr_t)ptr - (uintptr_t)arena->base;
+  if ((uintptr_t)ptr < (uintptr_t)arena->base || offset >= arena->slice_bytes * arena->slice_count)
+    return -1;
+  return (int)(offset / arena->slice_bytes);
+}
+
+void *arena_alloc(Arena *arena, size_t bytes) {
+  if (arena == NULL || arena->base == NULL || bytes > arena->slice_bytes)
+    return malloc(bytes > 0 ? bytes : 1);
+
+  int slice;
+  if (arena->free_count > 0)
+    slice = arena->free_slices[--arena->free_count];
+  else if (arena->next_slice < arena->slice_count)
+    slice = arena->next_slice++;
+  else
+    return malloc(bytes > 0 ? bytes : 1);
+  return arena->base + (size_t)slice * arena->slice_bytes;
+}
+
+void *arena_realloc(Arena *arena, void *ptr, size_t old_bytes, size_t new_bytes) {
+  if (ptr == NULL)
+    return arena_alloc(arena, new_bytes);
+
+  int slice = arena_slice_of(arena, ptr);
+  if (slice == -1)
+    return realloc(ptr, new_bytes > 0 ? new_bytes : 1);
+  if (new_bytes <= arena->slice_bytes)
+    return ptr;
+
+  // Outgrew its slice: move to the heap once.
+  void *moved = malloc(new_bytes);
+  if (moved == NULL)
+    return NULL;
+  memcpy(moved, ptr, old_bytes);
+  arena_release(arena, ptr);
+  return moved;
+}
+
+// Slice pages go back to the kernel right away; the slice is reused by the
+// next allocation and reads as zeros.
+void arena_release(Arena *arena, void *ptr) {
+  int slice = arena_slice_of(arena, ptr);
+  if (slice == -1) {
+    free(ptr);
+    return;
+  }
+  madvise(arena->base + (size_t)slice * arena->slice_bytes, arena->slice_bytes, MADV_DONTNEED);
+  arena->free_slices[arena->free_count++] = slice;
+}
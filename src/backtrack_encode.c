@@ -0,0 +1,280 @@
+#include "backtrack_encode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Trie edges live in one open-addressed table keyed by (node, byte) + 1, so
+// an empty slot is 0. node_token holds the token spelled by each node, or -1.
+struct BacktrackEncoder {
+  MergeRules *rules;
+  int token_count;
+  int *token_len;
+  int *split_left;
+  int *split_right;
+  int *next_prefix;  // longest shorter token the token starts with, or -1
+
+  uint64_t *edge_keys;
+  int *edge_child;
+  int edge_capacity;
+  int *node_token;
+  int node_count;
+};
+
+static void *checked_malloc(size_t bytes) {
+  void *ptr = malloc(bytes > 0 ? bytes : 1);
+  if (ptr == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  return ptr;
+}
+
+static inline uint64_t edge_key(int node, uint8_t byte) {
+  return (((uint64_t)node << 8) | byte) + 1;
+}
+
+static inline uint64_t edge_hash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline int trie_child(const BacktrackEncoder *encoder, int node, uint8_t byte) {
+  uint64_t key = edge_key(node, byte);
+  int mask = encoder->edge_capacity - 1;
+  int idx = (int)(edge_hash(key) & mask);
+  while (encoder->edge_keys[idx] != 0) {
+    if (encoder->edge_keys[idx] == key)
+      return encoder->edge_child[idx];
+    idx = (idx + 1) & mask;
+  }
+  return -1;
+}
+
+static void trie_insert(BacktrackEncoder *encoder, const uint8_t *bytes, int length, int token) {
+  int node = 0;
+  int mask = encoder->edge_capacity - 1;
+  for (int i = 0; i < length; i++) {
+    uint64_t key = edge_key(node, bytes[i]);
+    int idx = (int)(edge_hash(key) & mask);
+    while (encoder->edge_keys[idx] != 0 && encoder->edge_keys[idx] != key)
+      idx = (idx + 1) & mask;
+    if (encoder->edge_keys[idx] == 0) {
+      encoder->edge_keys[idx] = key;
+      encoder->edge_child[idx] = encoder->node_count;
+      encoder->node_token[encoder->node_count++] = -1;
+    }
+    node = encoder->edge_child[idx];
+  }
+  encoder->node_token[node] = token;
+}
+
+// Longest token spelled by text[pos..len); every byte is a token, so there
+// is always one.
+static int longest_match(const BacktrackEncoder *encoder, const uint8_t *text, SeqIndex pos, SeqIndex len) {
+  int node = 0;
+  int best = -1;
+  for (SeqIndex i = pos; i < len; i++) {
+    node = trie_child(encoder, node, text[i]);
+    if (node == -1)
+      break;
+    if (encoder->node_token[node] != -1)
+      best = encoder->node_token[node];
+  }
+  return best;
+}
+
+// Replays the merges of both tokens backwards, most recent first. If at any
+// point a merge across the boundary would have come before the merge just
+// undone, or before limit, BPE would never have left left and right side by
+// side. Base tokens split into themselves; token ids follow merge order.
+static int pair_fits(const BacktrackEncoder *encoder, int left, int right, uint32_t limit) {
+  uint32_t token1 = (uint32_t)left;
+  uint32_t token2 = (uint32_t)right;
+  while (1) {
+    int rank = merge_rank_after(encoder->rules, (int)token1, (int)token2, -1);
+    if (rank != -1 && (uint32_t)(256 + rank) < limit)
+      return 0;
+    if (token1 > token2) {
+      limit = token1;
+      token1 = (uint32_t)encoder->split_right[token1];
+      if (token1 == limit) {
+        limit = token2 + 1;
+        token2 = (uint32_t)encoder->split_left[token2];
+        if (token2 + 1 == limit)
+          return 1;
+      }
+    } else {
+      limit = token2 + 1;
+      token2 = (uint32_t)encoder->split_left[token2];
+      if (token2 + 1 == limit) {
+        limit = token1;
+        token1 = (uint32_t)encoder->split_right[token1];
+        if (token1 == limit)
+          return 1;
+      }
+    }
+  }
+}
+
+int backtrack_valid_pair(const BacktrackEncoder *encoder, int left, int right) {
+  return pair_fits(encoder, left, right, UINT32_MAX);
+}
+
+BacktrackEncoder *create_backtrack_encoder(const Vocabulary *vocab, MergeRules *rules) {
+  if (vocab->size != 256 + rules->num_rules)
+    return NULL;
+  for (int i = 0; i < 256; i++) {
+    if (vocab_token_length(vocab, i) != 1 || vocab_token_bytes(vocab, i)[0] != i)
+      return NULL;
+  }
+  for (int r = 0; r < rules->num_rules; r++) {
+    const MergeRule *rule = &rules->rules[r];
+    if (rule->result_token != 256 + r || rule->token1 < 0 || rule->token1 >= 256 + r || rule->token2 < 0 ||
+        rule->token2 >= 256 + r)
+      return NULL;
+  }
+  if (rules->rank_map.keys == NULL)
+    build_merge_ranks(rules);
+  for (int r = 0; r < rules->num_rules; r++) {
+    if (rules->rank_map.next_same[r] != -1)
+      return NULL;
+  }
+
+  BacktrackEncoder *encoder = calloc(1, sizeof(BacktrackEncoder));
+  if (encoder == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  int n = vocab->size;
+  encoder->rules = rules;
+  encoder->token_count = n;
+  encoder->token_len = checked_malloc(sizeof(int) * (size_t)n);
+  encoder->split_left = checked_malloc(sizeof(int) * (size_t)n);
+  encoder->split_right = checked_malloc(sizeof(int) * (size_t)n);
+  encoder->next_prefix = checked_malloc(sizeof(int) * (size_t)n);
+
+  size_t total_bytes = 0;
+  for (int t = 0; t < n; t++) {
+    encoder->token_len[t] = vocab_token_length(vocab, t);
+    encoder->split_left[t] = t < 256 ? t : rules->rules[t - 256].token1;
+    encoder->split_right[t] = t < 256 ? t : rules->rules[t - 256].token2;
+    total_bytes += (size_t)encoder->token_len[t];
+  }
+  int edge_capacity = 16;
+  while ((size_t)edge_capacity < total_bytes * 2)
+    edge_capacity <<= 1;
+  encoder->edge_capacity = edge_capacity;
+  encoder->edge_keys = calloc((size_t)edge_capacity, sizeof(uint64_t));
+  encoder->edge_child = checked_malloc(sizeof(int) * (size_t)edge_capacity);
+  encoder->node_token = checked_malloc(sizeof(int) * (total_bytes + 1));
+  if (encoder->edge_keys == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  encoder->node_token[0] = -1;
+  encoder->node_count = 1;
+
+  // A token whose own bytes encode to something else never appears in any
+  // encoding, so it is left out of the trie. A token encodes to itself when
+  // both halves do and no merge across them comes before its own.
+  uint8_t *reachable = checked_malloc((size_t)n);
+  for (int t = 0; t < n; t++) {
+    int left = encoder->split_left[t];
+    int right = encoder->split_right[t];
+    reachable[t] = t < 256 || (reachable[left] && reachable[right] && pair_fits(encoder, left, right, (uint32_t)t));
+    if (reachable[t])
+      trie_insert(encoder, vocab_token_bytes(vocab, t), encoder->token_len[t], t);
+  }
+  free(reachable);
+
+  for (int t = 0; t < n; t++) {
+    const uint8_t *bytes = vocab_token_bytes(vocab, t);
+    int node = 0;
+    encoder->next_prefix[t] = -1;
+    for (int i = 0; i + 1 < encoder->token_len[t] && node != -1; i++) {
+      node = trie_child(encoder, node, bytes[i]);
+      if (node != -1 && encoder->node_token[node] != -1)
+        encoder->next_prefix[t] = encoder->node_token[node];
+    }
+  }
+  return encoder;
+}
+
+void free_backtrack_encoder(BacktrackEncoder *encoder) {
+  if (encoder == NULL)
+    return;
+  free(encoder->token_len);
+  free(encoder->split_left);
+  free(encoder->split_right);
+  free(encoder->next_prefix);
+  free(encoder->edge_keys);
+  free(encoder->edge_child);
+  free(encoder->node_token);
+  free(encoder);
+}
+
+// Greedy longest match, shortened token by token until it fits after the
+// previous one and ends at a position not yet known to be a dead end. When
+// no prefix fits, the previous token is taken back and its start marked dead
+// for the rest of the call, which bounds the work by the text length.
+// Encodes text[start, end) and appends the tokens after the first count.
+static SeqIndex backtrack_span(const BacktrackEncoder *encoder, const uint8_t *text, SeqIndex start, SeqIndex end,
+                               uint64_t *open, int *tokens, SeqIndex count) {
+  SeqIndex first = count;
+  SeqIndex pos = start;
+  int next = longest_match(encoder, text, start, end);
+  while (next != -1) {
+    int token = next;
+    int last = count > first ? tokens[count - 1] : -1;
+    while (1) {
+      SeqIndex token_end = pos + encoder->token_len[token];
+      if ((open[token_end / 64] >> (token_end % 64) & 1) &&
+          (last == -1 || backtrack_valid_pair(encoder, last, token))) {
+        tokens[count++] = token;
+        pos = token_end;
+        next = pos < end ? longest_match(encoder, text, pos, end) : -1;
+        break;
+      }
+      if (encoder->next_prefix[token] != -1) {
+        token = encoder->next_prefix[token];
+        continue;
+      }
+      open[pos / 64] &= ~(UINT64_C(1) << (pos % 64));
+      count--;
+      pos -= encoder->token_len[last];
+      next = last;
+      break;
+    }
+  }
+  return count;
+}
+
+// Pretokenized rules never merge across a chunk, so each piece between cuts
+// is encoded on its own; otherwise the whole text is one span.
+TokenSequence backtrack_encode(const BacktrackEncoder *encoder, const uint8_t *text, SeqIndex text_len) {
+  TokenSequence seq = create_sequence(text_len > 0 ? text_len : 1);
+  if (text_len == 0)
+    return seq;
+  size_t words = (size_t)text_len / 64 + 1;
+  uint64_t *open = checked_malloc(sizeof(uint64_t) * words);
+  memset(open, 0xff, sizeof(uint64_t) * words);
+
+  SeqIndex count = 0;
+  if (encoder->rules->pretokenize) {
+    TextCutter cutter;
+    text_cutter_init(&cutter, encoder->rules, text, text_len);
+    for (SeqIndex start = 0; start < text_len;) {
+      SeqIndex end = text_cutter_next(&cutter, start + 1);
+      count = backtrack_span(encoder, text, start, end, open, seq.tokens, count);
+      start = end;
+    }
+  } else {
+    count = backtrack_span(encoder, text, 0, text_len, open, seq.tokens, 0);
+  }
+  seq.length = count;
+  free(open);
+  return seq;
+}
@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+#include "io.h"
+#include "seq_kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Benchmarks every sequence kernel version the CPU supports against the
+// scalar one and checks that they agree.
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void *checked_malloc(size_t bytes) {
+  void *ptr = malloc(bytes > 0 ? bytes : 1);
+  if (ptr == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  return ptr;
+}
+
+// Word-like filler for when no corpus is given.
+static void fill_text(uint8_t *text, SeqIndex n) {
+  static const char *words[] = {"the ", "and ", "of ", "to ", "in ", "that ", "is ", "was ", "he ",
+                                "for ", "it ", "with ", "as ", "his ", "on ", "be ", "at ", "by ",
+                                "aaaa ", "\n\n", "BPE ", "tokenizer ", "merge ", ", ", ". "};
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  SeqIndex pos = 0;
+  while (pos < n) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    const char *word = words[(state >> 33) % (sizeof(words) / sizeof(words[0]))];
+    for (SeqIndex i = 0; word[i] != '\0' && pos < n; i++)
+      text[pos++] = (uint8_t)word[i];
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL;
+  long megabytes = 64;
+  int rounds = 5;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      megabytes = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      rounds = (int)strtol(argv[++i], NULL, 10);
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      fprintf(stderr, "Usage: %s [FILE] [-n MB] [-r ROUNDS]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (megabytes <= 0 || rounds <= 0) {
+    fprintf(stderr, "-n and -r must be positive\n");
+    return 1;
+  }
+
+  SeqIndex n = (SeqIndex)megabytes << 20;
+  uint8_t *text = checked_malloc((size_t)n);
+  if (path != NULL) {
+    Corpus corpus;
+    if (read_corpus(path, NULL, &corpus) != 0 || corpus.length == 0)
+      return 1;
+    for (SeqIndex pos = 0; pos < n; pos += corpus.length) {
+      SeqIndex len = n - pos < corpus.length ? n - pos : corpus.length;
+      memcpy(text + pos, corpus.text, (size_t)len);
+    }
+    free_corpus(&corpus);
+  } else {
+    fill_text(text, n);
+  }
+
+  int *expected = checked_malloc(sizeof(int) * (size_t)n);
+  int *tokens = checked_malloc(sizeof(int) * (size_t)n);
+  for (SeqIndex i = 0; i < n; i++)
+    expected[i] = text[i];
+
+  printf("Input: %s, %ld MB, %d rounds\n", path != NULL ? path : "synthetic text", megabytes, rounds);
+  printf("Default kernels: %s\n\n", seq_isa_name(seq_kernels_isa()));
+  printf("%-22s %-8s %10s %9s\n", "kernel", "isa", "GB/s", "speedup");
+
+  int failed = 0;
+  double scalar_rate = 0.0;
+  for (int isa = 0; isa < SEQ_ISA_COUNT; isa++) {
+    if (seq_kernels_use((SeqIsa)isa) != 0)
+      continue;
+    double best = 1e30;
+    for (int round = 0; round < rounds; round++) {
+      memset(tokens, 0, sizeof(int) * (size_t)n);
+      double started = now_seconds();
+      widen_bytes(text, tokens, n);
+      double seconds = now_seconds() - started;
+      if (seconds < best)
+        best = seconds;
+    }
+    if (memcmp(tokens, expected, sizeof(int) * (size_t)n) != 0) {
+      printf("widen %s: output differs from scalar\n", seq_isa_name((SeqIsa)isa));
+      failed = 1;
+    }
+    double rate = n / best / 1e9;
+    if (isa == SEQ_ISA_SCALAR)
+      scalar_rate = rate;
+    printf("%-22s %-8s %10.2f %8.2fx\n", "widen_bytes", seq_isa_name((SeqIsa)isa), rate, rate / scalar_rate);
+  }
+
+  free(tokens);
+  free(expected);
+  free(text);
+  return failed;
+}
@@ -0,0 +1,296 @@
+#include "checkpoint.h"
+#include "tokenizer_io.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_IO_BUFFER (1 << 20)
+#define TOKEN_BATCH 4096
+
+// The header's chunked flag says whether the state is a list of chunks
+// (--pretokenize or several documents) rather than one sequence; it is not the
+// tokenizer's --pretokenize flag, which the embedded tokenizer carries.
+// Layout after the header and the embedded tokenizer:
+//   u64 token_count, u64 chunk_count (0 for a single plain sequence)
+//   chunk_count x (u64 length, u64 weight)
+//   token_count x u32 token
+//   u64 order_len, order_len x chunk id (u32 unless chunk_count needs u64)
+
+static int write_u32(FILE *fp, uint32_t value) {
+  return fwrite(&value, sizeof(uint32_t), 1, fp) == 1 ? 0 : -1;
+}
+
+static int write_u64(FILE *fp, uint64_t value) {
+  return fwrite(&value, sizeof(uint64_t), 1, fp) == 1 ? 0 : -1;
+}
+
+static int read_u32(FILE *fp, uint32_t *value) {
+  return fread(value, sizeof(uint32_t), 1, fp) == 1 ? 0 : -1;
+}
+
+static int read_u64(FILE *fp, uint64_t *value) {
+  return fread(value, sizeof(uint64_t), 1, fp) == 1 ? 0 : -1;
+}
+
+static int read_index(FILE *fp, SeqIndex *value) {
+  uint64_t raw;
+  if (read_u64(fp, &raw) != 0 || raw > (uint64_t)SEQ_INDEX_MAX)
+    return -1;
+  *value = (SeqIndex)raw;
+  return 0;
+}
+
+static int wide_chunk_ids(SeqIndex chunk_count) {
+  return (uint64_t)chunk_count > UINT32_MAX;
+}
+
+typedef struct {
+  uint32_t values[TOKEN_BATCH];
+  int count;
+} TokenBatch;
+
+static int batch_flush(FILE *fp, TokenBatch *batch) {
+  size_t n = (size_t)batch->count;
+  batch->count = 0;
+  return fwrite(batch->values, sizeof(uint32_t), n, fp) == n ? 0 : -1;
+}
+
+static int batch_push(FILE *fp, TokenBatch *batch, uint32_t value) {
+  batch->values[batch->count++] = value;
+  return batch->count == TOKEN_BATCH ? batch_flush(fp, batch) : 0;
+}
+
+static SeqIndex list_length(const TrainerState *state, SeqIndex node) {
+  SeqIndex len = 0;
+  for (; node != -1; node = state->next[node])
+    len++;
+  return len;
+}
+
+static int write_state(FILE *fp, const TrainerState *state) {
+  const ChunkIndex *chunks = &state->chunks;
+  int chunked = chunks->first_node != NULL;
+  SeqIndex chunk_count = chunked ? chunks->count : 0;
+
+  SeqIndex token_count = 0;
+  if (chunked) {
+    for (SeqIndex id = 0; id < chunk_count; id++)
+      token_count += list_length(state, chunks->first_node[id]);
+  } else {
+    token_count = list_length(state, state->head);
+  }
+
+  if (write_u64(fp, (uint64_t)token_count) != 0 || write_u64(fp, (uint64_t)chunk_count) != 0)
+    return -1;
+
+  for (SeqIndex id = 0; id < chunk_count; id++) {
+    SeqIndex first = chunks->first_node[id];
+    if (write_u64(fp, (uint64_t)list_length(state, first)) != 0 ||
+        write_u64(fp, (uint64_t)node_weight(state, first)) != 0)
+      return -1;
+  }
+
+  TokenBatch *batch = malloc(sizeof(TokenBatch));
+  if (!batch) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  batch->count = 0;
+
+  int result = 0;
+  if (chunked) {
+    for (SeqIndex id = 0; id < chunk_count && result == 0; id++) {
+      for (SeqIndex idx = chunks->first_node[id]; idx != -1 && result == 0; idx = state->next[idx])
+        result = batch_push(fp, batch, (uint32_t)node_token(state, idx));
+    }
+  } else {
+    for (SeqIndex idx = state->head; idx != -1 && result == 0; idx = state->next[idx])
+      result = batch_push(fp, batch, (uint32_t)node_token(state, idx));
+  }
+  if (result == 0)
+    result = batch_flush(fp, batch);
+
+  SeqIndex order_len = chunked ? chunks->order_len : 0;
+  if (result == 0)
+    result = write_u64(fp, (uint64_t)order_len);
+  for (SeqIndex i = 0; i < order_len && result == 0; i++) {
+    if (wide_chunk_ids(chunk_count))
+      result = write_u64(fp, (uint64_t)chunks->order[i]);
+    else
+      result = batch_push(fp, batch, (uint32_t)chunks->order[i]);
+  }
+  if (result == 0)
+    result = batch_flush(fp, batch);
+
+  free(batch);
+  return result;
+}
+
+int save_checkpoint(const char *path, const Vocabulary *vocab, const MergeRules *rules,
+                    const TrainerState *state, int target_vocab_size, SeqIndex initial_length) {
+  size_t path_len = strlen(path);
+  char *tmp_path = malloc(path_len + 5);
+  if (!tmp_path) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", 5);
+
+  FILE *fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    perror("fopen");
+    free(tmp_path);
+    return -1;
+  }
+  setvbuf(fp, NULL, _IOFBF, CHECKPOINT_IO_BUFFER);
+
+  const uint8_t magic[4] = {'B', 'P', 'E', 'K'};
+  int result = fwrite(magic, 1, 4, fp) == 4 ? 0 : -1;
+  if (result == 0)
+    result = write_u32(fp, CHECKPOINT_VERSION);
+  if (result == 0)
+    result = write_u32(fp, (uint32_t)target_vocab_size);
+  if (result == 0)
+    result = write_u32(fp, state->chunks.first_node != NULL);
+  if (result == 0)
+    result = write_u64(fp, (uint64_t)initial_length);
+  if (result == 0)
+    result = write_tokenizer(fp, vocab, rules);
+  if (result == 0)
+    result = write_state(fp, state);
+
+  if (fclose(fp) != 0)
+    result = -1;
+  if (result == 0 && rename(tmp_path, path) != 0) {
+    perror("rename");
+    result = -1;
+  }
+  if (result != 0)
+    remove(tmp_path);
+  free(tmp_path);
+  return result;
+}
+
+static int read_state(FILE *fp, TrainerSnapshot *snapshot) {
+  SeqIndex chunk_count;
+  if (read_index(fp, &snapshot->token_count) != 0 || read_index(fp, &chunk_count) != 0)
+    return -1;
+
+  size_t token_count = (size_t)snapshot->token_count;
+  snapshot->tokens = malloc(sizeof(int) * (token_count > 0 ? token_count : 1));
+  if (!snapshot->tokens) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+
+  if (chunk_count > 0) {
+    snapshot->chunk_count = chunk_count;
+    snapshot->chunk_lengths = malloc(sizeof(SeqIndex) * (size_t)chunk_count);
+    snapshot->chunk_weights = malloc(sizeof(SeqIndex) * (size_t)chunk_count);
+    if (!snapshot->chunk_lengths || !snapshot->chunk_weights) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    SeqIndex total = 0;
+    for (SeqIndex id = 0; id < chunk_count; id++) {
+      if (read_index(fp, &snapshot->chunk_lengths[id]) != 0 ||
+          read_index(fp, &snapshot->chunk_weights[id]) != 0)
+        return -1;
+      total += snapshot->chunk_lengths[id];
+    }
+    if (total != snapshot->token_count)
+      return -1;
+  }
+
+  // Tokens are stored as u32, the same width as the int array they land in.
+  if (fread(snapshot->tokens, sizeof(uint32_t), token_count, fp) != token_count)
+    return -1;
+
+  if (read_index(fp, &snapshot->order_len) != 0)
+    return -1;
+  if (chunk_count == 0) {
+    snapshot->live_count = snapshot->token_count;
+    return snapshot->order_len == 0 ? 0 : -1;
+  }
+
+  snapshot->order = malloc(sizeof(SeqIndex) * (snapshot->order_len > 0 ? (size_t)snapshot->order_len : 1));
+  if (!snapshot->order) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  snapshot->live_count = 0;
+  for (SeqIndex i = 0; i < snapshot->order_len; i++) {
+    uint64_t id;
+    if (wide_chunk_ids(chunk_count)) {
+      if (read_u64(fp, &id) != 0)
+        return -1;
+    } else {
+      uint32_t narrow;
+      if (read_u32(fp, &narrow) != 0)
+        return -1;
+      id = narrow;
+    }
+    if (id >= (uint64_t)chunk_count)
+      return -1;
+    snapshot->order[i] = (SeqIndex)id;
+    snapshot->live_count += snapshot->chunk_lengths[id];
+  }
+  return 0;
+}
+
+int load_checkpoint(const char *path, Vocabulary *vocab_out, MergeRules *rules_out, Checkpoint *checkpoint) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+  setvbuf(fp, NULL, _IOFBF, CHECKPOINT_IO_BUFFER);
+  memset(checkpoint, 0, sizeof(*checkpoint));
+
+  uint8_t magic[4];
+  uint32_t version, target, chunked;
+  uint64_t initial_length;
+  if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "BPEK", 4) != 0) {
+    fprintf(stderr, "Invalid checkpoint file header\n");
+    fclose(fp);
+    return -1;
+  }
+  if (read_u32(fp, &version) != 0 || version != CHECKPOINT_VERSION) {
+    fprintf(stderr, "Unsupported checkpoint format version\n");
+    fclose(fp);
+    return -1;
+  }
+  if (read_u32(fp, &target) != 0 || read_u32(fp, &chunked) != 0 || read_u64(fp, &initial_length) != 0 ||
+      read_tokenizer(fp, vocab_out, rules_out) != 0) {
+    fclose(fp);
+    return -1;
+  }
+
+  checkpoint->target_vocab_size = (int)target;
+  checkpoint->snapshot.initial_length = (SeqIndex)initial_length;
+  int result = read_state(fp, &checkpoint->snapshot);
+  int has_chunks = checkpoint->snapshot.chunk_lengths != NULL;
+  if (result == 0 && ((chunked != 0) != has_chunks || (rules_out->pretokenize && !has_chunks)))
+    result = -1;
+  for (SeqIndex i = 0; result == 0 && i < checkpoint->snapshot.token_count; i++) {
+    if (checkpoint->snapshot.tokens[i] < 0 || checkpoint->snapshot.tokens[i] >= vocab_out->size)
+      result = -1;
+  }
+  fclose(fp);
+
+  if (result != 0) {
+    fprintf(stderr, "Truncated or corrupt checkpoint state\n");
+    free_checkpoint(checkpoint);
+    free_vocab(vocab_out);
+    free_merge_rules(rules_out);
+  }
+  return result;
+}
+
+void free_checkpoint(Checkpoint *checkpoint) {
+  free_trainer_snapshot(&checkpoint->snapshot);
+}
@@ -9,9 +9,32 @@ void print_usage(const char *progname) {
           "Usage: %s [options]\n\n"
           "Options:\n"
           "  -v, --vocab-size <N>   Target vocabulary size (default 512)\n"
-          "  -i, --input <PATH>     Training text file (default input.txt)\n"
-          "  -l, --load <FILE>      Load tokenizer (vocab + merges) from file\n"
+          "  -i, --input <PATH>     Training text: a file, a directory or a quoted glob, one\n"
+          "                         document per file or tar(.xz/.gz/.zst) member\n"
+          "                         (default input.txt)\n"
+          "      --input-list <FILE>        Also train on the files listed in FILE, one per line\n"
+          "  -l, --load <FILE>      Load tokenizer (vocab + merges) from file; with --input,\n"
+          "                         continue training it up to --vocab-size\n"
           "  -s, --save <FILE>      Save tokenizer (vocab + merges) after training\n"
+          "  -p, --pretokenize      Train on unique pre-tokenized chunks (no merges across words)\n"
+          "  -t, --threads <N>      Worker threads for parallel training phases (default 1)\n"
+          "  -q, --queue <KIND>     Pair priority queue: heap or buckets (default heap)\n"
+          "      --checkpoint <FILE>        Periodically save training state to FILE\n"
+          "      --checkpoint-every <N>     Checkpoint every N merges (default off)\n"
+          "      --checkpoint-seconds <T>   Checkpoint every T seconds (default 600)\n"
+          "      --resume <FILE>            Continue training from a checkpoint\n"
+          "      --snapshot-at <N,...>      Also save the tokenizer at these vocab sizes, as\n"
+          "                                 the --save path with -<N> before the extension\n"
+          "      --sample <F>               Approximate training on a fraction F of the corpus\n"
+          "      --sample-checks <N>        Check at most N close merge picks of --sample\n"
+          "                                 against the full corpus, one encoding pass of it\n"
+          "                                 each (default 8)\n"
+          "      --compare <FILE>           Report how the learned merges diverge from FILE\n"
+          "      --batch-merges <K>         Merge up to K non-interacting top pairs per step\n"
+          "      --verify-batches           Retrain one merge at a time and check the result\n"
+          "      --no-arena                 Grow trainer tables with realloc instead of in place\n"
+          "      --stats <FILE>             Write training telemetry to FILE as JSON\n"
+          "      --merge-log <FILE>         Write one JSON line per merge to FILE\n"
           "  -h, --help             Show this help message\n",
           progname);
 }
@@ -25,11 +48,59 @@ static int parse_int(const char *value, int *out) {
   return 0;
 }
 
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// Parses a comma-separated list of vocab sizes, sorted and deduplicated.
+static int parse_snapshot_sizes(const char *value, CliOptions *options) {
+  int count = 0;
+  const char *p = value;
+  while (1) {
+    char *end;
+    long v = strtol(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0') || v <= 256 || v > (1L << 24) || count >= MAX_SNAPSHOTS)
+      return -1;
+    options->snapshot_sizes[count++] = (int)v;
+    if (*end == '\0')
+      break;
+    p = end + 1;
+  }
+
+  qsort(options->snapshot_sizes, count, sizeof(int), compare_ints);
+  int unique = 0;
+  for (int i = 0; i < count; i++) {
+    if (unique == 0 || options->snapshot_sizes[unique - 1] != options->snapshot_sizes[i])
+      options->snapshot_sizes[unique++] = options->snapshot_sizes[i];
+  }
+  options->snapshot_count = unique;
+  return 0;
+}
+
 int parse_cli_args(int argc, char **argv, CliOptions *options) {
   options->target_vocab_size = 512;
-  options->input_path = "input.txt";
+  options->input_path = NULL;
+  options->input_list_path = NULL;
   options->load_path = NULL;
   options->save_path = NULL;
+  options->pretokenize = 0;
+  options->threads = 1;
+  options->queue = PAIR_QUEUE_HEAP;
+  options->checkpoint_path = NULL;
+  options->checkpoint_every = 0;
+  options->checkpoint_seconds = 600;
+  options->resume_path = NULL;
+  options->snapshot_count = 0;
+  options->sample_fraction = 1.0;
+  options->sample_checks = 8;
+  options->compare_path = NULL;
+  options->batch_merges = 1;
+  options->verify_batches = 0;
+  options->use_arena = 1;
+  options->stats_path = NULL;
+  options->merge_log_path = NULL;
 
   for (int i = 1; i < argc; ++i) {
     const char *arg = argv[i];
@@ -54,6 +125,13 @@ int parse_cli_args(int argc, char **argv, CliOptions *options) {
         return -1;
       }
       options->input_path = argv[++i];
+    } else if (strcmp(arg, "--input-list") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      options->input_list_path = argv[++i];
     } else if (strcmp(arg, "-l") == 0 || strcmp(arg, "--load") == 0) {
       if (i + 1 >= argc) {
         fprintf(stderr, "Error: missing value for %s\n", arg);
@@ -68,6 +146,129 @@ int parse_cli_args(int argc, char **argv, CliOptions *options) {
         return -1;
       }
       options->save_path = argv[++i];
+    } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--pretokenize") == 0) {
+      options->pretokenize = 1;
+    } else if (strcmp(arg, "-t") == 0 || strcmp(arg, "--threads") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      if (parse_int(argv[++i], &options->threads) != 0) {
+        fprintf(stderr, "Error: invalid thread count '%s'\n", argv[i]);
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--queue") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      const char *kind = argv[++i];
+      if (strcmp(kind, "heap") == 0) {
+        options->queue = PAIR_QUEUE_HEAP;
+      } else if (strcmp(kind, "buckets") == 0) {
+        options->queue = PAIR_QUEUE_BUCKETS;
+      } else {
+        fprintf(stderr, "Error: unknown queue '%s'\n", kind);
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (strcmp(arg, "--checkpoint") == 0 || strcmp(arg, "--resume") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      if (strcmp(arg, "--checkpoint") == 0)
+        options->checkpoint_path = argv[++i];
+      else
+        options->resume_path = argv[++i];
+    } else if (strcmp(arg, "--checkpoint-every") == 0 || strcmp(arg, "--checkpoint-seconds") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      int *out = strcmp(arg, "--checkpoint-every") == 0 ? &options->checkpoint_every
+                                                          : &options->checkpoint_seconds;
+      if (parse_int(argv[++i], out) != 0) {
+        fprintf(stderr, "Error: invalid value '%s' for %s\n", argv[i], arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (strcmp(arg, "--snapshot-at") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      if (parse_snapshot_sizes(argv[++i], options) != 0) {
+        fprintf(stderr, "Error: invalid snapshot sizes '%s'\n", argv[i]);
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (strcmp(arg, "--sample") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      char *end;
+      options->sample_fraction = strtod(argv[++i], &end);
+      if (*end != '\0' || !(options->sample_fraction > 0.0 && options->sample_fraction <= 1.0)) {
+        fprintf(stderr, "Error: sample fraction must be in (0, 1], got '%s'\n", argv[i]);
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (strcmp(arg, "--sample-checks") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      if (parse_int(argv[++i], &options->sample_checks) != 0) {
+        fprintf(stderr, "Error: invalid value '%s' for %s\n", argv[i], arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (strcmp(arg, "--compare") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      options->compare_path = argv[++i];
+    } else if (strcmp(arg, "--batch-merges") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      if (parse_int(argv[++i], &options->batch_merges) != 0) {
+        fprintf(stderr, "Error: invalid batch size '%s'\n", argv[i]);
+        print_usage(argv[0]);
+        return -1;
+      }
+    } else if (strcmp(arg, "--verify-batches") == 0) {
+      options->verify_batches = 1;
+    } else if (strcmp(arg, "--no-arena") == 0) {
+      options->use_arena = 0;
+    } else if (strcmp(arg, "--stats") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      options->stats_path = argv[++i];
+    } else if (strcmp(arg, "--merge-log") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: missing value for %s\n", arg);
+        print_usage(argv[0]);
+        return -1;
+      }
+      options->merge_log_path = argv[++i];
     } else if (strncmp(arg, "-", 1) == 0) {
       fprintf(stderr, "Error: unknown option '%s'\n", arg);
       print_usage(argv[0]);
@@ -81,6 +282,10 @@ int parse_cli_args(int argc, char **argv, CliOptions *options) {
     fprintf(stderr, "Error: target vocabulary size must be at least 256\n");
     return -1;
   }
+  if (options->sample_fraction < 1.0 && options->batch_merges > 1) {
+    fprintf(stderr, "Error: --sample merges one pair at a time and cannot be combined with --batch-merges\n");
+    return -1;
+  }
 
   return 0;
 }
@@ -0,0 +1,271 @@
+#include "encode_cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENCODE_CACHE_SHARD_BITS 6
+#define ENCODE_CACHE_SHARDS (1 << ENCODE_CACHE_SHARD_BITS)
+
+// tokens points at one allocation holding the tokens followed by the key
+// bytes; it is NULL for a free slot, whose next links the free list.
+typedef struct {
+  uint64_t hash;
+  int *tokens;
+  uint16_t key_len;
+  uint16_t token_count;
+  uint8_t referenced;
+  int next;
+} CacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  CacheEntry *entries;
+  int entry_count;
+  int entry_capacity;
+  int free_head;
+  int *buckets;
+  int bucket_count;
+  int live;
+  int hand;
+  size_t bytes;
+  size_t budget;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} CacheShard;
+
+struct EncodeCache {
+  MergeRules *rules;
+  CacheShard shards[ENCODE_CACHE_SHARDS];
+};
+
+static uint64_t hash_bytes(const uint8_t *bytes, SeqIndex len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (SeqIndex i = 0; i < len; i++) {
+    h ^= bytes[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static size_t entry_bytes(int key_len, int token_count) {
+  return sizeof(CacheEntry) + sizeof(int) + sizeof(int) * (size_t)token_count + (size_t)key_len;
+}
+
+static const uint8_t *entry_key(const CacheEntry *entry) {
+  return (const uint8_t *)(entry->tokens + entry->token_count);
+}
+
+EncodeCache *create_encode_cache(MergeRules *rules, size_t budget_bytes) {
+  EncodeCache *cache = calloc(1, sizeof(EncodeCache));
+  if (cache == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  // Built once here so concurrent encodes only read the rank map.
+  if (rules->rank_map.keys == NULL)
+    build_merge_ranks(rules);
+  cache->rules = rules;
+  for (int s = 0; s < ENCODE_CACHE_SHARDS; s++) {
+    CacheShard *shard = &cache->shards[s];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->budget = budget_bytes / ENCODE_CACHE_SHARDS;
+    shard->free_head = -1;
+    shard->bucket_count = 64;
+    shard->buckets = malloc(sizeof(int) * (size_t)shard->bucket_count);
+    if (shard->buckets == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    for (int b = 0; b < shard->bucket_count; b++)
+      shard->buckets[b] = -1;
+  }
+  return cache;
+}
+
+void free_encode_cache(EncodeCache *cache) {
+  if (cache == NULL)
+    return;
+  for (int s = 0; s < ENCODE_CACHE_SHARDS; s++) {
+    CacheShard *shard = &cache->shards[s];
+    for (int i = 0; i < shard->entry_count; i++)
+      free(shard->entries[i].tokens);
+    free(shard->entries);
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(cache);
+}
+
+void encode_cache_stats(EncodeCache *cache, EncodeCacheStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int s = 0; s < ENCODE_CACHE_SHARDS; s++) {
+    CacheShard *shard = &cache->shards[s];
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    stats->entries += (uint64_t)shard->live;
+    stats->bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+static CacheEntry *shard_find(CacheShard *shard, uint64_t hash, const uint8_t *key, int key_len) {
+  int i = shard->buckets[hash & (uint64_t)(shard->bucket_count - 1)];
+  for (; i != -1; i = shard->entries[i].next) {
+    CacheEntry *entry = &shard->entries[i];
+    if (entry->hash == hash && entry->key_len == key_len && memcmp(entry_key(entry), key, (size_t)key_len) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static void shard_grow_buckets(CacheShard *shard) {
+  int new_count = shard->bucket_count * 2;
+  int *buckets = malloc(sizeof(int) * (size_t)new_count);
+  if (buckets == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  for (int b = 0; b < new_count; b++)
+    buckets[b] = -1;
+  for (int i = 0; i < shard->entry_count; i++) {
+    CacheEntry *entry = &shard->entries[i];
+    if (entry->tokens == NULL)
+      continue;
+    int b = (int)(entry->hash & (uint64_t)(new_count - 1));
+    entry->next = buckets[b];
+    buckets[b] = i;
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->bucket_count = new_count;
+}
+
+// CLOCK: recently hit entries get one more sweep before they go.
+static void shard_evict_one(CacheShard *shard) {
+  while (1) {
+    if (shard->hand >= shard->entry_count)
+      shard->hand = 0;
+    int i = shard->hand++;
+    CacheEntry *entry = &shard->entries[i];
+    if (entry->tokens == NULL)
+      continue;
+    if (entry->referenced) {
+      entry->referenced = 0;
+      continue;
+    }
+
+    int *link = &shard->buckets[entry->hash & (uint64_t)(shard->bucket_count - 1)];
+    while (*link != i)
+      link = &shard->entries[*link].next;
+    *link = entry->next;
+
+    shard->bytes -= entry_bytes(entry->key_len, entry->token_count);
+    free(entry->tokens);
+    entry->tokens = NULL;
+    entry->next = shard->free_head;
+    shard->free_head = i;
+    shard->live--;
+    shard->evictions++;
+    return;
+  }
+}
+
+static void shard_insert(CacheShard *shard, uint64_t hash, const uint8_t *key, int key_len, const int *tokens,
+                         int token_count) {
+  size_t size = entry_bytes(key_len, token_count);
+  if (size > shard->budget || shard_find(shard, hash, key, key_len) != NULL)
+    return;
+  while (shard->bytes + size > shard->budget && shard->live > 0)
+    shard_evict_one(shard);
+
+  int i = shard->free_head;
+  if (i != -1) {
+    shard->free_head = shard->entries[i].next;
+  } else {
+    if (shard->entry_count == shard->entry_capacity) {
+      int new_cap = shard->entry_capacity ? shard->entry_capacity * 2 : 64;
+      CacheEntry *entries = realloc(shard->entries, sizeof(CacheEntry) * (size_t)new_cap);
+      if (entries == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+      }
+      shard->entries = entries;
+      shard->entry_capacity = new_cap;
+    }
+    i = shard->entry_count++;
+  }
+
+  CacheEntry *entry = &shard->entries[i];
+  entry->tokens = malloc(sizeof(int) * (size_t)token_count + (size_t)key_len);
+  if (entry->tokens == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  memcpy(entry->tokens, tokens, sizeof(int) * (size_t)token_count);
+  memcpy(entry->tokens + token_count, key, (size_t)key_len);
+  entry->hash = hash;
+  entry->key_len = (uint16_t)key_len;
+  entry->token_count = (uint16_t)token_count;
+  entry->referenced = 0;
+
+  int b = (int)(hash & (uint64_t)(shard->bucket_count - 1));
+  entry->next = shard->buckets[b];
+  shard->buckets[b] = i;
+  shard->bytes += size;
+  shard->live++;
+  if (shard->live > shard->bucket_count)
+    shard_grow_buckets(shard);
+}
+
+TokenSequence encode_cached(EncodeCache *cache, const uint8_t *text, SeqIndex text_len) {
+  TokenSequence out = create_sequence(text_len > 0 ? text_len : 1);
+  TextCutter cutter;
+  text_cutter_init(&cutter, cache->rules, text, text_len);
+  for (SeqIndex pos = 0; pos < text_len;) {
+    SeqIndex end = text_cutter_next(&cutter, pos + 1);
+    const uint8_t *piece = text + pos;
+    int len = (int)(end - pos);
+    pos = end;
+    if (len == 1) {
+      out.tokens[out.length++] = piece[0];
+      continue;
+    }
+    if (len > ENCODE_CACHE_MAX_PIECE) {
+      TokenSequence encoded = encode(piece, len, cache->rules);
+      memcpy(out.tokens + out.length, encoded.tokens, sizeof(int) * (size_t)encoded.length);
+      out.length += encoded.length;
+      free_sequence(&encoded);
+      continue;
+    }
+
+    // The top hash bits pick the shard and the low bits the bucket.
+    uint64_t hash = hash_bytes(piece, len);
+    CacheShard *shard = &cache->shards[hash >> (64 - ENCODE_CACHE_SHARD_BITS)];
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = shard_find(shard, hash, piece, len);
+    if (entry != NULL) {
+      entry->referenced = 1;
+      memcpy(out.tokens + out.length, entry->tokens, sizeof(int) * entry->token_count);
+      out.length += entry->token_count;
+      shard->hits++;
+      pthread_mutex_unlock(&shard->lock);
+      continue;
+    }
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    TokenSequence encoded = encode(piece, len, cache->rules);
+    memcpy(out.tokens + out.length, encoded.tokens, sizeof(int) * (size_t)encoded.length);
+    out.length += encoded.length;
+    pthread_mutex_lock(&shard->lock);
+    shard_insert(shard, hash, piece, len, encoded.tokens, (int)encoded.length);
+    pthread_mutex_unlock(&shard->lock);
+    free_sequence(&encoded);
+  }
+  return out;
+}
@@ -0,0 +1,379 @@
+#include "encode_pool.h"
+#include "pretokenize.h"
+#include "sequence.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tasks per thread a batch is cut into, so stealing has something to even out.
+#define ENCODE_TASKS_PER_THREAD 16
+// Smallest piece encode_parallel() cuts a document into.
+#define ENCODE_PARALLEL_MIN_PIECE (64 << 10)
+
+// A lane's remaining tasks [lo, hi) packed as lo << 32 | hi. The owner takes
+// from lo and thieves cut from hi, both by compare-and-swap.
+typedef struct {
+  _Atomic uint64_t range;
+} EncodeLane;
+
+struct EncodePool {
+  int count;
+  EncodeLane *lanes;
+  pthread_t *threads;
+  int started;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  int generation;
+  int pending;
+  int stop;
+
+  EncodeTaskFn fn;
+  void *ctx;
+};
+
+typedef struct {
+  EncodePool *pool;
+  int id;
+} EncodeWorkerArg;
+
+static inline uint64_t pack_range(uint32_t lo, uint32_t hi) {
+  return ((uint64_t)lo << 32) | hi;
+}
+
+static int lane_take(EncodeLane *lane, uint32_t *task) {
+  uint64_t range = atomic_load_explicit(&lane->range, memory_order_acquire);
+  while (1) {
+    uint32_t lo = (uint32_t)(range >> 32);
+    uint32_t hi = (uint32_t)range;
+    if (lo >= hi)
+      return 0;
+    if (atomic_compare_exchange_weak_explicit(&lane->range, &range, pack_range(lo + 1, hi), memory_order_acq_rel,
+                                              memory_order_acquire)) {
+      *task = lo;
+      return 1;
+    }
+  }
+}
+
+// Moves the upper half of the fullest other lane into this (empty) lane.
+static int lane_steal(EncodePool *pool, int id) {
+  while (1) {
+    int victim = -1;
+    uint32_t most = 0;
+    for (int i = 0; i < pool->count; i++) {
+      uint64_t range = atomic_load_explicit(&pool->lanes[i].range, memory_order_acquire);
+      uint32_t lo = (uint32_t)(range >> 32);
+      uint32_t hi = (uint32_t)range;
+      if (i != id && hi > lo && hi - lo > most) {
+        most = hi - lo;
+        victim = i;
+      }
+    }
+    if (victim == -1)
+      return 0;
+
+    EncodeLane *lane = &pool->lanes[victim];
+    uint64_t range = atomic_load_explicit(&lane->range, memory_order_acquire);
+    uint32_t lo = (uint32_t)(range >> 32);
+    uint32_t hi = (uint32_t)range;
+    if (lo >= hi)
+      continue;
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (atomic_compare_exchange_strong_explicit(&lane->range, &range, pack_range(lo, mid), memory_order_acq_rel,
+                                                memory_order_acquire)) {
+      atomic_store_explicit(&pool->lanes[id].range, pack_range(mid, hi), memory_order_release);
+      return 1;
+    }
+  }
+}
+
+static void encode_pool_work(EncodePool *pool, int id) {
+  uint32_t task;
+  do {
+    while (lane_take(&pool->lanes[id], &task))
+      pool->fn(pool->ctx, id, (SeqIndex)task);
+  } while (lane_steal(pool, id));
+}
+
+static void *encode_worker_main(void *arg) {
+  EncodeWorkerArg *worker = arg;
+  EncodePool *pool = worker->pool;
+  int id = worker->id;
+  free(worker);
+  int seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (pool->generation == seen && !pool->stop)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->stop)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    encode_pool_work(pool, id);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->idle);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+EncodePool *create_encode_pool(int threads) {
+  if (threads < 1)
+    threads = 1;
+  EncodePool *pool = calloc(1, sizeof(EncodePool));
+  if (pool == NULL) {
+    fprintf(stderr, "Failed to allocate encode pool\n");
+    exit(1);
+  }
+  pool->count = threads;
+  pool->lanes = calloc((size_t)threads, sizeof(EncodeLane));
+  pool->threads = calloc((size_t)threads, sizeof(pthread_t));
+  if (pool->lanes == NULL || pool->threads == NULL) {
+    fprintf(stderr, "Failed to allocate encode pool\n");
+    exit(1);
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  // Lane 0 runs on the calling thread.
+  for (int i = 1; i < threads; i++) {
+    EncodeWorkerArg *arg = malloc(sizeof(EncodeWorkerArg));
+    if (arg == NULL) {
+      fprintf(stderr, "Failed to allocate encode pool\n");
+      exit(1);
+    }
+    arg->pool = pool;
+    arg->id = i;
+    if (pthread_create(&pool->threads[i], NULL, encode_worker_main, arg) != 0) {
+      free(arg);
+      break;
+    }
+    pool->started++;
+  }
+  if (pool->started + 1 < threads) {
+    free_encode_pool(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void free_encode_pool(EncodePool *pool) {
+  if (pool == NULL)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 1; i <= pool->started; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->lanes);
+  free(pool->threads);
+  free(pool);
+}
+
+int encode_pool_threads(const EncodePool *pool) {
+  return pool->count;
+}
+
+void encode_pool_run(EncodePool *pool, SeqIndex task_count, EncodeTaskFn fn, void *ctx) {
+  if ((uint64_t)task_count > UINT32_MAX) {
+    fprintf(stderr, "Too many encode tasks in one job\n");
+    exit(1);
+  }
+  for (int i = 0; i < pool->count; i++) {
+    uint32_t lo = (uint32_t)((uint64_t)task_count * i / pool->count);
+    uint32_t hi = (uint32_t)((uint64_t)task_count * (i + 1) / pool->count);
+    atomic_store_explicit(&pool->lanes[i].range, pack_range(lo, hi), memory_order_relaxed);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->pending = pool->started;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  encode_pool_work(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+typedef struct {
+  const uint8_t *const *texts;
+  const SeqIndex *lengths;
+  MergeRules *rules;
+  EncodeCache *cache;
+  const SeqIndex *task_start;  // first document of each task, plus the end
+  const SeqIndex *byte_start;  // where each document's tokens go before packing
+  SeqIndex *token_counts;
+  int *tokens;
+  EncoderContext *contexts;  // one per lane
+} BatchJob;
+
+static void encode_batch_task(void *ctx, int lane, SeqIndex task) {
+  BatchJob *job = ctx;
+  for (SeqIndex d = job->task_start[task]; d < job->task_start[task + 1]; d++) {
+    if (job->cache != NULL) {
+      TokenSequence encoded = encode_cached(job->cache, job->texts[d], job->lengths[d]);
+      memcpy(job->tokens + job->byte_start[d], encoded.tokens, sizeof(int) * (size_t)encoded.length);
+      job->token_counts[d] = encoded.length;
+      free_sequence(&encoded);
+    } else {
+      EncoderContext *context = &job->contexts[lane];
+      SeqIndex length = encode_in_context(context, job->texts[d], job->lengths[d], job->rules);
+      memcpy(job->tokens + job->byte_start[d], context->tokens, sizeof(int) * (size_t)length);
+      job->token_counts[d] = length;
+    }
+  }
+}
+
+// No document encodes to more tokens than it has bytes, so each one is first
+// written to tokens at its byte offset, byte_start[d]; the caller squeezes
+// out the gaps. byte_start has count + 1 entries.
+static void encode_spread(EncodePool *pool, const uint8_t *const *texts, const SeqIndex *lengths, SeqIndex count,
+                          MergeRules *rules, EncodeCache *cache, const SeqIndex *byte_start, SeqIndex *token_counts,
+                          int *tokens) {
+  if (rules->rank_map.keys == NULL)
+    build_merge_ranks(rules);
+
+  // Tasks close once they hold a grain of bytes; a long document is a task
+  // of its own.
+  int threads = encode_pool_threads(pool);
+  SeqIndex total = byte_start[count];
+  SeqIndex grain = total / ((SeqIndex)threads * ENCODE_TASKS_PER_THREAD) + 1;
+  SeqIndex *task_start = malloc(sizeof(SeqIndex) * (size_t)(count + 1));
+  EncoderContext *contexts = calloc((size_t)threads, sizeof(EncoderContext));
+  if (task_start == NULL || contexts == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  SeqIndex task_count = 0;
+  for (SeqIndex d = 0; d < count;) {
+    task_start[task_count++] = d;
+    SeqIndex first = byte_start[d];
+    while (d < count && (byte_start[d] - first < grain || d == task_start[task_count - 1]))
+      d++;
+  }
+  task_start[task_count] = count;
+
+  BatchJob job = {texts, lengths, rules, cache, task_start, byte_start, token_counts, tokens, contexts};
+  encode_pool_run(pool, task_count, encode_batch_task, &job);
+  for (int i = 0; i < threads; i++)
+    free_encoder_context(&contexts[i]);
+  free(contexts);
+  free(task_start);
+}
+
+void encode_batch(EncodePool *pool, const uint8_t *const *texts, const SeqIndex *lengths, SeqIndex count,
+                  MergeRules *rules, EncodeCache *cache, TokenBatch *out) {
+  SeqIndex *byte_start = malloc(sizeof(SeqIndex) * (size_t)(count + 1));
+  SeqIndex *token_counts = malloc(sizeof(SeqIndex) * (size_t)(count > 0 ? count : 1));
+  if (byte_start == NULL || token_counts == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  byte_start[0] = 0;
+  for (SeqIndex d = 0; d < count; d++)
+    byte_start[d + 1] = byte_start[d] + lengths[d];
+  SeqIndex total = byte_start[count];
+
+  size_t offsets_bytes = sizeof(SeqIndex) * (size_t)(count + 1);
+  uint8_t *block = malloc(offsets_bytes + sizeof(int) * (size_t)(total > 0 ? total : 1));
+  if (block == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  out->offsets = (SeqIndex *)block;
+  out->tokens = (int *)(block + offsets_bytes);
+  out->count = count;
+
+  encode_spread(pool, texts, lengths, count, rules, cache, byte_start, token_counts, out->tokens);
+
+  SeqIndex pos = 0;
+  for (SeqIndex d = 0; d < count; d++) {
+    out->offsets[d] = pos;
+    memmove(out->tokens + pos, out->tokens + byte_start[d], sizeof(int) * (size_t)token_counts[d]);
+    pos += token_counts[d];
+  }
+  out->offsets[count] = pos;
+
+  uint8_t *shrunk = realloc(block, offsets_bytes + sizeof(int) * (size_t)(pos > 0 ? pos : 1));
+  if (shrunk != NULL) {
+    out->offsets = (SeqIndex *)shrunk;
+    out->tokens = (int *)(shrunk + offsets_bytes);
+  }
+  free(token_counts);
+  free(byte_start);
+}
+
+// Pieces are cut at the first place past each multiple of the piece size
+// where no merge can cross. With no boundary in reach a piece just runs on to the next
+// one, so a text without any is encoded serially. Each piece is pre-tokenized
+// again on its own, so pretokenized pieces must not end in whitespace.
+TokenSequence encode_parallel(EncodePool *pool, const uint8_t *text, SeqIndex text_len, MergeRules *rules) {
+  if (rules->rank_map.keys == NULL)
+    build_merge_ranks(rules);
+
+  SeqIndex piece_bytes = text_len / ((SeqIndex)encode_pool_threads(pool) * ENCODE_TASKS_PER_THREAD) + 1;
+  if (piece_bytes < ENCODE_PARALLEL_MIN_PIECE)
+    piece_bytes = ENCODE_PARALLEL_MIN_PIECE;
+  SeqIndex max_pieces = text_len / piece_bytes + 1;
+  const uint8_t **texts = malloc(sizeof(uint8_t *) * (size_t)max_pieces);
+  SeqIndex *lengths = malloc(sizeof(SeqIndex) * (size_t)max_pieces);
+  SeqIndex *byte_start = malloc(sizeof(SeqIndex) * (size_t)(max_pieces + 1));
+  SeqIndex *token_counts = malloc(sizeof(SeqIndex) * (size_t)max_pieces);
+  if (texts == NULL || lengths == NULL || byte_start == NULL || token_counts == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  TextCutter cutter;
+  text_cutter_init(&cutter, rules, text, text_len);
+  SeqIndex count = 0;
+  byte_start[0] = 0;
+  for (SeqIndex start = 0; start < text_len;) {
+    SeqIndex end = text_cutter_next(&cutter, start + piece_bytes);
+    while (rules->pretokenize && end < text_len && !pretokenize_can_end(text, end))
+      end = text_cutter_next(&cutter, end + 1);
+    texts[count] = text + start;
+    lengths[count] = end - start;
+    byte_start[++count] = end;
+    start = end;
+  }
+
+  TokenSequence seq = create_sequence(text_len > 0 ? text_len : 1);
+  encode_spread(pool, texts, lengths, count, rules, NULL, byte_start, token_counts, seq.tokens);
+
+  SeqIndex pos = 0;
+  for (SeqIndex p = 0; p < count; p++) {
+    memmove(seq.tokens + pos, seq.tokens + byte_start[p], sizeof(int) * (size_t)token_counts[p]);
+    pos += token_counts[p];
+  }
+  seq.length = pos;
+  free(token_counts);
+  free(byte_start);
+  free(lengths);
+  free(texts);
+  return seq;
+}
+
+void free_token_batch(TokenBatch *batch) {
+  free(batch->offsets);
+  memset(batch, 0, sizeof(*batch));
+}
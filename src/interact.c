@@ -1,7 +1,10 @@
 #define _POSIX_C_SOURCE 200809L
+#include "backtrack_encode.h"
+#include "encode_cache.h"
+#include "encode_pool.h"
+#include "io.h"
 #include "merge_rules.h"
 #include "sequence.h"
-#include "token.h"
 #include "tokenizer_io.h"
 #include "vocab.h"
 
@@ -25,19 +28,146 @@ static double elapsed_ms(struct timespec start, struct timespec end) {
 
 static void print_usage(const char *progname) {
   fprintf(stderr,
-          "Usage: %s --load <tokenizer.bin>\n"
+          "Usage: %s --load <tokenizer.bin> [--encode <PATH> [--threads <N>]]\n"
+          "          [--cache-mb <N> | --backtrack]\n"
           "Starts an interactive tokenizer REPL.\n"
+          "With --encode, instead encodes a file, directory, glob or tar archive\n"
+          "document by document and reports the totals, as one batch over N\n"
+          "threads with --threads. A single document is then split across the\n"
+          "threads instead.\n"
+          "With --cache-mb, encodes through an N MB cache of short pieces,\n"
+          "with the same tokens; it pays off for --pretokenize tokenizers.\n"
+          "With --backtrack, uses the linear-time backtracking encoder, which\n"
+          "gives the same tokens as the default one.\n"
           "Commands:\n"
           "  quit/exit    Leave the session\n"
           "  :help        Show this message\n",
           progname);
 }
 
+static void print_cache_stats(EncodeCache *cache) {
+  EncodeCacheStats stats;
+  encode_cache_stats(cache, &stats);
+  uint64_t lookups = stats.hits + stats.misses;
+  printf("Cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %llu entries, %.1f MB\n",
+         (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+         lookups > 0 ? 100.0 * stats.hits / lookups : 0.0, (unsigned long long)stats.evictions,
+         (unsigned long long)stats.entries, stats.bytes / (1024.0 * 1024.0));
+}
+
+// At most one of cache and backtrack is set.
+typedef struct {
+  MergeRules *rules;
+  EncodeCache *cache;
+  BacktrackEncoder *backtrack;
+} Encoder;
+
+static TokenSequence encode_text(const Encoder *encoder, const uint8_t *text, SeqIndex len) {
+  if (encoder->cache != NULL)
+    return encode_cached(encoder->cache, text, len);
+  if (encoder->backtrack != NULL)
+    return backtrack_encode(encoder->backtrack, text, len);
+  return encode(text, len, encoder->rules);
+}
+
+static int encode_corpus(const char *path, const Encoder *encoder, int threads) {
+  Corpus corpus;
+  if (read_corpus(path, NULL, &corpus) != 0)
+    return 1;
+
+  EncodePool *pool = NULL;
+  if (threads > 0 && (pool = create_encode_pool(threads)) == NULL) {
+    fprintf(stderr, "Failed to start %d encoder threads\n", threads);
+    free_corpus(&corpus);
+    return 1;
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  SeqIndex tokens = 0;
+  if (pool != NULL && corpus.doc_count == 1 && encoder->cache == NULL) {
+    TokenSequence encoded = encode_parallel(pool, corpus.text, corpus.length, encoder->rules);
+    tokens = encoded.length;
+    free_sequence(&encoded);
+  } else if (pool != NULL) {
+    const uint8_t **texts = malloc(sizeof(uint8_t *) * (size_t)(corpus.doc_count > 0 ? corpus.doc_count : 1));
+    SeqIndex *lengths = malloc(sizeof(SeqIndex) * (size_t)(corpus.doc_count > 0 ? corpus.doc_count : 1));
+    if (texts == NULL || lengths == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    for (SeqIndex d = 0; d < corpus.doc_count; d++) {
+      SeqIndex start = d > 0 ? corpus.doc_ends[d - 1] : 0;
+      texts[d] = corpus.text + start;
+      lengths[d] = corpus.doc_ends[d] - start;
+    }
+    TokenBatch batch;
+    encode_batch(pool, texts, lengths, corpus.doc_count, encoder->rules, encoder->cache, &batch);
+    tokens = batch.offsets[batch.count];
+    free_token_batch(&batch);
+    free(lengths);
+    free(texts);
+  } else if (encoder->cache == NULL && encoder->backtrack == NULL) {
+    EncoderContext context = create_encoder_context(0);
+    SeqIndex start = 0;
+    for (SeqIndex d = 0; d < corpus.doc_count; d++) {
+      tokens += encode_in_context(&context, corpus.text + start, corpus.doc_ends[d] - start, encoder->rules);
+      start = corpus.doc_ends[d];
+    }
+    free_encoder_context(&context);
+  } else {
+    SeqIndex start = 0;
+    for (SeqIndex d = 0; d < corpus.doc_count; d++) {
+      TokenSequence encoded = encode_text(encoder, corpus.text + start, corpus.doc_ends[d] - start);
+      tokens += encoded.length;
+      free_sequence(&encoded);
+      start = corpus.doc_ends[d];
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double encode_ms = elapsed_ms(t0, t1);
+  printf("Documents: %lld\n", (long long)corpus.doc_count);
+  printf("Length bytes: %lld\n", (long long)corpus.length);
+  printf("Token count: %lld\n", (long long)tokens);
+  if (tokens > 0)
+    printf("Compression ratio: %.3fx\n", (double)corpus.length / tokens);
+  printf("Encode time: %.3f ms (%.1f MB/s)\n", encode_ms,
+         encode_ms > 0 ? corpus.length / (encode_ms * 1000.0) : 0.0);
+  if (encoder->cache != NULL)
+    print_cache_stats(encoder->cache);
+  free_encode_pool(pool);
+  free_corpus(&corpus);
+  return 0;
+}
+
 int main(int argc, char **argv) {
   const char *load_path = NULL;
+  const char *encode_path = NULL;
+  long cache_mb = 0;
+  long threads = 0;
+  int backtrack = 0;
   for (int i = 1; i < argc; ++i) {
     if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
       load_path = argv[++i];
+    } else if (strcmp(argv[i], "--encode") == 0 && i + 1 < argc) {
+      encode_path = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      char *end = NULL;
+      threads = strtol(argv[++i], &end, 10);
+      if (end == argv[i] || *end != '\0' || threads <= 0 || threads > 1024) {
+        fprintf(stderr, "Invalid --threads value: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+      char *end = NULL;
+      cache_mb = strtol(argv[++i], &end, 10);
+      if (end == argv[i] || *end != '\0' || cache_mb <= 0) {
+        fprintf(stderr, "Invalid --cache-mb value: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backtrack") == 0) {
+      backtrack = 1;
     } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
       print_usage(argv[0]);
       return 0;
@@ -53,6 +183,10 @@ int main(int argc, char **argv) {
     print_usage(argv[0]);
     return 1;
   }
+  if (backtrack && (cache_mb > 0 || threads > 0)) {
+    fprintf(stderr, "Error: --backtrack cannot be combined with --cache-mb or --threads.\n");
+    return 1;
+  }
 
   Vocabulary vocab;
   MergeRules rules;
@@ -61,6 +195,20 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  Encoder encoder = {&rules, NULL, NULL};
+  if (cache_mb > 0)
+    encoder.cache = create_encode_cache(&rules, (size_t)cache_mb << 20);
+  if (backtrack && (encoder.backtrack = create_backtrack_encoder(&vocab, &rules)) == NULL)
+    fprintf(stderr, "Tokenizer layout not supported by --backtrack; using the default encoder\n");
+  if (encode_path != NULL) {
+    int result = encode_corpus(encode_path, &encoder, (int)threads);
+    free_backtrack_encoder(encoder.backtrack);
+    free_encode_cache(encoder.cache);
+    free_merge_rules(&rules);
+    free_vocab(&vocab);
+    return result;
+  }
+
   printf("Interactive tokenizer\n");
   printf("Loaded vocabulary size: %d\n", vocab.size);
   printf("Loaded merge rules: %d\n\n", rules.num_rules);
@@ -90,17 +238,17 @@ int main(int argc, char **argv) {
     size_t input_len = strlen(line);
     struct timespec t0, t1;
     clock_gettime(CLOCK_MONOTONIC, &t0);
-    TokenSequence encoded = encode((uint8_t *)line, (int)input_len, &rules);
+    TokenSequence encoded = encode_text(&encoder, (uint8_t *)line, (SeqIndex)input_len);
     clock_gettime(CLOCK_MONOTONIC, &t1);
 
     double encode_ms = elapsed_ms(t0, t1);
 
-    printf("Tokens (%d): ", encoded.length);
+    printf("Tokens (%lld): ", (long long)encoded.length);
     print_sequence(&encoded, &vocab);
 
     double compression = encoded.length > 0 ? ((double)input_len / encoded.length) : 0.0;
     printf("Length bytes: %zu\n", input_len);
-    printf("Token count: %d\n", encoded.length);
+    printf("Token count: %lld\n", (long long)encoded.length);
     if (encoded.length > 0)
       printf("Compression ratio: %.3fx\n", compression);
     else
@@ -108,10 +256,10 @@ int main(int argc, char **argv) {
 
     printf("Encode time: %.3f ms\n", encode_ms);
 
-    int decoded_len = 0;
+    SeqIndex decoded_len = 0;
     uint8_t *decoded = decode(&encoded, &vocab, &decoded_len);
     if (decoded) {
-      int match = (decoded_len == (int)input_len) && memcmp(decoded, line, input_len) == 0;
+      int match = (decoded_len == (SeqIndex)input_len) && memcmp(decoded, line, input_len) == 0;
       printf("Round-trip match: %s\n", match ? "yes" : "no");
       free(decoded);
     }
@@ -121,6 +269,8 @@ int main(int argc, char **argv) {
   }
 
   free(line);
+  free_backtrack_encoder(encoder.backtrack);
+  free_encode_cache(encoder.cache);
   free_merge_rules(&rules);
   free_vocab(&vocab);
   return 0;
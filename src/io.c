@@ -1,30 +1,327 @@
+#define _DEFAULT_SOURCE
 #include "io.h"
+#include "archive.h"
+#include <dirent.h>
+#include <glob.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-uint8_t* read_file(const char *filename, int *file_size) {
-  FILE *file = fopen(filename, "rb");
+typedef struct {
+  char **paths;
+  size_t count;
+  size_t capacity;
+} PathList;
+
+static void path_list_push(PathList *list, const char *path) {
+  if (list->count == list->capacity) {
+    size_t new_cap = list->capacity ? list->capacity * 2 : 64;
+    char **paths = realloc(list->paths, sizeof(char *) * new_cap);
+    if (paths == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    list->paths = paths;
+    list->capacity = new_cap;
+  }
+  size_t len = strlen(path);
+  char *copy = malloc(len + 1);
+  if (copy == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  memcpy(copy, path, len + 1);
+  list->paths[list->count++] = copy;
+}
+
+static void path_list_free(PathList *list) {
+  for (size_t i = 0; i < list->count; i++)
+    free(list->paths[i]);
+  free(list->paths);
+  memset(list, 0, sizeof(*list));
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int collect_directory(PathList *list, const char *dir_path) {
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    fprintf(stderr, "Could not open directory: %s\n", dir_path);
+    return -1;
+  }
+
+  size_t first = list->count;
+  int result = 0;
+  struct dirent *entry;
+  while (result == 0 && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    size_t len = strlen(dir_path) + strlen(entry->d_name) + 2;
+    char *path = malloc(len);
+    if (path == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    snprintf(path, len, "%s/%s", dir_path, entry->d_name);
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+      fprintf(stderr, "Could not stat: %s\n", path);
+      result = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      result = collect_directory(list, path);
+    } else if (S_ISREG(st.st_mode)) {
+      path_list_push(list, path);
+    }
+    free(path);
+  }
+  closedir(dir);
+
+  // readdir order is arbitrary; sorting keeps the corpus order stable.
+  qsort(list->paths + first, list->count - first, sizeof(char *), compare_paths);
+  return result;
+}
+
+static int collect_input(PathList *list, const char *input) {
+  struct stat st;
+  if (stat(input, &st) == 0) {
+    if (S_ISDIR(st.st_mode))
+      return collect_directory(list, input);
+    path_list_push(list, input);
+    return 0;
+  }
+  if (strpbrk(input, "*?[") == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", input);
+    return -1;
+  }
+
+  glob_t matches;
+  if (glob(input, 0, NULL, &matches) != 0) {
+    fprintf(stderr, "No files match: %s\n", input);
+    return -1;
+  }
+  int result = 0;
+  for (size_t i = 0; i < matches.gl_pathc && result == 0; i++) {
+    if (stat(matches.gl_pathv[i], &st) == 0 && S_ISDIR(st.st_mode))
+      result = collect_directory(list, matches.gl_pathv[i]);
+    else
+      path_list_push(list, matches.gl_pathv[i]);
+  }
+  globfree(&matches);
+  return result;
+}
+
+static int collect_list_file(PathList *list, const char *list_path) {
+  FILE *file = fopen(list_path, "r");
   if (file == NULL) {
-    fprintf(stderr, "Could not open file: %s\n", filename);
-    return NULL;
+    fprintf(stderr, "Could not open file list: %s\n", list_path);
+    return -1;
+  }
+  char line[4096];
+  int result = 0;
+  while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+    size_t len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    if (len > 0)
+      result = collect_input(list, line);
+  }
+  fclose(file);
+  return result;
+}
+
+typedef struct {
+  Corpus *corpus;
+  size_t capacity;
+  size_t doc_capacity;
+  int failed;
+} CorpusBuilder;
+
+static int corpus_reserve(CorpusBuilder *builder, uint64_t extra) {
+  Corpus *corpus = builder->corpus;
+  uint64_t need = (uint64_t)corpus->length + extra;
+  if (need > (uint64_t)SEQ_INDEX_MAX) {
+    fprintf(stderr, "Corpus of over %llu bytes is too large for this build; rebuild with LARGE_CORPUS=1\n",
+            (unsigned long long)need);
+    return -1;
   }
-  
-  // Get file size
-  fseek(file, 0, SEEK_END);
-  *file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-  
-  // Allocate memory and read
-  uint8_t *buffer = malloc(*file_size);
-  if (buffer == NULL) {
+  if (need <= builder->capacity && corpus->text != NULL)
+    return 0;
+  size_t new_cap = builder->capacity * 2 > need ? builder->capacity * 2 : (size_t)need;
+  uint8_t *text = realloc(corpus->text, new_cap > 0 ? new_cap : 1);
+  if (text == NULL) {
     fprintf(stderr, "Memory allocation failed\n");
-    fclose(file);
+    exit(1);
+  }
+  corpus->text = text;
+  builder->capacity = new_cap;
+  return 0;
+}
+
+static void corpus_end_document(CorpusBuilder *builder) {
+  Corpus *corpus = builder->corpus;
+  SeqIndex last = corpus->doc_count > 0 ? corpus->doc_ends[corpus->doc_count - 1] : 0;
+  if (corpus->length == last)
+    return;
+  if ((size_t)corpus->doc_count == builder->doc_capacity) {
+    size_t new_cap = builder->doc_capacity ? builder->doc_capacity * 2 : 256;
+    SeqIndex *doc_ends = realloc(corpus->doc_ends, sizeof(SeqIndex) * new_cap);
+    if (doc_ends == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    corpus->doc_ends = doc_ends;
+    builder->doc_capacity = new_cap;
+  }
+  corpus->doc_ends[corpus->doc_count++] = corpus->length;
+}
+
+static uint8_t *tar_member_start(void *ctx, const char *name, uint64_t size) {
+  CorpusBuilder *builder = ctx;
+  const char *base = strrchr(name, '/');
+  base = base != NULL ? base + 1 : name;
+  if (base[0] == '.' || builder->failed)
+    return NULL;
+  if (corpus_reserve(builder, size) != 0) {
+    builder->failed = 1;
     return NULL;
   }
-  
-  fread(buffer, 1, *file_size, file);
+  return builder->corpus->text + builder->corpus->length;
+}
+
+static void tar_member_end(void *ctx, uint64_t size) {
+  CorpusBuilder *builder = ctx;
+  builder->corpus->length += (SeqIndex)size;
+  corpus_end_document(builder);
+}
+
+static int read_plain_file(CorpusBuilder *builder, const char *path, size_t size) {
+  Corpus *corpus = builder->corpus;
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", path);
+    return -1;
+  }
+  int result = corpus_reserve(builder, size);
+  size_t got = result == 0 ? fread(corpus->text + corpus->length, 1, size, file) : 0;
+  if (result == 0 && (got != size || fgetc(file) != EOF)) {
+    fprintf(stderr, "File changed while reading: %s\n", path);
+    result = -1;
+  }
   fclose(file);
-  
-  return buffer;
-}
\ No newline at end of file
+  corpus->length += (SeqIndex)got;
+  corpus_end_document(builder);
+  return result;
+}
+
+// Maps path read-only as the whole corpus. Returns 1 when the file cannot be
+// mapped (empty, or not a regular file) and should be read instead.
+static int map_plain_file(CorpusBuilder *builder, const char *path) {
+  Corpus *corpus = builder->corpus;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open file: %s\n", path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+  if ((uint64_t)st.st_size > (uint64_t)SEQ_INDEX_MAX) {
+    fprintf(stderr, "%s is too large for this build; rebuild with LARGE_CORPUS=1\n", path);
+    close(fd);
+    return -1;
+  }
+  void *text = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED)
+    return 1;
+  // Training and encoding make one front-to-back pass over the text.
+  madvise(text, (size_t)st.st_size, MADV_SEQUENTIAL);
+  madvise(text, (size_t)st.st_size, MADV_WILLNEED);
+  corpus->text = text;
+  corpus->length = (SeqIndex)st.st_size;
+  corpus->mapped_bytes = (size_t)st.st_size;
+  corpus_end_document(builder);
+  return 0;
+}
+
+// Plain files are sized first so they land in one buffer without being
+// copied twice; archive members are appended as they stream in.
+static int read_paths(const PathList *list, Corpus *corpus) {
+  size_t *sizes = malloc(sizeof(size_t) * (list->count > 0 ? list->count : 1));
+  if (sizes == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  CorpusBuilder builder = {corpus, 0, 0, 0};
+  if (list->count == 1 && !is_tar_path(list->paths[0])) {
+    int mapped = map_plain_file(&builder, list->paths[0]);
+    if (mapped <= 0) {
+      free(sizes);
+      return mapped;
+    }
+  }
+  uint64_t plain_total = 0;
+  for (size_t i = 0; i < list->count; i++) {
+    struct stat st;
+    if (stat(list->paths[i], &st) != 0) {
+      fprintf(stderr, "Could not stat: %s\n", list->paths[i]);
+      free(sizes);
+      return -1;
+    }
+    sizes[i] = (size_t)st.st_size;
+    if (!is_tar_path(list->paths[i]))
+      plain_total += (uint64_t)st.st_size;
+  }
+
+  int result = corpus_reserve(&builder, plain_total);
+  TarVisitor visitor = {tar_member_start, tar_member_end, &builder};
+  for (size_t i = 0; i < list->count && result == 0; i++) {
+    if (is_tar_path(list->paths[i])) {
+      result = read_tar(list->paths[i], &visitor);
+      if (builder.failed)
+        result = -1;
+    } else {
+      result = read_plain_file(&builder, list->paths[i], sizes[i]);
+    }
+  }
+  free(sizes);
+  return result;
+}
+
+int read_corpus(const char *input, const char *list_path, Corpus *corpus) {
+  memset(corpus, 0, sizeof(*corpus));
+  PathList list = {0};
+  int result = 0;
+  if (input != NULL)
+    result = collect_input(&list, input);
+  if (result == 0 && list_path != NULL)
+    result = collect_list_file(&list, list_path);
+  if (result == 0 && list.count == 0) {
+    fprintf(stderr, "No input files found\n");
+    result = -1;
+  }
+  if (result == 0)
+    result = read_paths(&list, corpus);
+  path_list_free(&list);
+  if (result != 0)
+    free_corpus(corpus);
+  return result;
+}
+
+void free_corpus(Corpus *corpus) {
+  if (corpus->mapped_bytes > 0)
+    munmap(corpus->text, corpus->mapped_bytes);
+  else
+    free(corpus->text);
+  free(corpus->doc_ends);
+  memset(corpus, 0, sizeof(*corpus));
+}
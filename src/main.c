@@ -1,10 +1,12 @@
+#include "checkpoint.h"
 #include "cli.h"
 #include "vocab.h"
 #include "sequence.h"
 #include "merge_rules.h"
+#include "sample.h"
 #include "train.h"
+#include "train_stats.h"
 #include "io.h"
-#include "token.h"
 #include "tokenizer_io.h"
 
 #include <stdint.h>
@@ -12,6 +14,49 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Retrains the corpus one merge at a time and checks that the batched run
+// learned the same merge list.
+static int verify_batched_merges(const CliOptions *options, const TrainOptions *batched, const Corpus *corpus,
+                                 const MergeRules *rules) {
+  Vocabulary vocab;
+  MergeRules reference;
+  if (options->load_path != NULL) {
+    if (load_tokenizer(options->load_path, &vocab, &reference) != 0)
+      return -1;
+    reserve_vocab(&vocab, options->target_vocab_size);
+    reserve_merge_rules(&reference, reference.num_rules + options->target_vocab_size - vocab.size);
+  } else {
+    vocab = create_vocab(options->target_vocab_size);
+    init_base_vocab(&vocab);
+    reference = create_merge_rules(options->target_vocab_size - 256);
+  }
+
+  TrainOptions serial = *batched;
+  serial.batch_merges = 1;
+  serial.checkpoint_path = NULL;
+  serial.snapshot_count = 0;
+  serial.stats = NULL;
+  serial.merge_log_path = NULL;
+  printf("\nVerifying batched merges against one-at-a-time training...\n");
+  train_bpe_text(&vocab, corpus->text, corpus->length, options->target_vocab_size, &reference, &serial);
+
+  int mismatch = -1;
+  int longest = rules->num_rules > reference.num_rules ? rules->num_rules : reference.num_rules;
+  for (int r = 0; r < longest && mismatch == -1; r++) {
+    if (r >= rules->num_rules || r >= reference.num_rules ||
+        memcmp(&rules->rules[r], &reference.rules[r], sizeof(MergeRule)) != 0)
+      mismatch = r;
+  }
+  if (mismatch == -1)
+    printf("Batched merges verified: all %d merges match one-at-a-time training\n", rules->num_rules);
+  else
+    fprintf(stderr, "Batched merges diverge from one-at-a-time training at merge %d\n", mismatch);
+
+  free_merge_rules(&reference);
+  free_vocab(&vocab);
+  return mismatch == -1 ? 0 : -1;
+}
+
 int main(int argc, char **argv) {
   CliOptions options;
   int parse_result = parse_cli_args(argc, argv, &options);
@@ -21,10 +66,26 @@ int main(int argc, char **argv) {
 
   Vocabulary vocab;
   MergeRules merge_rules;
-  uint8_t *text = NULL;
-  int text_len = 0;
-  TokenSequence seq;
-  int seq_initialised = 0;
+  Corpus corpus = {0};
+  int interrupted = 0;
+
+  TrainOptions train_options = default_train_options();
+  train_options.pretokenize = options.pretokenize;
+  train_options.threads = options.threads;
+  train_options.queue = options.queue;
+  train_options.checkpoint_path = options.checkpoint_path;
+  train_options.checkpoint_every = options.checkpoint_every;
+  train_options.checkpoint_seconds = options.checkpoint_seconds;
+  train_options.snapshot_sizes = options.snapshot_sizes;
+  train_options.snapshot_count = options.snapshot_count;
+  train_options.snapshot_path = options.save_path != NULL ? options.save_path : "tokenizer.bin";
+  train_options.batch_merges = options.batch_merges;
+  train_options.use_arena = options.use_arena;
+  train_options.merge_log_path = options.merge_log_path;
+  TrainStats stats;
+  train_stats_init(&stats);
+  if (options.stats_path != NULL)
+    train_options.stats = &stats;
 
   printf("BPE Tokenizer\n\n");
 
@@ -36,28 +97,155 @@ int main(int argc, char **argv) {
     printf("Loaded tokenizer from %s\n", options.load_path);
     printf("Vocabulary size: %d\n", vocab.size);
     printf("Merge rules: %d\n\n", merge_rules.num_rules);
-  } else {
-    printf("Training corpus: %s\n", options.input_path);
+    // Further merges have to cut the text where the loaded ones did.
+    if (options.pretokenize && !merge_rules.pretokenize) {
+      fprintf(stderr, "%s was trained without --pretokenize; drop -p to continue it\n", options.load_path);
+      free_merge_rules(&merge_rules);
+      free_vocab(&vocab);
+      return 1;
+    }
+    train_options.pretokenize = merge_rules.pretokenize;
+    if ((options.input_path != NULL || options.input_list_path != NULL) && options.target_vocab_size <= vocab.size) {
+      fprintf(stderr, "Target vocabulary size %d must exceed the loaded %d to continue training\n",
+              options.target_vocab_size, vocab.size);
+      free_merge_rules(&merge_rules);
+      free_vocab(&vocab);
+      return 1;
+    }
+  } else if (options.resume_path != NULL) {
+    Checkpoint checkpoint;
+    if (load_checkpoint(options.resume_path, &vocab, &merge_rules, &checkpoint) != 0) {
+      fprintf(stderr, "Failed to load checkpoint from %s\n", options.resume_path);
+      return 1;
+    }
+    if (options.pretokenize && !merge_rules.pretokenize) {
+      fprintf(stderr, "%s was trained without --pretokenize; drop -p to resume it\n", options.resume_path);
+      free_checkpoint(&checkpoint);
+      free_merge_rules(&merge_rules);
+      free_vocab(&vocab);
+      return 1;
+    }
+    printf("Resuming from checkpoint %s\n", options.resume_path);
+    printf("Merges so far: %d\n", merge_rules.num_rules);
+    printf("Target vocabulary size: %d\n\n", checkpoint.target_vocab_size);
+
+    int target = checkpoint.target_vocab_size;
+    reserve_vocab(&vocab, target);
+    reserve_merge_rules(&merge_rules, merge_rules.num_rules + (target > vocab.size ? target - vocab.size : 0));
+
+    // Keep checkpointing into the file we resumed from unless told otherwise.
+    train_options.pretokenize = merge_rules.pretokenize;
+    train_options.resume = &checkpoint.snapshot;
+    if (train_options.checkpoint_path == NULL)
+      train_options.checkpoint_path = options.resume_path;
+
+    interrupted = train_bpe_text(&vocab, NULL, 0, target, &merge_rules, &train_options);
+    free_checkpoint(&checkpoint);
+    build_merge_ranks(&merge_rules);
+  }
+
+  // A loaded tokenizer is only trained further when given a corpus.
+  int has_input = options.input_path != NULL || options.input_list_path != NULL;
+  int train_corpus = options.load_path != NULL ? has_input : options.resume_path == NULL;
+  if (train_corpus) {
+    const char *input_path = has_input ? options.input_path : "input.txt";
+    if (input_path != NULL)
+      printf("Training corpus: %s\n", input_path);
+    if (options.input_list_path != NULL)
+      printf("Training file list: %s\n", options.input_list_path);
     printf("Target vocabulary size: %d\n\n", options.target_vocab_size);
 
-    vocab = create_vocab(options.target_vocab_size);
-    init_base_vocab(&vocab);
+    if (options.load_path != NULL) {
+      reserve_vocab(&vocab, options.target_vocab_size);
+      reserve_merge_rules(&merge_rules, merge_rules.num_rules + options.target_vocab_size - vocab.size);
+    } else {
+      vocab = create_vocab(options.target_vocab_size);
+      init_base_vocab(&vocab);
+      merge_rules = create_merge_rules(options.target_vocab_size - 256);
+    }
 
-    text = read_file(options.input_path, &text_len);
-    if (text == NULL) {
-      fprintf(stderr, "Failed to load training data from %s\n", options.input_path);
+    double read_started = train_stats_clock();
+    int read_result = read_corpus(input_path, options.input_list_path, &corpus);
+    stats.read_seconds = train_stats_clock() - read_started;
+    if (read_result != 0) {
+      fprintf(stderr, "Failed to load training data\n");
+      free_merge_rules(&merge_rules);
       free_vocab(&vocab);
       return 1;
     }
 
     printf("Loaded training text\n");
-    printf("Text length: %d bytes\n\n", text_len);
+    if (corpus.doc_count > 1)
+      printf("Documents: %lld\n", (long long)corpus.doc_count);
+    printf("Text length: %lld bytes\n\n", (long long)corpus.length);
+
+    // A sampled run trains on the sample and keeps the full corpus for
+    // checking its close merge picks.
+    Corpus sample = {0};
+    SampleChecker checker;
+    const Corpus *train_text = &corpus;
+    if (options.sample_fraction < 1.0) {
+      sample_corpus(&corpus, options.sample_fraction, &sample);
+      printf("Approximate training on a %.1f%% sample: %lld bytes\n\n", 100.0 * options.sample_fraction,
+             (long long)sample.length);
+      checker = create_sample_checker(&corpus, options.sample_checks);
+      train_options.check_pairs = sample_check_pairs;
+      train_options.check_ctx = &checker;
+      train_text = &sample;
+    }
+
+    train_options.document_ends = train_text->doc_ends;
+    train_options.document_count = train_text->doc_count;
+
+    interrupted = train_bpe_text(&vocab, train_text->text, train_text->length, options.target_vocab_size,
+                                 &merge_rules, &train_options);
+    build_merge_ranks(&merge_rules);
 
-    seq = text_to_sequence(text, text_len);
-    seq_initialised = 1;
+    if (train_text == &sample) {
+      printf("Checked %d close merge picks against the full corpus; exact counts changed %d of them\n",
+             checker.checks, checker.reranked);
+      free_sample_checker(&checker);
+      train_options.check_pairs = NULL;
+      free_corpus(&corpus);
+      corpus = sample;
+    }
+
+    if (!interrupted && options.verify_batches && options.batch_merges > 1 &&
+        verify_batched_merges(&options, &train_options, &corpus, &merge_rules) != 0) {
+      free_corpus(&corpus);
+      free_merge_rules(&merge_rules);
+      free_vocab(&vocab);
+      return 1;
+    }
+  }
 
-    merge_rules = create_merge_rules(options.target_vocab_size - 256);
-    train_bpe(&vocab, &seq, options.target_vocab_size, &merge_rules);
+  if (train_options.stats != NULL && (train_corpus || options.resume_path != NULL)) {
+    if (write_train_stats(options.stats_path, &stats) != 0)
+      fprintf(stderr, "Failed to write training stats to %s\n", options.stats_path);
+    else
+      printf("Training stats written to %s\n", options.stats_path);
+  }
+  free_train_stats(&stats);
+
+  if (interrupted) {
+    fprintf(stderr, "Resume with: %s --resume %s\n", argv[0], train_options.checkpoint_path);
+    free_corpus(&corpus);
+    free_merge_rules(&merge_rules);
+    free_vocab(&vocab);
+    return 130;
+  }
+
+  if (options.compare_path != NULL) {
+    Vocabulary ref_vocab;
+    MergeRules ref_rules;
+    if (load_tokenizer(options.compare_path, &ref_vocab, &ref_rules) != 0) {
+      fprintf(stderr, "Failed to load reference tokenizer from %s\n", options.compare_path);
+    } else {
+      printf("\nCompared with %s:\n", options.compare_path);
+      report_merge_divergence(&vocab, &merge_rules, &ref_vocab, &ref_rules);
+      free_merge_rules(&ref_rules);
+      free_vocab(&ref_vocab);
+    }
   }
 
   if (options.save_path != NULL) {
@@ -71,7 +259,7 @@ int main(int argc, char **argv) {
   printf("\n\nSome learned tokens:\n");
   for (int i = 256; i < vocab.size && i < 280; i++) {
     printf("Token %d: ", i);
-    print_token(&vocab.tokens[i]);
+    print_token(&vocab, i);
     printf("\n");
   }
 
@@ -87,18 +275,18 @@ int main(int argc, char **argv) {
   
   TokenSequence encoded = encode(test_text, test_len, &merge_rules);
   
-  printf("Encoded length: %d tokens\n", encoded.length);
+  printf("Encoded length: %lld tokens\n", (long long)encoded.length);
   printf("Compression: %.2fx\n", (float)test_len / encoded.length);
   printf("\nEncoded tokens:\n");
   print_sequence(&encoded, &vocab);
 
   printf("\n--- Testing Decode ---\n");
-  int decoded_len;
+  SeqIndex decoded_len;
   uint8_t *decoded = decode(&encoded, &vocab, &decoded_len);
 
-  printf("Decoded length: %d bytes\n", decoded_len);
+  printf("Decoded length: %lld bytes\n", (long long)decoded_len);
   printf("Decoded text: ");
-  for (int i = 0; i < decoded_len; i++) {
+  for (SeqIndex i = 0; i < decoded_len; i++) {
     printf("%c", decoded[i]);
   }
   printf("\n");
@@ -111,10 +299,7 @@ int main(int argc, char **argv) {
   }
   
   // Cleanup
-  if (text)
-    free(text);
-  if (seq_initialised)
-    free_sequence(&seq);
+  free_corpus(&corpus);
   free_sequence(&encoded);
   free(decoded);
   free_merge_rules(&merge_rules);
@@ -1,12 +1,32 @@
 #include "merge_rules.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static void free_merge_ranks(MergeRankMap *map) {
+  free(map->keys);
+  free(map->ranks);
+  free(map->next_same);
+  free(map->joins);
+  map->keys = NULL;
+  map->ranks = NULL;
+  map->next_same = NULL;
+  map->joins = NULL;
+  map->capacity = 0;
+}
 
 MergeRules create_merge_rules(int capacity) {
   MergeRules rules;
   rules.num_rules = 0;
   rules.capacity = capacity;
+  rules.rank_map.keys = NULL;
+  rules.rank_map.ranks = NULL;
+  rules.rank_map.next_same = NULL;
+  rules.rank_map.joins = NULL;
+  rules.rank_map.capacity = 0;
+  rules.pretokenize = 0;
   if (capacity <= 0) {
     rules.rules = NULL;
     return rules;
@@ -23,6 +43,7 @@ void free_merge_rules(MergeRules *rules) {
   free(rules->rules);
   rules->rules = NULL;
   rules->num_rules = 0;
+  free_merge_ranks(&rules->rank_map);
 }
 
 void add_merge_rule(MergeRules *rules, int token1, int token2, int result) {
@@ -38,4 +59,152 @@ void add_merge_rule(MergeRules *rules, int token1, int token2, int result) {
   rules->rules[rules->num_rules].token2 = token2;
   rules->rules[rules->num_rules].result_token = result;
   rules->num_rules++;
+
+  // The rank lookup describes a fixed rule list; drop it so encode() rebuilds.
+  if (rules->rank_map.keys != NULL)
+    free_merge_ranks(&rules->rank_map);
+}
+
+void reserve_merge_rules(MergeRules *rules, int capacity) {
+  if (capacity <= rules->capacity)
+    return;
+  MergeRule *grown = realloc(rules->rules, sizeof(MergeRule) * capacity);
+  if (grown == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  rules->rules = grown;
+  rules->capacity = capacity;
+}
+
+static inline uint64_t rank_key(int token1, int token2) {
+  return ((uint64_t)(uint32_t)token1 << 32) | (uint32_t)token2;
+}
+
+static uint64_t rank_hash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Follows the first and last byte of every token the rules can build, until
+// nothing changes. A token built two ways with different end bytes makes
+// every pair joinable, which only costs the chance to split the input.
+static void build_merge_joins(MergeRules *rules) {
+  MergeRankMap *map = &rules->rank_map;
+  map->joins = calloc(1024, sizeof(uint64_t));
+  int max_token = 255;
+  for (int r = 0; r < rules->num_rules; r++) {
+    const MergeRule *rule = &rules->rules[r];
+    if (rule->token1 > max_token)
+      max_token = rule->token1;
+    if (rule->token2 > max_token)
+      max_token = rule->token2;
+    if (rule->result_token > max_token)
+      max_token = rule->result_token;
+  }
+  int *first = malloc(sizeof(int) * ((size_t)max_token + 1));
+  int *last = malloc(sizeof(int) * ((size_t)max_token + 1));
+  if (map->joins == NULL || first == NULL || last == NULL) {
+    fprintf(stderr, "Failed to allocate merge rank map\n");
+    exit(1);
+  }
+  for (int t = 0; t <= max_token; t++)
+    first[t] = last[t] = t < 256 ? t : -1;
+
+  int conflict = 0;
+  int changed = 1;
+  while (changed && !conflict) {
+    changed = 0;
+    for (int r = 0; r < rules->num_rules; r++) {
+      const MergeRule *rule = &rules->rules[r];
+      if (rule->token1 < 0 || rule->token2 < 0 || rule->result_token < 0) {
+        conflict = 1;
+        break;
+      }
+      int head = first[rule->token1];
+      int tail = last[rule->token2];
+      if (head == -1 || tail == -1)
+        continue;
+      if (first[rule->result_token] == -1) {
+        first[rule->result_token] = head;
+        last[rule->result_token] = tail;
+        changed = 1;
+      } else if (first[rule->result_token] != head || last[rule->result_token] != tail) {
+        conflict = 1;
+        break;
+      }
+    }
+  }
+
+  if (conflict) {
+    memset(map->joins, 0xff, 1024 * sizeof(uint64_t));
+  } else {
+    for (int r = 0; r < rules->num_rules; r++) {
+      const MergeRule *rule = &rules->rules[r];
+      if (last[rule->token1] == -1 || first[rule->token2] == -1)
+        continue;
+      unsigned pair = (unsigned)last[rule->token1] << 8 | (unsigned)first[rule->token2];
+      map->joins[pair >> 6] |= UINT64_C(1) << (pair & 63);
+    }
+  }
+  free(first);
+  free(last);
+}
+
+void build_merge_ranks(MergeRules *rules) {
+  MergeRankMap *map = &rules->rank_map;
+  free_merge_ranks(map);
+
+  int cap = 16;
+  while (cap < rules->num_rules * 2)
+    cap <<= 1;
+
+  map->capacity = cap;
+  map->keys = malloc(sizeof(uint64_t) * cap);
+  map->ranks = malloc(sizeof(int) * cap);
+  map->next_same = malloc(sizeof(int) * (rules->num_rules > 0 ? rules->num_rules : 1));
+  if (!map->keys || !map->ranks || !map->next_same) {
+    fprintf(stderr, "Failed to allocate merge rank map\n");
+    exit(1);
+  }
+  for (int i = 0; i < cap; i++)
+    map->ranks[i] = -1;
+
+  // Walk the rules backwards so each slot ends up holding the lowest rank for
+  // its pair and next_same points at the following rule with the same pair.
+  int mask = cap - 1;
+  for (int rank = rules->num_rules - 1; rank >= 0; rank--) {
+    const MergeRule *rule = &rules->rules[rank];
+    uint64_t key = rank_key(rule->token1, rule->token2);
+    int idx = (int)(rank_hash(key) & mask);
+    while (map->ranks[idx] != -1 && map->keys[idx] != key)
+      idx = (idx + 1) & mask;
+    map->next_same[rank] = map->ranks[idx];
+    map->keys[idx] = key;
+    map->ranks[idx] = rank;
+  }
+  build_merge_joins(rules);
+}
+
+// Returns the lowest rank greater than after_rank that merges (token1, token2),
+// or -1 when no later rule applies to the pair.
+int merge_rank_after(const MergeRules *rules, int token1, int token2, int after_rank) {
+  const MergeRankMap *map = &rules->rank_map;
+  if (map->capacity == 0)
+    return -1;
+
+  uint64_t key = rank_key(token1, token2);
+  int mask = map->capacity - 1;
+  int idx = (int)(rank_hash(key) & mask);
+  while (map->ranks[idx] != -1 && map->keys[idx] != key)
+    idx = (idx + 1) & mask;
+
+  int rank = map->ranks[idx];
+  while (rank != -1 && rank <= after_rank)
+    rank = map->next_same[rank];
+  return rank;
 }
@@ -11,7 +11,7 @@ static void pair_heap_reserve(PairHeap *heap, int min_capacity) {
   while (new_cap < min_capacity)
     new_cap *= 2;
 
-  int *new_data = realloc(heap->data, sizeof(int) * new_cap);
+  int *new_data = arena_realloc(heap->arena, heap->data, sizeof(int) * heap->capacity, sizeof(int) * new_cap);
   if (!new_data) {
     fprintf(stderr, "Failed to grow pair heap\n");
     exit(1);
@@ -21,10 +21,11 @@ static void pair_heap_reserve(PairHeap *heap, int min_capacity) {
   heap->capacity = new_cap;
 }
 
-void pair_heap_init(PairHeap *heap, int capacity_hint) {
+void pair_heap_init(PairHeap *heap, int capacity_hint, Arena *arena) {
+  heap->arena = arena;
   heap->capacity = capacity_hint > 0 ? capacity_hint : 16;
   heap->size = 0;
-  heap->data = malloc(sizeof(int) * heap->capacity);
+  heap->data = arena_alloc(arena, sizeof(int) * heap->capacity);
   if (!heap->data && heap->capacity > 0) {
     fprintf(stderr, "Failed to allocate pair heap\n");
     exit(1);
@@ -32,12 +33,22 @@ void pair_heap_init(PairHeap *heap, int capacity_hint) {
 }
 
 void pair_heap_free(PairHeap *heap) {
-  free(heap->data);
+  arena_release(heap->arena, heap->data);
   heap->data = NULL;
   heap->size = 0;
   heap->capacity = 0;
 }
 
+// Higher counts come first. Ties go to the smaller (left, right) token pair so
+// the pop order depends only on the counts, not on how the heap was built.
+static inline int pair_before(const PairEntry *entries, int a, int b) {
+  if (entries[a].count != entries[b].count)
+    return entries[a].count > entries[b].count;
+  if (entries[a].token_left != entries[b].token_left)
+    return entries[a].token_left < entries[b].token_left;
+  return entries[a].token_right < entries[b].token_right;
+}
+
 static void heap_swap(PairHeap *heap, PairEntry *entries, int a, int b) {
   int pa = heap->data[a];
   int pb = heap->data[b];
@@ -52,7 +63,7 @@ static void heap_sift_up(PairHeap *heap, PairEntry *entries, int idx) {
     int parent = (idx - 1) / 2;
     int current = heap->data[idx];
     int parent_idx = heap->data[parent];
-    if (entries[current].count <= entries[parent_idx].count)
+    if (!pair_before(entries, current, parent_idx))
       break;
     heap_swap(heap, entries, idx, parent);
     idx = parent;
@@ -65,11 +76,9 @@ static void heap_sift_down(PairHeap *heap, PairEntry *entries, int idx) {
     int right = left + 1;
     int largest = idx;
 
-    if (left < heap->size &&
-        entries[heap->data[left]].count > entries[heap->data[largest]].count)
+    if (left < heap->size && pair_before(entries, heap->data[left], heap->data[largest]))
       largest = left;
-    if (right < heap->size &&
-        entries[heap->data[right]].count > entries[heap->data[largest]].count)
+    if (right < heap->size && pair_before(entries, heap->data[right], heap->data[largest]))
       largest = right;
     if (largest == idx)
       break;
@@ -118,6 +127,23 @@ void pair_heap_update(PairHeap *heap, PairEntry *entries, int pair_index) {
   }
 }
 
+void pair_heap_build(PairHeap *heap, PairEntry *entries, int entry_count) {
+  pair_heap_reserve(heap, entry_count);
+  heap->size = 0;
+  for (int i = 0; i < entry_count; i++) {
+    if (!entries[i].in_use || entries[i].count <= 0) {
+      entries[i].heap_index = -1;
+      continue;
+    }
+    heap->data[heap->size] = i;
+    entries[i].heap_index = heap->size;
+    heap->size++;
+  }
+
+  for (int idx = heap->size / 2 - 1; idx >= 0; idx--)
+    heap_sift_down(heap, entries, idx);
+}
+
 int pair_heap_pop_max(PairHeap *heap, PairEntry *entries) {
   if (heap->size == 0)
     return -1;
@@ -0,0 +1,259 @@
+#include "pair_queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint64_t bucket_key(const PairEntry *entry) {
+  return ((uint64_t)(uint32_t)entry->token_left << 32) | (uint32_t)entry->token_right;
+}
+
+static void buckets_reserve(PairBuckets *buckets, int pair_index) {
+  if (pair_index < buckets->capacity)
+    return;
+
+  int new_cap = buckets->capacity ? buckets->capacity : 1024;
+  while (new_cap <= pair_index)
+    new_cap *= 2;
+
+  size_t old_cap = (size_t)buckets->capacity;
+  int *prev = arena_realloc(buckets->arena, buckets->prev, sizeof(int) * old_cap, sizeof(int) * new_cap);
+  int *next = arena_realloc(buckets->arena, buckets->next, sizeof(int) * old_cap, sizeof(int) * new_cap);
+  SeqIndex *filed = arena_realloc(buckets->arena, buckets->filed, sizeof(SeqIndex) * old_cap,
+                                  sizeof(SeqIndex) * new_cap);
+  if (!prev || !next || !filed) {
+    fprintf(stderr, "Failed to grow pair buckets\n");
+    exit(1);
+  }
+  memset(filed + buckets->capacity, 0, sizeof(SeqIndex) * (new_cap - buckets->capacity));
+  buckets->prev = prev;
+  buckets->next = next;
+  buckets->filed = filed;
+  buckets->capacity = new_cap;
+}
+
+static void buckets_init(PairBuckets *buckets, int capacity_hint, Arena *arena) {
+  memset(buckets, 0, sizeof(*buckets));
+  buckets->arena = arena;
+  buckets->head = malloc(sizeof(int) * PAIR_BUCKET_LIMIT);
+  if (!buckets->head) {
+    fprintf(stderr, "Failed to allocate pair buckets\n");
+    exit(1);
+  }
+  for (int c = 0; c < PAIR_BUCKET_LIMIT; c++)
+    buckets->head[c] = -1;
+  buckets_reserve(buckets, capacity_hint > 0 ? capacity_hint - 1 : 0);
+  pair_heap_init(&buckets->overflow, 16, arena);
+}
+
+static void buckets_free(PairBuckets *buckets) {
+  free(buckets->head);
+  arena_release(buckets->arena, buckets->prev);
+  arena_release(buckets->arena, buckets->next);
+  arena_release(buckets->arena, buckets->filed);
+  arena_release(buckets->arena, buckets->keys);
+  pair_heap_free(&buckets->overflow);
+  memset(buckets, 0, sizeof(*buckets));
+}
+
+static void bucket_keys_sift_down(BucketKey *keys, int size, int idx) {
+  while (1) {
+    int left = idx * 2 + 1;
+    int right = left + 1;
+    int smallest = idx;
+    if (left < size && keys[left].key < keys[smallest].key)
+      smallest = left;
+    if (right < size && keys[right].key < keys[smallest].key)
+      smallest = right;
+    if (smallest == idx)
+      break;
+    BucketKey tmp = keys[idx];
+    keys[idx] = keys[smallest];
+    keys[smallest] = tmp;
+    idx = smallest;
+  }
+}
+
+static void bucket_keys_reserve(PairBuckets *buckets) {
+  if (buckets->key_count < buckets->key_capacity)
+    return;
+  int new_cap = buckets->key_capacity ? buckets->key_capacity * 2 : 256;
+  BucketKey *keys = arena_realloc(buckets->arena, buckets->keys, sizeof(BucketKey) * buckets->key_capacity,
+                                  sizeof(BucketKey) * new_cap);
+  if (!keys) {
+    fprintf(stderr, "Failed to grow pair bucket keys\n");
+    exit(1);
+  }
+  buckets->keys = keys;
+  buckets->key_capacity = new_cap;
+}
+
+static void bucket_keys_push(PairBuckets *buckets, uint64_t key, int pair_index) {
+  bucket_keys_reserve(buckets);
+  int idx = buckets->key_count++;
+  while (idx > 0) {
+    int parent = (idx - 1) / 2;
+    if (buckets->keys[parent].key <= key)
+      break;
+    buckets->keys[idx] = buckets->keys[parent];
+    idx = parent;
+  }
+  buckets->keys[idx].key = key;
+  buckets->keys[idx].pair_index = pair_index;
+}
+
+static void bucket_unlink(PairBuckets *buckets, int pair_index) {
+  SeqIndex count = buckets->filed[pair_index];
+  if (count == 0)
+    return;
+
+  int prev = buckets->prev[pair_index];
+  int next = buckets->next[pair_index];
+  if (prev != -1)
+    buckets->next[prev] = next;
+  else
+    buckets->head[count] = next;
+  if (next != -1)
+    buckets->prev[next] = prev;
+
+  buckets->filed[pair_index] = 0;
+  if (count == buckets->key_bucket)
+    buckets->key_live--;
+}
+
+static void bucket_link(PairBuckets *buckets, const PairEntry *entries, int pair_index, SeqIndex count) {
+  int head = buckets->head[count];
+  buckets->prev[pair_index] = -1;
+  buckets->next[pair_index] = head;
+  if (head != -1)
+    buckets->prev[head] = pair_index;
+  buckets->head[count] = pair_index;
+  buckets->filed[pair_index] = count;
+
+  if (count > buckets->top)
+    buckets->top = count;
+  if (count == buckets->key_bucket) {
+    buckets->key_live++;
+    bucket_keys_push(buckets, bucket_key(&entries[pair_index]), pair_index);
+  }
+}
+
+// Collects the top bucket's members into the key heap.
+static void bucket_keys_rebuild(PairBuckets *buckets, const PairEntry *entries) {
+  buckets->key_bucket = buckets->top;
+  buckets->key_count = 0;
+  buckets->key_live = 0;
+  for (int idx = buckets->head[buckets->top]; idx != -1; idx = buckets->next[idx]) {
+    bucket_keys_reserve(buckets);
+    buckets->keys[buckets->key_count].key = bucket_key(&entries[idx]);
+    buckets->keys[buckets->key_count].pair_index = idx;
+    buckets->key_count++;
+    buckets->key_live++;
+  }
+  for (int idx = buckets->key_count / 2 - 1; idx >= 0; idx--)
+    bucket_keys_sift_down(buckets->keys, buckets->key_count, idx);
+}
+
+static void buckets_remove(PairBuckets *buckets, PairEntry *entries, int pair_index) {
+  pair_heap_remove(&buckets->overflow, entries, pair_index);
+  if (pair_index < buckets->capacity)
+    bucket_unlink(buckets, pair_index);
+}
+
+static void buckets_update(PairBuckets *buckets, PairEntry *entries, int pair_index) {
+  PairEntry *entry = &entries[pair_index];
+  if (!entry->in_use || entry->count <= 0) {
+    buckets_remove(buckets, entries, pair_index);
+    return;
+  }
+
+  buckets_reserve(buckets, pair_index);
+  if (entry->count >= PAIR_BUCKET_LIMIT) {
+    bucket_unlink(buckets, pair_index);
+    pair_heap_update(&buckets->overflow, entries, pair_index);
+    return;
+  }
+
+  if (entry->heap_index != -1)
+    pair_heap_remove(&buckets->overflow, entries, pair_index);
+  if (buckets->filed[pair_index] == entry->count)
+    return;
+  bucket_unlink(buckets, pair_index);
+  bucket_link(buckets, entries, pair_index, entry->count);
+}
+
+static int buckets_pop_max(PairBuckets *buckets, PairEntry *entries) {
+  if (buckets->overflow.size > 0)
+    return pair_heap_pop_max(&buckets->overflow, entries);
+
+  while (buckets->top > 0 && buckets->head[buckets->top] == -1)
+    buckets->top--;
+  if (buckets->top == 0)
+    return -1;
+
+  // Pairs that left and re-entered the bucket leave stale keys behind; start
+  // over once they outnumber the live ones.
+  if (buckets->key_bucket != buckets->top || buckets->key_count > 2 * buckets->key_live + 64)
+    bucket_keys_rebuild(buckets, entries);
+
+  while (1) {
+    BucketKey top = buckets->keys[0];
+    buckets->keys[0] = buckets->keys[--buckets->key_count];
+    bucket_keys_sift_down(buckets->keys, buckets->key_count, 0);
+
+    int idx = top.pair_index;
+    if (buckets->filed[idx] == buckets->top && bucket_key(&entries[idx]) == top.key) {
+      bucket_unlink(buckets, idx);
+      return idx;
+    }
+  }
+}
+
+void pair_queue_init(PairQueue *queue, PairQueueKind kind, int capacity_hint, Arena *arena) {
+  memset(queue, 0, sizeof(*queue));
+  queue->kind = kind;
+  if (kind == PAIR_QUEUE_BUCKETS)
+    buckets_init(&queue->buckets, capacity_hint, arena);
+  else
+    pair_heap_init(&queue->heap, capacity_hint, arena);
+}
+
+void pair_queue_free(PairQueue *queue) {
+  if (queue->kind == PAIR_QUEUE_BUCKETS)
+    buckets_free(&queue->buckets);
+  else
+    pair_heap_free(&queue->heap);
+}
+
+void pair_queue_build(PairQueue *queue, PairEntry *entries, int entry_count) {
+  if (queue->kind != PAIR_QUEUE_BUCKETS) {
+    pair_heap_build(&queue->heap, entries, entry_count);
+    return;
+  }
+  buckets_reserve(&queue->buckets, entry_count);
+  for (int i = 0; i < entry_count; i++)
+    buckets_update(&queue->buckets, entries, i);
+}
+
+void pair_queue_update(PairQueue *queue, PairEntry *entries, int pair_index) {
+  queue->updates++;
+  if (queue->kind == PAIR_QUEUE_BUCKETS)
+    buckets_update(&queue->buckets, entries, pair_index);
+  else
+    pair_heap_update(&queue->heap, entries, pair_index);
+}
+
+int pair_queue_pop_max(PairQueue *queue, PairEntry *entries) {
+  queue->pops++;
+  if (queue->kind == PAIR_QUEUE_BUCKETS)
+    return buckets_pop_max(&queue->buckets, entries);
+  return pair_heap_pop_max(&queue->heap, entries);
+}
+
+void pair_queue_remove(PairQueue *queue, PairEntry *entries, int pair_index) {
+  queue->removes++;
+  if (queue->kind == PAIR_QUEUE_BUCKETS)
+    buckets_remove(&queue->buckets, entries, pair_index);
+  else
+    pair_heap_remove(&queue->heap, entries, pair_index);
+}
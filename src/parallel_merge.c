@@ -0,0 +1,507 @@
+#include "parallel_merge.h"
+#include "pair_queue.h"
+#include "trainer_state.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  SeqIndex *items;
+  SeqIndex size;
+  SeqIndex capacity;
+} IndexVec;
+
+// An adjacency created by the merge. pair_index is -1 while the pair has no
+// entry yet, and -(id + 2) once the owning lane has given its key a local id.
+typedef struct {
+  SeqIndex node;
+  int pair_index;
+  uint64_t key;
+} PendingPair;
+
+typedef struct {
+  PendingPair *items;
+  SeqIndex size;
+  SeqIndex capacity;
+} PendingVec;
+
+typedef struct MergeLane {
+  int id;
+  struct MergeWorkers *workers;
+
+  // Records produced by this lane, bucketed by the lane that owns the key.
+  IndexVec *stale;
+  PendingVec *added;
+
+  // Keys owned by this lane that have no pair entry yet.
+  uint64_t *new_keys;
+  int *new_pairs;
+  int new_count;
+  int new_capacity;
+  int *new_slots;
+  int new_slot_capacity;
+
+  IndexVec touched;
+  SeqIndex live_delta;
+} MergeLane;
+
+typedef void (*MergePhase)(struct MergeWorkers *workers, MergeLane *lane);
+
+struct MergeWorkers {
+  TrainerState *state;
+  int count;
+  MergeLane *lanes;
+
+  pthread_t *threads;
+  int started;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  int generation;
+  int pending;
+  int stop;
+  MergePhase phase;
+
+  int pair_index;
+  int new_token;
+  int stamp;
+  SeqIndex *sites;
+  SeqIndex sites_capacity;
+  SeqIndex *site_start;
+  int *marks;
+  SeqIndex *deltas;
+  int marks_capacity;
+};
+
+static void *checked_realloc(void *ptr, size_t bytes) {
+  void *grown = realloc(ptr, bytes);
+  if (!grown) {
+    fprintf(stderr, "Failed to grow parallel merge buffers\n");
+    exit(1);
+  }
+  return grown;
+}
+
+static void index_vec_push(IndexVec *vec, SeqIndex value) {
+  if (vec->size >= vec->capacity) {
+    vec->capacity = vec->capacity ? vec->capacity * 2 : 256;
+    vec->items = checked_realloc(vec->items, sizeof(SeqIndex) * (size_t)vec->capacity);
+  }
+  vec->items[vec->size++] = value;
+}
+
+static void pending_vec_push(PendingVec *vec, SeqIndex node, int pair_index, uint64_t key) {
+  if (vec->size >= vec->capacity) {
+    vec->capacity = vec->capacity ? vec->capacity * 2 : 256;
+    vec->items = checked_realloc(vec->items, sizeof(PendingPair) * (size_t)vec->capacity);
+  }
+  PendingPair *pending = &vec->items[vec->size++];
+  pending->node = node;
+  pending->pair_index = pair_index;
+  pending->key = key;
+}
+
+static inline int key_owner(const MergeWorkers *workers, uint64_t key) {
+  return (int)(hash64(key) % (uint64_t)workers->count);
+}
+
+static inline int pair_owner(const MergeWorkers *workers, int pair_index) {
+  const PairEntry *entry = &workers->state->pairs[pair_index];
+  return key_owner(workers, make_pair_key(entry->token_left, entry->token_right));
+}
+
+static void lane_touch(MergeWorkers *workers, MergeLane *lane, int pair_index) {
+  if (workers->marks[pair_index] == workers->stamp)
+    return;
+  workers->marks[pair_index] = workers->stamp;
+  index_vec_push(&lane->touched, pair_index);
+}
+
+static int lane_intern_key(MergeLane *lane, uint64_t key) {
+  if (lane->new_count * 2 >= lane->new_slot_capacity) {
+    int new_cap = lane->new_slot_capacity ? lane->new_slot_capacity * 2 : 256;
+    lane->new_slots = checked_realloc(lane->new_slots, sizeof(int) * new_cap);
+    lane->new_slot_capacity = new_cap;
+    memset(lane->new_slots, 0xff, sizeof(int) * new_cap);
+    int mask = new_cap - 1;
+    for (int id = 0; id < lane->new_count; id++) {
+      int slot = (int)(hash64(lane->new_keys[id]) & mask);
+      while (lane->new_slots[slot] != -1)
+        slot = (slot + 1) & mask;
+      lane->new_slots[slot] = id;
+    }
+  }
+
+  int mask = lane->new_slot_capacity - 1;
+  int slot = (int)(hash64(key) & mask);
+  while (lane->new_slots[slot] != -1) {
+    int id = lane->new_slots[slot];
+    if (lane->new_keys[id] == key)
+      return id;
+    slot = (slot + 1) & mask;
+  }
+
+  if (lane->new_count >= lane->new_capacity) {
+    lane->new_capacity = lane->new_capacity ? lane->new_capacity * 2 : 256;
+    lane->new_keys = checked_realloc(lane->new_keys, sizeof(uint64_t) * lane->new_capacity);
+    lane->new_pairs = checked_realloc(lane->new_pairs, sizeof(int) * lane->new_capacity);
+  }
+  int id = lane->new_count++;
+  lane->new_keys[id] = key;
+  lane->new_slots[slot] = id;
+  return id;
+}
+
+static void lane_add_pending(MergeWorkers *workers, MergeLane *lane, SeqIndex node, int left_token, int right_token) {
+  uint64_t key = make_pair_key(left_token, right_token);
+  int pair_index = pair_map_lookup(&workers->state->map, key);
+  pending_vec_push(&lane->added[key_owner(workers, key)], node, pair_index, key);
+}
+
+// Phase 1, by node range: rewrite tokens and links. Accepted sites never share
+// a node, and this phase never reads a prev link, so lanes do not interfere.
+static void phase_rewrite(MergeWorkers *workers, MergeLane *lane) {
+  TrainerState *state = workers->state;
+  SeqIndex *prev = state->prev;
+  SeqIndex *next = state->next;
+  for (SeqIndex i = workers->site_start[lane->id]; i < workers->site_start[lane->id + 1]; i++) {
+    SeqIndex left_idx = workers->sites[i];
+    SeqIndex right_idx = next[left_idx];
+    SeqIndex next_idx = next[right_idx];
+
+    if (state->occ_pair[right_idx] != -1)
+      index_vec_push(&lane->stale[pair_owner(workers, state->occ_pair[right_idx])], right_idx);
+
+    node_set_token(state, left_idx, workers->new_token);
+    next[left_idx] = next_idx;
+    if (next_idx != -1)
+      prev[next_idx] = left_idx;
+
+    prev[right_idx] = NODE_DEAD;
+    next[right_idx] = -1;
+    lane->live_delta -= node_weight(state, right_idx);
+  }
+}
+
+// Phase 2, by node range: with the sequence final, record the occurrences that
+// went stale and the adjacencies that replace them.
+static void phase_collect(MergeWorkers *workers, MergeLane *lane) {
+  TrainerState *state = workers->state;
+  int new_token = workers->new_token;
+  for (SeqIndex i = workers->site_start[lane->id]; i < workers->site_start[lane->id + 1]; i++) {
+    SeqIndex left_idx = workers->sites[i];
+    SeqIndex prev_idx = state->prev[left_idx];
+    // A neighbour carrying the new token was merged too and records its own pair.
+    if (prev_idx != -1 && node_token(state, prev_idx) != new_token) {
+      if (state->occ_pair[prev_idx] != -1)
+        index_vec_push(&lane->stale[pair_owner(workers, state->occ_pair[prev_idx])], prev_idx);
+      lane_add_pending(workers, lane, prev_idx, node_token(state, prev_idx), new_token);
+    }
+    SeqIndex next_idx = state->next[left_idx];
+    if (next_idx != -1)
+      lane_add_pending(workers, lane, left_idx, new_token, node_token(state, next_idx));
+  }
+}
+
+// Phase 3, by key owner: give each unseen key a lane-local id.
+static void phase_intern(MergeWorkers *workers, MergeLane *lane) {
+  for (int src = 0; src < workers->count; src++) {
+    PendingVec *vec = &workers->lanes[src].added[lane->id];
+    for (SeqIndex i = 0; i < vec->size; i++) {
+      if (vec->items[i].pair_index == -1)
+        vec->items[i].pair_index = -(lane_intern_key(lane, vec->items[i].key) + 2);
+    }
+  }
+}
+
+// Phase 4, by key owner: every list touched here belongs to this lane.
+static void phase_unlink(MergeWorkers *workers, MergeLane *lane) {
+  TrainerState *state = workers->state;
+  for (int src = 0; src < workers->count; src++) {
+    IndexVec *vec = &workers->lanes[src].stale[lane->id];
+    for (SeqIndex i = 0; i < vec->size; i++) {
+      SeqIndex occ_idx = vec->items[i];
+      int pair_index = state->occ_pair[occ_idx];
+      PairEntry *entry = &state->pairs[pair_index];
+      SeqIndex prev_occ = state->occ_prev[occ_idx];
+      SeqIndex next_occ = state->occ_next[occ_idx];
+      if (prev_occ != -1)
+        state->occ_next[prev_occ] = next_occ;
+      else
+        entry->occ_head = next_occ;
+      if (next_occ != -1)
+        state->occ_prev[next_occ] = prev_occ;
+
+      state->occ_pair[occ_idx] = -1;
+      state->occ_prev[occ_idx] = -1;
+      state->occ_next[occ_idx] = -1;
+      workers->deltas[pair_index] -= node_weight(state, occ_idx);
+      lane_touch(workers, lane, pair_index);
+    }
+  }
+}
+
+// Phase 5, by key owner: link the new occurrences. A slot unlinked in phase 4
+// may be relinked here under another owner, hence the separate phase.
+static void phase_link(MergeWorkers *workers, MergeLane *lane) {
+  TrainerState *state = workers->state;
+  for (int src = 0; src < workers->count; src++) {
+    PendingVec *vec = &workers->lanes[src].added[lane->id];
+    for (SeqIndex i = 0; i < vec->size; i++) {
+      PendingPair *pending = &vec->items[i];
+      int pair_index = pending->pair_index >= 0 ? pending->pair_index
+                                                : lane->new_pairs[-(pending->pair_index + 2)];
+      PairEntry *entry = &state->pairs[pair_index];
+      SeqIndex node = pending->node;
+      state->occ_pair[node] = pair_index;
+      state->occ_prev[node] = -1;
+      state->occ_next[node] = entry->occ_head;
+      if (entry->occ_head != -1)
+        state->occ_prev[entry->occ_head] = node;
+      entry->occ_head = node;
+      workers->deltas[pair_index] += node_weight(state, node);
+      lane_touch(workers, lane, pair_index);
+    }
+  }
+}
+
+static void merge_workers_run(MergeWorkers *workers, MergePhase phase) {
+  pthread_mutex_lock(&workers->lock);
+  workers->phase = phase;
+  workers->pending = workers->started;
+  workers->generation++;
+  pthread_cond_broadcast(&workers->wake);
+  pthread_mutex_unlock(&workers->lock);
+
+  phase(workers, &workers->lanes[0]);
+
+  pthread_mutex_lock(&workers->lock);
+  while (workers->pending > 0)
+    pthread_cond_wait(&workers->idle, &workers->lock);
+  pthread_mutex_unlock(&workers->lock);
+}
+
+static void *merge_worker_main(void *arg) {
+  MergeLane *lane = (MergeLane*)arg;
+  MergeWorkers *workers = lane->workers;
+  int seen = 0;
+
+  pthread_mutex_lock(&workers->lock);
+  while (1) {
+    while (workers->generation == seen && !workers->stop)
+      pthread_cond_wait(&workers->wake, &workers->lock);
+    if (workers->stop)
+      break;
+    seen = workers->generation;
+    MergePhase phase = workers->phase;
+    pthread_mutex_unlock(&workers->lock);
+
+    phase(workers, lane);
+
+    pthread_mutex_lock(&workers->lock);
+    if (--workers->pending == 0)
+      pthread_cond_signal(&workers->idle);
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return NULL;
+}
+
+MergeWorkers* merge_workers_create(TrainerState *state, int threads) {
+  MergeWorkers *workers = calloc(1, sizeof(MergeWorkers));
+  if (!workers) {
+    fprintf(stderr, "Failed to allocate merge workers\n");
+    exit(1);
+  }
+  workers->state = state;
+  workers->count = threads;
+  workers->lanes = calloc(threads, sizeof(MergeLane));
+  workers->threads = calloc(threads, sizeof(pthread_t));
+  workers->site_start = calloc(threads + 1, sizeof(SeqIndex));
+  if (!workers->lanes || !workers->threads || !workers->site_start) {
+    fprintf(stderr, "Failed to allocate merge workers\n");
+    exit(1);
+  }
+  pthread_mutex_init(&workers->lock, NULL);
+  pthread_cond_init(&workers->wake, NULL);
+  pthread_cond_init(&workers->idle, NULL);
+
+  for (int i = 0; i < threads; i++) {
+    MergeLane *lane = &workers->lanes[i];
+    lane->id = i;
+    lane->workers = workers;
+    lane->stale = calloc(threads, sizeof(IndexVec));
+    lane->added = calloc(threads, sizeof(PendingVec));
+    if (!lane->stale || !lane->added) {
+      fprintf(stderr, "Failed to allocate merge workers\n");
+      exit(1);
+    }
+  }
+
+  // Lane 0 runs on the training thread.
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&workers->threads[i], NULL, merge_worker_main, &workers->lanes[i]) != 0)
+      break;
+    workers->started++;
+  }
+  if (workers->started + 1 < threads) {
+    fprintf(stderr, "Warning: started %d of %d merge workers; merging serially.\n",
+            workers->started + 1, threads);
+    merge_workers_free(workers);
+    return NULL;
+  }
+  return workers;
+}
+
+void merge_workers_free(MergeWorkers *workers) {
+  pthread_mutex_lock(&workers->lock);
+  workers->stop = 1;
+  pthread_cond_broadcast(&workers->wake);
+  pthread_mutex_unlock(&workers->lock);
+  for (int i = 1; i <= workers->started; i++)
+    pthread_join(workers->threads[i], NULL);
+
+  for (int i = 0; i < workers->count; i++) {
+    MergeLane *lane = &workers->lanes[i];
+    for (int j = 0; j < workers->count; j++) {
+      free(lane->stale[j].items);
+      free(lane->added[j].items);
+    }
+    free(lane->stale);
+    free(lane->added);
+    free(lane->new_keys);
+    free(lane->new_pairs);
+    free(lane->new_slots);
+    free(lane->touched.items);
+  }
+  pthread_mutex_destroy(&workers->lock);
+  pthread_cond_destroy(&workers->wake);
+  pthread_cond_destroy(&workers->idle);
+  free(workers->lanes);
+  free(workers->threads);
+  free(workers->site_start);
+  free(workers->sites);
+  arena_release(&workers->state->arena, workers->marks);
+  arena_release(&workers->state->arena, workers->deltas);
+  free(workers);
+}
+
+// Detaches every occurrence of the winning pair, drops self-pair sites that
+// an earlier site already consumes, and groups the rest by owning node range.
+static void prepare_sites(MergeWorkers *workers, const SeqIndex *sites, SeqIndex site_count) {
+  TrainerState *state = workers->state;
+  PairEntry *entry = &state->pairs[workers->pair_index];
+  int self_pair = entry->token_left == entry->token_right;
+
+  for (SeqIndex i = 0; i < site_count; i++) {
+    state->occ_pair[sites[i]] = -1;
+    state->occ_prev[sites[i]] = -1;
+    state->occ_next[sites[i]] = -1;
+  }
+  entry->occ_head = -1;
+  entry->count = 0;
+
+  if (workers->sites_capacity < site_count) {
+    workers->sites_capacity = site_count;
+    workers->sites = checked_realloc(workers->sites, sizeof(SeqIndex) * (size_t)site_count);
+  }
+
+  int count = workers->count;
+  SeqIndex node_count = state->node_count;
+  SeqIndex *start = workers->site_start;
+  memset(start, 0, sizeof(SeqIndex) * (count + 1));
+
+  SeqIndex last_right = -1;
+  for (SeqIndex i = 0; i < site_count; i++) {
+    if (self_pair && sites[i] == last_right)
+      continue;
+    last_right = state->next[sites[i]];
+    start[(int)((int64_t)sites[i] * count / node_count) + 1]++;
+  }
+  for (int lane = 0; lane < count; lane++)
+    start[lane + 1] += start[lane];
+
+  SeqIndex *fill = calloc(count, sizeof(SeqIndex));
+  if (!fill) {
+    fprintf(stderr, "Failed to allocate merge site buckets\n");
+    exit(1);
+  }
+  last_right = -1;
+  for (SeqIndex i = 0; i < site_count; i++) {
+    if (self_pair && sites[i] == last_right)
+      continue;
+    last_right = state->next[sites[i]];
+    int lane = (int)((int64_t)sites[i] * count / node_count);
+    workers->sites[start[lane] + fill[lane]++] = sites[i];
+  }
+  free(fill);
+}
+
+void parallel_merge_sites(MergeWorkers *workers, int pair_index, int new_token_id,
+                          const SeqIndex *sites, SeqIndex site_count) {
+  TrainerState *state = workers->state;
+  workers->pair_index = pair_index;
+  workers->new_token = new_token_id;
+  workers->stamp++;
+
+  prepare_sites(workers, sites, site_count);
+  merge_workers_run(workers, phase_rewrite);
+  merge_workers_run(workers, phase_collect);
+  merge_workers_run(workers, phase_intern);
+
+  // Pair entries and the map are shared; create the new pairs here, in lane
+  // order, before the owners link their occurrences.
+  for (int i = 0; i < workers->count; i++) {
+    MergeLane *lane = &workers->lanes[i];
+    for (int id = 0; id < lane->new_count; id++) {
+      uint64_t key = lane->new_keys[id];
+      int index = trainer_acquire_pair_entry(state);
+      state->pairs[index].token_left = (int)(key >> 32);
+      state->pairs[index].token_right = (int)(uint32_t)key;
+      pair_map_set(&state->map, key, index);
+      lane->new_pairs[id] = index;
+    }
+  }
+  if (workers->marks_capacity < state->pair_capacity) {
+    int old_cap = workers->marks_capacity;
+    workers->marks = arena_realloc(&state->arena, workers->marks, sizeof(int) * old_cap,
+                                   sizeof(int) * state->pair_capacity);
+    workers->deltas = arena_realloc(&state->arena, workers->deltas, sizeof(SeqIndex) * old_cap,
+                                    sizeof(SeqIndex) * state->pair_capacity);
+    if (!workers->marks || !workers->deltas) {
+      fprintf(stderr, "Failed to grow merge marks\n");
+      exit(1);
+    }
+    memset(workers->marks + old_cap, 0, sizeof(int) * (state->pair_capacity - old_cap));
+    memset(workers->deltas + old_cap, 0, sizeof(SeqIndex) * (state->pair_capacity - old_cap));
+    workers->marks_capacity = state->pair_capacity;
+  }
+
+  merge_workers_run(workers, phase_unlink);
+  merge_workers_run(workers, phase_link);
+
+  // Counts change one pair at a time so each queue update sees an otherwise
+  // valid queue.
+  for (int i = 0; i < workers->count; i++) {
+    MergeLane *lane = &workers->lanes[i];
+    for (SeqIndex j = 0; j < lane->touched.size; j++) {
+      int pair_index = (int)lane->touched.items[j];
+      state->pairs[pair_index].count += workers->deltas[pair_index];
+      workers->deltas[pair_index] = 0;
+      pair_queue_update(&state->queue, state->pairs, pair_index);
+    }
+    state->live_count += lane->live_delta;
+
+    lane->live_delta = 0;
+    lane->touched.size = 0;
+    lane->new_count = 0;
+    if (lane->new_slots)
+      memset(lane->new_slots, 0xff, sizeof(int) * lane->new_slot_capacity);
+    for (int j = 0; j < workers->count; j++) {
+      lane->stale[j].size = 0;
+      lane->added[j].size = 0;
+    }
+  }
+}
@@ -0,0 +1,73 @@
+#include "pretokenize.h"
+
+enum {
+  CLASS_SPACE,
+  CLASS_LETTER,
+  CLASS_DIGIT,
+  CLASS_OTHER
+};
+
+static int byte_class(uint8_t c) {
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f')
+    return CLASS_SPACE;
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80)
+    return CLASS_LETTER;
+  if (c >= '0' && c <= '9')
+    return CLASS_DIGIT;
+  return CLASS_OTHER;
+}
+
+static int contraction_length(const uint8_t *text, SeqIndex len, SeqIndex pos) {
+  if (pos + 1 >= len)
+    return 0;
+  uint8_t a = text[pos + 1];
+  if (a == 's' || a == 't' || a == 'm' || a == 'd')
+    return 2;
+  if (pos + 2 >= len)
+    return 0;
+  uint8_t b = text[pos + 2];
+  if ((a == 'r' && b == 'e') || (a == 'v' && b == 'e') || (a == 'l' && b == 'l'))
+    return 3;
+  return 0;
+}
+
+static SeqIndex run_end(const uint8_t *text, SeqIndex len, SeqIndex pos, int cls) {
+  while (pos < len && byte_class(text[pos]) == cls)
+    pos++;
+  return pos;
+}
+
+int pretokenize_can_end(const uint8_t *text, SeqIndex pos) {
+  return pos == 0 || byte_class(text[pos - 1]) != CLASS_SPACE;
+}
+
+SeqIndex pretokenize_next(const uint8_t *text, SeqIndex len, SeqIndex pos) {
+  if (pos >= len)
+    return len;
+
+  uint8_t c = text[pos];
+  if (c == '\'') {
+    int contraction = contraction_length(text, len, pos);
+    if (contraction > 0)
+      return pos + contraction;
+  }
+
+  int cls = byte_class(c);
+  if (cls != CLASS_SPACE)
+    return run_end(text, len, pos, cls);
+
+  // A single space attaches to the run that follows it.
+  if (c == ' ' && pos + 1 < len) {
+    int next_cls = byte_class(text[pos + 1]);
+    if (next_cls != CLASS_SPACE)
+      return run_end(text, len, pos + 1, next_cls);
+  }
+
+  // Whitespace runs leave their last byte for the following chunk.
+  SeqIndex end = run_end(text, len, pos, CLASS_SPACE);
+  if (end == len)
+    return end;
+  if (end - pos > 1)
+    return end - 1;
+  return end;
+}
@@ -0,0 +1,204 @@
+#include "sample.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Block i is taken when floor(i * fraction) steps up, which spreads the
+// taken blocks evenly.
+static int block_taken(SeqIndex i, double fraction) {
+  return (uint64_t)((double)(i + 1) * fraction) != (uint64_t)((double)i * fraction);
+}
+
+void sample_corpus(const Corpus *corpus, double fraction, Corpus *sample) {
+  SeqIndex text_len = corpus->length;
+  SeqIndex block_count = (text_len + SAMPLE_BLOCK - 1) / SAMPLE_BLOCK;
+  SeqIndex sample_len = 0;
+  SeqIndex taken = 0;
+  for (SeqIndex i = 0; i < block_count; i++) {
+    if (!block_taken(i, fraction))
+      continue;
+    SeqIndex start = i * (SeqIndex)SAMPLE_BLOCK;
+    sample_len += (start + SAMPLE_BLOCK < text_len ? SAMPLE_BLOCK : text_len - start);
+    taken++;
+  }
+  sample->text = malloc(sample_len > 0 ? (size_t)sample_len : 1);
+  sample->doc_ends = malloc(sizeof(SeqIndex) * (size_t)(corpus->doc_count + taken + 1));
+  if (sample->text == NULL || sample->doc_ends == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  sample->length = 0;
+  sample->doc_count = 0;
+  sample->mapped_bytes = 0;
+
+  SeqIndex doc = 0;
+  for (SeqIndex i = 0; i < block_count; i++) {
+    if (!block_taken(i, fraction))
+      continue;
+    SeqIndex start = i * (SeqIndex)SAMPLE_BLOCK;
+    SeqIndex end = start + SAMPLE_BLOCK < text_len ? start + SAMPLE_BLOCK : text_len;
+    memcpy(sample->text + sample->length, corpus->text + start, (size_t)(end - start));
+    while (doc < corpus->doc_count && corpus->doc_ends[doc] <= start)
+      doc++;
+    for (; doc < corpus->doc_count && corpus->doc_ends[doc] < end; doc++)
+      sample->doc_ends[sample->doc_count++] = sample->length + corpus->doc_ends[doc] - start;
+    sample->length += end - start;
+    sample->doc_ends[sample->doc_count++] = sample->length;
+  }
+}
+
+SampleChecker create_sample_checker(const Corpus *corpus, int max_checks) {
+  SampleChecker checker;
+  checker.corpus = corpus;
+  checker.max_checks = max_checks;
+  checker.checks = 0;
+  checker.reranked = 0;
+  checker.ctx = create_encoder_context(0);
+  return checker;
+}
+
+void free_sample_checker(SampleChecker *checker) {
+  free_encoder_context(&checker->ctx);
+}
+
+// The corpus is encoded a segment at a time, which leaves the tokens as they
+// would be in one piece.
+#define CHECK_SEGMENT_BYTES (1 << 20)
+
+// Counted the way training counts: every adjacent pair within a document, and
+// within a chunk for pretokenized rules.
+static void count_exact(SampleChecker *checker, MergeRules *rules, const uint64_t *pairs, int count,
+                        SeqIndex *exact) {
+  const Corpus *corpus = checker->corpus;
+  build_merge_ranks(rules);
+  memset(exact, 0, sizeof(SeqIndex) * (size_t)count);
+  SeqIndex doc_start = 0;
+  for (SeqIndex d = 0; d < corpus->doc_count; d++) {
+    const uint8_t *doc = corpus->text + doc_start;
+    SeqIndex doc_len = corpus->doc_ends[d] - doc_start;
+    doc_start = corpus->doc_ends[d];
+    TextCutter cutter;
+    text_cutter_init(&cutter, rules, doc, doc_len);
+    int last = -1;
+    for (SeqIndex start = 0; start < doc_len;) {
+      SeqIndex end = text_cutter_next(&cutter, start + (rules->pretokenize ? 1 : CHECK_SEGMENT_BYTES));
+      SeqIndex n = encode_in_context(&checker->ctx, doc + start, end - start, rules);
+      if (rules->pretokenize)
+        last = -1;
+      for (SeqIndex i = 0; i < n; i++) {
+        int token = checker->ctx.tokens[i];
+        if (last != -1) {
+          uint64_t key = (uint64_t)(uint32_t)last << 32 | (uint32_t)token;
+          for (int c = 0; c < count; c++) {
+            if (pairs[c] == key) {
+              exact[c]++;
+              break;
+            }
+          }
+        }
+        last = token;
+      }
+      start = end;
+    }
+  }
+}
+
+int sample_check_pairs(void *ctx, MergeRules *rules, const uint64_t *pairs, const SeqIndex *sample_counts,
+                       int count, SeqIndex *exact) {
+  SampleChecker *checker = ctx;
+  if (checker->checks >= checker->max_checks)
+    return 0;
+  // Blocks are taken whole, so counts vary far more between samples than
+  // independent draws would; a fixed margin holds up better than a
+  // confidence bound.
+  if ((double)sample_counts[1] < (1.0 - SAMPLE_CHECK_MARGIN) * (double)sample_counts[0])
+    return 0;
+
+  count_exact(checker, rules, pairs, count, exact);
+  checker->checks++;
+  for (int i = 1; i < count; i++) {
+    if (exact[i] > exact[0]) {
+      checker->reranked++;
+      break;
+    }
+  }
+  return 1;
+}
+
+typedef struct {
+  const uint8_t *bytes;
+  int length;
+} TokenText;
+
+static TokenText token_text(const Vocabulary *vocab, int token) {
+  TokenText text = {vocab_token_bytes(vocab, token), vocab_token_length(vocab, token)};
+  return text;
+}
+
+static int compare_tokens(const void *a, const void *b) {
+  const TokenText *x = a;
+  const TokenText *y = b;
+  int n = x->length < y->length ? x->length : y->length;
+  int c = memcmp(x->bytes, y->bytes, (size_t)n);
+  if (c != 0)
+    return c;
+  return (x->length > y->length) - (x->length < y->length);
+}
+
+static int same_token(TokenText x, TokenText y) {
+  return x.length == y.length && memcmp(x.bytes, y.bytes, (size_t)x.length) == 0;
+}
+
+static TokenText *learned_tokens(const Vocabulary *vocab, const MergeRules *rules) {
+  TokenText *tokens = malloc(sizeof(TokenText) * (rules->num_rules > 0 ? (size_t)rules->num_rules : 1));
+  if (tokens == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  for (int i = 0; i < rules->num_rules; i++)
+    tokens[i] = token_text(vocab, rules->rules[i].result_token);
+  qsort(tokens, (size_t)rules->num_rules, sizeof(TokenText), compare_tokens);
+  return tokens;
+}
+
+void report_merge_divergence(const Vocabulary *vocab, const MergeRules *rules, const Vocabulary *ref_vocab,
+                             const MergeRules *ref_rules) {
+  int common = rules->num_rules < ref_rules->num_rules ? rules->num_rules : ref_rules->num_rules;
+  int first_diff = common;
+  for (int r = 0; r < common; r++) {
+    const MergeRule *a = &rules->rules[r];
+    const MergeRule *b = &ref_rules->rules[r];
+    if (!same_token(token_text(vocab, a->token1), token_text(ref_vocab, b->token1)) ||
+        !same_token(token_text(vocab, a->token2), token_text(ref_vocab, b->token2))) {
+      first_diff = r;
+      break;
+    }
+  }
+
+  TokenText *mine = learned_tokens(vocab, rules);
+  TokenText *theirs = learned_tokens(ref_vocab, ref_rules);
+  int shared = 0;
+  for (int i = 0, j = 0; i < rules->num_rules && j < ref_rules->num_rules;) {
+    int c = compare_tokens(&mine[i], &theirs[j]);
+    if (c == 0) {
+      shared++;
+      i++;
+      j++;
+    } else if (c < 0) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  free(mine);
+  free(theirs);
+
+  if (first_diff == common)
+    printf("Merge lists agree on all %d shared ranks\n", common);
+  else
+    printf("Merge lists agree on the first %d merges\n", first_diff);
+  printf("Learned tokens also in the reference: %d of %d (%.1f%%)\n", shared, rules->num_rules,
+         rules->num_rules > 0 ? 100.0 * shared / rules->num_rules : 100.0);
+}
@@ -0,0 +1,131 @@
+#include "seq_kernels.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SEQ_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*WidenFn)(const uint8_t *src, int *dst, SeqIndex n);
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static SeqIsa active_isa = SEQ_ISA_SCALAR;
+static WidenFn widen_fn;
+
+static void widen_scalar(const uint8_t *src, int *dst, SeqIndex n) {
+  for (SeqIndex i = 0; i < n; i++)
+    dst[i] = src[i];
+}
+
+#ifdef SEQ_KERNELS_X86
+__attribute__((target("sse4.1"))) static void widen_sse41(const uint8_t *src, int *dst, SeqIndex n) {
+  SeqIndex i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_cvtepu8_epi32(bytes));
+    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+    _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+    _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12)));
+  }
+  widen_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void widen_avx2(const uint8_t *src, int *dst, SeqIndex n) {
+  SeqIndex i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(src + i + 16));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvtepu8_epi32(lo));
+    _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+    _mm256_storeu_si256((__m256i *)(dst + i + 16), _mm256_cvtepu8_epi32(hi));
+    _mm256_storeu_si256((__m256i *)(dst + i + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+  }
+  widen_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void widen_avx512(const uint8_t *src, int *dst, SeqIndex n) {
+  SeqIndex i = 0;
+  for (; i + 64 <= n; i += 64) {
+    for (int k = 0; k < 4; k++) {
+      __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i + 16 * k));
+      _mm512_storeu_si512((void *)(dst + i + 16 * k), _mm512_cvtepu8_epi32(bytes));
+    }
+  }
+  widen_scalar(src + i, dst + i, n - i);
+}
+#endif
+
+const char *seq_isa_name(SeqIsa isa) {
+  static const char *names[SEQ_ISA_COUNT] = {"scalar", "sse4.1", "avx2", "avx512"};
+  return isa >= 0 && isa < SEQ_ISA_COUNT ? names[isa] : "unknown";
+}
+
+int seq_isa_supported(SeqIsa isa) {
+  switch (isa) {
+  case SEQ_ISA_SCALAR:
+    return 1;
+#ifdef SEQ_KERNELS_X86
+  case SEQ_ISA_SSE41:
+    return __builtin_cpu_supports("sse4.1");
+  case SEQ_ISA_AVX2:
+    return __builtin_cpu_supports("avx2");
+  case SEQ_ISA_AVX512:
+    return __builtin_cpu_supports("avx512f");
+#endif
+  default:
+    return 0;
+  }
+}
+
+static void select_isa(SeqIsa isa) {
+  active_isa = isa;
+  switch (isa) {
+#ifdef SEQ_KERNELS_X86
+  case SEQ_ISA_SSE41:
+    widen_fn = widen_sse41;
+    break;
+  case SEQ_ISA_AVX2:
+    widen_fn = widen_avx2;
+    break;
+  case SEQ_ISA_AVX512:
+    widen_fn = widen_avx512;
+    break;
+#endif
+  default:
+    active_isa = SEQ_ISA_SCALAR;
+    widen_fn = widen_scalar;
+    break;
+  }
+}
+
+static void kernels_init(void) {
+#ifdef SEQ_KERNELS_X86
+  __builtin_cpu_init();
+#endif
+  SeqIsa best = SEQ_ISA_SCALAR;
+  for (int isa = SEQ_ISA_SCALAR; isa < SEQ_ISA_COUNT; isa++) {
+    if (seq_isa_supported((SeqIsa)isa))
+      best = (SeqIsa)isa;
+  }
+  select_isa(best);
+}
+
+SeqIsa seq_kernels_isa(void) {
+  pthread_once(&kernels_once, kernels_init);
+  return active_isa;
+}
+
+int seq_kernels_use(SeqIsa isa) {
+  pthread_once(&kernels_once, kernels_init);
+  if (!seq_isa_supported(isa))
+    return -1;
+  select_isa(isa);
+  return 0;
+}
+
+void widen_bytes(const uint8_t *src, int *dst, SeqIndex n) {
+  pthread_once(&kernels_once, kernels_init);
+  widen_fn(src, dst, n);
+}
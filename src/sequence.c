@@ -1,16 +1,18 @@
 #include "sequence.h"
-#include "token.h"
+#include "pretokenize.h"
+#include "seq_kernels.h"
+#include "vocab.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-TokenSequence create_sequence(int capacity) {
+TokenSequence create_sequence(SeqIndex capacity) {
   TokenSequence seq;
   seq.length = 0;
   seq.capacity = capacity;
-  seq.tokens = malloc(sizeof(int) * capacity);
+  seq.tokens = malloc(sizeof(int) * (size_t)capacity);
   if (seq.tokens == NULL) {
     fprintf(stderr, "Memory allocation failed\n");
     exit(1);
@@ -25,27 +27,39 @@ void free_sequence(TokenSequence *seq) {
   seq->capacity = 0;
 }
 
-TokenSequence text_to_sequence(uint8_t *text, int text_len) {
+TokenSequence text_to_sequence(const uint8_t *text, SeqIndex text_len) {
   TokenSequence seq = create_sequence(text_len);
-  for (int i = 0; i < text_len; i++)
-    seq.tokens[i] = (int)text[i];
+  widen_bytes(text, seq.tokens, text_len);
   seq.length = text_len;
   return seq;
 }
 
+// Formats the whole sequence into one buffer and writes it at once.
 void print_sequence(TokenSequence *seq, Vocabulary *vocab) {
-  printf("Sequence (%d tokens): ", seq->length);
-  for (int i = 0; i < seq->length; i++) {
-    print_token(&vocab->tokens[seq->tokens[i]]);
-    if (i < seq->length - 1) printf(" ");
+  size_t size = 1;
+  for (SeqIndex i = 0; i < seq->length; i++)
+    size += 4 * (size_t)vocab_token_length(vocab, seq->tokens[i]) + 3;
+  char *text = malloc(size);
+  if (text == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  size_t pos = 0;
+  for (SeqIndex i = 0; i < seq->length; i++) {
+    pos += format_token(vocab, seq->tokens[i], text + pos);
+    if (i < seq->length - 1)
+      text[pos++] = ' ';
   }
-  printf("\n");
+  text[pos++] = '\n';
+  printf("Sequence (%lld tokens): ", (long long)seq->length);
+  fwrite(text, 1, pos, stdout);
+  free(text);
 }
 
 void merge_pair_in_sequence(TokenSequence *seq, int token1, int token2, int new_token) {
-  int write_pos = 0;
+  SeqIndex write_pos = 0;
 
-  for (int read_pos = 0; read_pos < seq->length; read_pos++) {
+  for (SeqIndex read_pos = 0; read_pos < seq->length; read_pos++) {
     // Check if we found the pair to merge
     if (read_pos < seq->length - 1 &&
       seq->tokens[read_pos] == token1 &&
@@ -64,38 +78,338 @@ void merge_pair_in_sequence(TokenSequence *seq, int token1, int token2, int new_
   seq->length = write_pos;
 }
 
-TokenSequence encode(uint8_t *text, int text_len, MergeRules *rules) {
-  // Start with base tokenization
-  TokenSequence seq = text_to_sequence(text, text_len);
+static void rank_heap_sift_down(uint64_t *heap, SeqIndex size, SeqIndex idx) {
+  while (1) {
+    SeqIndex left = idx * 2 + 1;
+    SeqIndex right = left + 1;
+    SeqIndex smallest = idx;
+    if (left < size && heap[left] < heap[smallest])
+      smallest = left;
+    if (right < size && heap[right] < heap[smallest])
+      smallest = right;
+    if (smallest == idx)
+      break;
+    uint64_t tmp = heap[idx];
+    heap[idx] = heap[smallest];
+    heap[smallest] = tmp;
+    idx = smallest;
+  }
+}
+
+static void rank_heap_push(uint64_t **heap, SeqIndex *size, SeqIndex *capacity, uint64_t key) {
+  if (*size >= *capacity) {
+    SeqIndex new_cap = *capacity ? *capacity * 2 : 16;
+    uint64_t *grown = realloc(*heap, sizeof(uint64_t) * (size_t)new_cap);
+    if (grown == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    *heap = grown;
+    *capacity = new_cap;
+  }
+
+  SeqIndex idx = (*size)++;
+  uint64_t *data = *heap;
+  while (idx > 0) {
+    SeqIndex parent = (idx - 1) / 2;
+    if (data[parent] <= key)
+      break;
+    data[idx] = data[parent];
+    idx = parent;
+  }
+  data[idx] = key;
+}
+
+// Heap keys pack (rank, position) so that integer order is merge order.
+#ifdef BPE_LARGE_CORPUS
+#define RANK_KEY_POS_BITS 40
+#else
+#define RANK_KEY_POS_BITS 32
+#endif
+#define RANK_KEY_POS_MASK ((UINT64_C(1) << RANK_KEY_POS_BITS) - 1)
+
+static inline uint64_t rank_heap_key(int rank, SeqIndex pos) {
+  return ((uint64_t)rank << RANK_KEY_POS_BITS) | (uint64_t)pos;
+}
+
+EncoderContext create_encoder_context(SeqIndex capacity) {
+  EncoderContext ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  encoder_context_reserve(&ctx, capacity);
+  return ctx;
+}
+
+void free_encoder_context(EncoderContext *ctx) {
+  free(ctx->tokens);
+  free(ctx->next);
+  free(ctx->prev);
+  free(ctx->pair_rank);
+  free(ctx->heap);
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void encoder_context_reserve(EncoderContext *ctx, SeqIndex capacity) {
+  if (capacity <= ctx->capacity)
+    return;
+  int *tokens = realloc(ctx->tokens, sizeof(int) * (size_t)capacity);
+  SeqIndex *next = realloc(ctx->next, sizeof(SeqIndex) * (size_t)capacity);
+  SeqIndex *prev = realloc(ctx->prev, sizeof(SeqIndex) * (size_t)capacity);
+  int *pair_rank = realloc(ctx->pair_rank, sizeof(int) * (size_t)capacity);
+  if (!tokens || !next || !prev || !pair_rank) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  ctx->tokens = tokens;
+  ctx->next = next;
+  ctx->prev = prev;
+  ctx->pair_rank = pair_rank;
+  ctx->capacity = capacity;
+  if (ctx->heap_capacity < capacity) {
+    uint64_t *heap = realloc(ctx->heap, sizeof(uint64_t) * (size_t)capacity);
+    if (heap == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    ctx->heap = heap;
+    ctx->heap_capacity = capacity;
+  }
+}
+
+// Merges the n byte tokens at tokens in place and returns how many are left.
+// They are linked through ctx->next from index 0, which is also the byte
+// offset where each one starts.
+static SeqIndex merge_piece(EncoderContext *ctx, int *tokens, SeqIndex n, MergeRules *rules) {
+  SeqIndex *next = ctx->next;
+  if (n < 2 || rules->num_rules == 0) {
+    for (SeqIndex i = 0; i < n; i++)
+      next[i] = (i + 1 < n) ? i + 1 : -1;
+    return n;
+  }
+
+  // Apply merges in (rank, position) order over a linked list of positions.
+  // A pair created by the merge at rank r is only eligible for rules after r,
+  // which reproduces the result of sweeping the rules one at a time.
+  if ((uint64_t)n > RANK_KEY_POS_MASK || (uint64_t)rules->num_rules >> (64 - RANK_KEY_POS_BITS) != 0) {
+    fprintf(stderr, "Input too large to encode in one call\n");
+    exit(1);
+  }
+  SeqIndex live = n;
+  SeqIndex *prev = ctx->prev;
+  int *pair_rank = ctx->pair_rank;
+  SeqIndex heap_size = 0;
+  uint64_t *heap = ctx->heap;
 
-  // Apply each merge rule in order
-  for (int i = 0; i < rules->num_rules; i++) {
-    MergeRule *rule = &rules->rules[i];
-    merge_pair_in_sequence(&seq, rule->token1, rule->token2, rule->result_token);
+  for (SeqIndex i = 0; i < n; i++) {
+    prev[i] = i - 1;
+    next[i] = (i + 1 < n) ? i + 1 : -1;
+    pair_rank[i] = (i + 1 < n) ? merge_rank_after(rules, tokens[i], tokens[i + 1], -1) : -1;
+    if (pair_rank[i] != -1)
+      heap[heap_size++] = rank_heap_key(pair_rank[i], i);
   }
+  for (SeqIndex i = heap_size / 2 - 1; i >= 0; i--)
+    rank_heap_sift_down(heap, heap_size, i);
+
+  while (heap_size > 0) {
+    uint64_t top = heap[0];
+    heap[0] = heap[--heap_size];
+    rank_heap_sift_down(heap, heap_size, 0);
+
+    int rank = (int)(top >> RANK_KEY_POS_BITS);
+    SeqIndex pos = (SeqIndex)(top & RANK_KEY_POS_MASK);
+    if (pair_rank[pos] != rank)
+      continue;  // stale entry: the pair at pos changed since it was queued
 
+    SeqIndex right = next[pos];
+    SeqIndex after = next[right];
+    tokens[pos] = rules->rules[rank].result_token;
+    live--;
+    next[pos] = after;
+    if (after != -1)
+      prev[after] = pos;
+    pair_rank[right] = -1;
+
+    pair_rank[pos] = (after != -1) ? merge_rank_after(rules, tokens[pos], tokens[after], rank) : -1;
+    if (pair_rank[pos] != -1)
+      rank_heap_push(&heap, &heap_size, &ctx->heap_capacity, rank_heap_key(pair_rank[pos], pos));
+
+    SeqIndex before = prev[pos];
+    if (before != -1) {
+      pair_rank[before] = merge_rank_after(rules, tokens[before], tokens[pos], rank);
+      if (pair_rank[before] != -1)
+        rank_heap_push(&heap, &heap_size, &ctx->heap_capacity, rank_heap_key(pair_rank[before], before));
+    }
+  }
+
+  ctx->heap = heap;
+  return live;
+}
+
+void text_cutter_init(TextCutter *cutter, const MergeRules *rules, const uint8_t *text, SeqIndex text_len) {
+  cutter->rules = rules;
+  cutter->text = text;
+  cutter->text_len = text_len;
+  cutter->chunk_end = 0;
+}
+
+// Chunks are found from the start of the text, as training found them, so
+// the walk only moves forward. Only chunk ends are cut for pretokenized
+// rules: the pre-tokenizer restarts cleanly there and nowhere else.
+SeqIndex text_cutter_next(TextCutter *cutter, SeqIndex from) {
+  if (from < 1)
+    from = 1;
+  if (cutter->rules->pretokenize) {
+    while (cutter->chunk_end < from && cutter->chunk_end < cutter->text_len)
+      cutter->chunk_end = pretokenize_next(cutter->text, cutter->text_len, cutter->chunk_end);
+    return cutter->chunk_end;
+  }
+  for (SeqIndex end = from; end < cutter->text_len; end++) {
+    if (!merge_can_join(cutter->rules, cutter->text[end - 1], cutter->text[end]))
+      return end;
+  }
+  return cutter->text_len;
+}
+
+// The text is cut into pieces of at least min_bytes that encode on their own
+// with the same result. Small pieces keep the heap short and in cache.
+// Pretokenized rules still join pairs across chunks, so there every chunk is
+// a piece of its own.
+#define ENCODE_PIECE_BYTES 4096
+
+static SeqIndex piece_end(TextCutter *cutter, SeqIndex start, SeqIndex min_bytes) {
+  return text_cutter_next(cutter, start + (cutter->rules->pretokenize ? 1 : min_bytes));
+}
+
+// Each piece is widened right after the tokens kept so far and packed down
+// onto them once merged.
+SeqIndex encode_in_context(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules) {
+  encoder_context_reserve(ctx, text_len);
+  if (rules->rank_map.keys == NULL)
+    build_merge_ranks(rules);
+
+  TextCutter cutter;
+  text_cutter_init(&cutter, rules, text, text_len);
+  SeqIndex written = 0;
+  for (SeqIndex start = 0; start < text_len;) {
+    SeqIndex end = piece_end(&cutter, start, ENCODE_PIECE_BYTES);
+    int *piece = ctx->tokens + written;
+    widen_bytes(text + start, piece, end - start);
+    if (end - start > 0 && merge_piece(ctx, piece, end - start, rules) < end - start) {
+      for (SeqIndex idx = 0; idx != -1; idx = ctx->next[idx])
+        ctx->tokens[written++] = piece[idx];
+    } else {
+      written += end - start;
+    }
+    start = end;
+  }
+  return written;
+}
+
+SeqIndex count_tokens(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules) {
+  if (rules->rank_map.keys == NULL)
+    build_merge_ranks(rules);
+
+  TextCutter cutter;
+  text_cutter_init(&cutter, rules, text, text_len);
+  SeqIndex count = 0;
+  for (SeqIndex start = 0; start < text_len;) {
+    SeqIndex end = piece_end(&cutter, start, ENCODE_PIECE_BYTES);
+    encoder_context_reserve(ctx, end - start);
+    widen_bytes(text + start, ctx->tokens, end - start);
+    count += merge_piece(ctx, ctx->tokens, end - start, rules);
+    start = end;
+  }
+  return count;
+}
+
+SeqIndex encode_truncated(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules,
+                          SeqIndex max_tokens, SeqIndex *cut_offset) {
+  if (rules->rank_map.keys == NULL)
+    build_merge_ranks(rules);
+
+  // Pieces are sized to a few bytes per token still wanted, so little text
+  // past the cut gets encoded.
+  TextCutter cutter;
+  text_cutter_init(&cutter, rules, text, text_len);
+  SeqIndex written = 0;
+  for (SeqIndex start = 0; start < text_len;) {
+    if (written >= max_tokens) {
+      *cut_offset = start;
+      return written;
+    }
+    SeqIndex left = max_tokens - written;
+    SeqIndex end = piece_end(&cutter, start, left < ENCODE_PIECE_BYTES / 4 ? 4 * left : ENCODE_PIECE_BYTES);
+    encoder_context_reserve(ctx, written + (end - start));
+    int *piece = ctx->tokens + written;
+    widen_bytes(text + start, piece, end - start);
+    merge_piece(ctx, piece, end - start, rules);
+    for (SeqIndex idx = 0; idx != -1; idx = ctx->next[idx]) {
+      if (written == max_tokens) {
+        *cut_offset = start + idx;
+        return written;
+      }
+      ctx->tokens[written++] = piece[idx];
+    }
+    start = end;
+  }
+  *cut_offset = text_len;
+  return written;
+}
+
+SeqIndex encode_into_u32(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules,
+                         uint32_t *out, SeqIndex out_capacity) {
+  SeqIndex count = encode_in_context(ctx, text, text_len, rules);
+  if (count <= out_capacity) {
+    for (SeqIndex i = 0; i < count; i++)
+      out[i] = (uint32_t)ctx->tokens[i];
+  }
+  return count;
+}
+
+SeqIndex encode_into_u16(EncoderContext *ctx, const uint8_t *text, SeqIndex text_len, MergeRules *rules,
+                         uint16_t *out, SeqIndex out_capacity) {
+  if (256 + rules->num_rules > 65536)
+    return -1;
+  SeqIndex count = encode_in_context(ctx, text, text_len, rules);
+  if (count <= out_capacity) {
+    for (SeqIndex i = 0; i < count; i++)
+      out[i] = (uint16_t)ctx->tokens[i];
+  }
+  return count;
+}
+
+// A one-off context whose token buffer becomes the result.
+TokenSequence encode(const uint8_t *text, SeqIndex text_len, MergeRules *rules) {
+  EncoderContext ctx = create_encoder_context(text_len > 0 ? text_len : 1);
+  TokenSequence seq;
+  seq.length = encode_in_context(&ctx, text, text_len, rules);
+  seq.capacity = ctx.capacity;
+  seq.tokens = ctx.tokens;
+  ctx.tokens = NULL;
+  free_encoder_context(&ctx);
   return seq;
 }
 
-uint8_t* decode(TokenSequence *seq, Vocabulary *vocab, int *output_len) {
+uint8_t* decode(TokenSequence *seq, Vocabulary *vocab, SeqIndex *output_len) {
   // First calculate total length needed
-  int total_len = 0;
-  for (int i = 0; i < seq->length; i++)
-    total_len += vocab->tokens[seq->tokens[i]].length;
+  SeqIndex total_len = 0;
+  for (SeqIndex i = 0; i < seq->length; i++)
+    total_len += vocab_token_length(vocab, seq->tokens[i]);
 
   // Allocate output buffer
-  uint8_t *output = malloc(total_len);
+  uint8_t *output = malloc(total_len > 0 ? (size_t)total_len : 1);
   if (output == NULL) {
     fprintf(stderr, "Memory allocation failed");
     exit(1);
   }
 
-  // Copy token bytes into output
-  int pos = 0;
-  for (int i = 0; i < seq->length; i++) {
-    Token *token = &vocab->tokens[seq->tokens[i]];
-    memcpy(output + pos, token->bytes, token->length);
-    pos += token->length;
+  // Copy token bytes into output. Short tokens come straight from their
+  // table entry, so most of decoding reads the table in one pass.
+  SeqIndex pos = 0;
+  for (SeqIndex i = 0; i < seq->length; i++) {
+    const VocabEntry *entry = &vocab->entries[seq->tokens[i]];
+    memcpy(output + pos, entry->length <= VOCAB_INLINE_BYTES ? entry->bytes : vocab->bytes + entry->offset,
+           entry->length);
+    pos += entry->length;
   }
 
   *output_len = total_len;
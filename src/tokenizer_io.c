@@ -13,150 +13,141 @@ static int read_u32(FILE *fp, uint32_t *value) {
   return fread(value, sizeof(uint32_t), 1, fp) == 1 ? 0 : -1;
 }
 
-int save_tokenizer(const char *path, const Vocabulary *vocab, const MergeRules *rules) {
-  FILE *fp = fopen(path, "wb");
-  if (!fp) {
-    perror("fopen");
+int write_tokenizer(FILE *fp, const Vocabulary *vocab, const MergeRules *rules) {
+  const uint8_t magic[4] = {'B', 'P', 'E', 'C'};
+  if (fwrite(magic, 1, 4, fp) != 4)
     return -1;
-  }
 
-  const uint8_t magic[4] = {'B', 'P', 'E', 'C'};
-  if (fwrite(magic, 1, 4, fp) != 4) {
-    fclose(fp);
+  if (write_u32(fp, 2) != 0)  // format version
     return -1;
-  }
 
-  if (write_u32(fp, 1) != 0) {  // format version
-    fclose(fp);
+  // Version 2 adds flags (bit 0 is set for --pretokenize tokenizers) and
+  // stores all token lengths ahead of all token bytes, so both are read in
+  // one go.
+  if (write_u32(fp, rules->pretokenize ? 1 : 0) != 0)
     return -1;
-  }
 
-  if (write_u32(fp, (uint32_t)vocab->size) != 0) {
-    fclose(fp);
+  if (write_u32(fp, (uint32_t)vocab->size) != 0)
     return -1;
-  }
 
   for (int i = 0; i < vocab->size; ++i) {
-    const Token *token = &vocab->tokens[i];
-    if (write_u32(fp, (uint32_t)token->length) != 0) {
-      fclose(fp);
+    if (write_u32(fp, (uint32_t)vocab_token_length(vocab, i)) != 0)
+      return -1;
+  }
+  for (int i = 0; i < vocab->size; ++i) {
+    size_t length = (size_t)vocab_token_length(vocab, i);
+    if (length > 0 && fwrite(vocab_token_bytes(vocab, i), 1, length, fp) != length)
       return -1;
-    }
-    if (token->length > 0) {
-      if (fwrite(token->bytes, 1, token->length, fp) != (size_t)token->length) {
-        fclose(fp);
-        return -1;
-      }
-    }
   }
 
-  if (write_u32(fp, (uint32_t)rules->num_rules) != 0) {
-    fclose(fp);
+  if (write_u32(fp, (uint32_t)rules->num_rules) != 0)
     return -1;
-  }
 
   for (int i = 0; i < rules->num_rules; ++i) {
     const MergeRule *rule = &rules->rules[i];
     if (write_u32(fp, (uint32_t)rule->token1) != 0 ||
         write_u32(fp, (uint32_t)rule->token2) != 0 ||
-        write_u32(fp, (uint32_t)rule->result_token) != 0) {
-      fclose(fp);
+        write_u32(fp, (uint32_t)rule->result_token) != 0)
       return -1;
-    }
   }
 
-  fclose(fp);
   return 0;
 }
 
-static void free_partial_vocab(Vocabulary *vocab) {
-  if (vocab->tokens == NULL)
-    return;
-  for (int i = 0; i < vocab->size; ++i)
-    free_token(&vocab->tokens[i]);
-  free(vocab->tokens);
-  vocab->tokens = NULL;
-  vocab->size = 0;
-  vocab->capacity = 0;
+// Version 1 interleaves each token's length with its bytes.
+static int read_tokens_v1(FILE *fp, Vocabulary *vocab, uint32_t token_count) {
+  for (uint32_t i = 0; i < token_count; ++i) {
+    uint32_t length;
+    if (read_u32(fp, &length) != 0 || length > INT32_MAX)
+      return -1;
+    uint8_t *bytes = append_token(vocab, (int)length);
+    if (length > 0 && fread(bytes, 1, length, fp) != length)
+      return -1;
+  }
+  return 0;
 }
 
-int load_tokenizer(const char *path, Vocabulary *vocab_out, MergeRules *rules_out) {
-  FILE *fp = fopen(path, "rb");
-  if (!fp) {
-    perror("fopen");
+static int read_tokens(FILE *fp, Vocabulary *vocab, uint32_t token_count) {
+  uint32_t *lengths = malloc(sizeof(uint32_t) * (token_count > 0 ? token_count : 1));
+  if (lengths == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  if (fread(lengths, sizeof(uint32_t), token_count, fp) != token_count) {
+    free(lengths);
+    return -1;
+  }
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < token_count; ++i)
+    total += lengths[i];
+  if (total > UINT32_MAX) {
+    free(lengths);
     return -1;
   }
 
+  uint8_t *bytes = malloc(total > 0 ? (size_t)total : 1);
+  if (bytes == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  int result = -1;
+  if (fread(bytes, 1, (size_t)total, fp) == total) {
+    add_tokens(vocab, lengths, (int)token_count, bytes);
+    result = 0;
+  }
+  free(bytes);
+  free(lengths);
+  return result;
+}
+
+int read_tokenizer(FILE *fp, Vocabulary *vocab_out, MergeRules *rules_out) {
   uint8_t magic[4];
   if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "BPEC", 4) != 0) {
     fprintf(stderr, "Invalid tokenizer file header\n");
-    fclose(fp);
     return -1;
   }
 
   uint32_t version;
-  if (read_u32(fp, &version) != 0 || version != 1) {
+  if (read_u32(fp, &version) != 0 || version < 1 || version > 2) {
     fprintf(stderr, "Unsupported tokenizer format version\n");
-    fclose(fp);
     return -1;
   }
 
+  uint32_t flags = 0;
+  if (version >= 2 && read_u32(fp, &flags) != 0)
+    return -1;
+
   uint32_t token_count;
-  if (read_u32(fp, &token_count) != 0) {
-    fclose(fp);
+  if (read_u32(fp, &token_count) != 0)
     return -1;
-  }
 
+  if (token_count > INT32_MAX)
+    return -1;
   Vocabulary vocab = create_vocab((int)token_count);
-
-  for (uint32_t i = 0; i < token_count; ++i) {
-    uint32_t length;
-    if (read_u32(fp, &length) != 0) {
-      free_partial_vocab(&vocab);
-      fclose(fp);
-      return -1;
-    }
-    uint8_t *buffer = NULL;
-    if (length > 0) {
-      buffer = malloc(length);
-      if (!buffer) {
-        free_partial_vocab(&vocab);
-        fclose(fp);
-        return -1;
-      }
-      if (fread(buffer, 1, length, fp) != length) {
-        free(buffer);
-        free_partial_vocab(&vocab);
-        fclose(fp);
-        return -1;
-      }
-    }
-    add_token(&vocab, buffer, (int)length);
-    free(buffer);
+  if ((version == 1 ? read_tokens_v1 : read_tokens)(fp, &vocab, token_count) != 0) {
+    free_vocab(&vocab);
+    return -1;
   }
 
   uint32_t num_rules;
   if (read_u32(fp, &num_rules) != 0) {
-    free_partial_vocab(&vocab);
-    fclose(fp);
+    free_vocab(&vocab);
     return -1;
   }
 
   MergeRules rules = create_merge_rules(num_rules > 0 ? (int)num_rules : 0);
   if (num_rules > 0 && rules.rules == NULL) {
     // Should not happen unless allocation failed.
-    free_partial_vocab(&vocab);
-    fclose(fp);
+    free_vocab(&vocab);
     return -1;
   }
 
   for (uint32_t i = 0; i < num_rules; ++i) {
     uint32_t t1, t2, res;
     if (read_u32(fp, &t1) != 0 || read_u32(fp, &t2) != 0 || read_u32(fp, &res) != 0) {
-      free_partial_vocab(&vocab);
+      free_vocab(&vocab);
       if (rules.rules)
         free(rules.rules);
-      fclose(fp);
       return -1;
     }
     rules.rules[i].token1 = (int)t1;
@@ -164,9 +155,36 @@ int load_tokenizer(const char *path, Vocabulary *vocab_out, MergeRules *rules_ou
     rules.rules[i].result_token = (int)res;
   }
   rules.num_rules = (int)num_rules;
-  fclose(fp);
+  rules.pretokenize = (flags & 1) != 0;
+
+  build_merge_ranks(&rules);
 
   *vocab_out = vocab;
   *rules_out = rules;
   return 0;
 }
+
+int save_tokenizer(const char *path, const Vocabulary *vocab, const MergeRules *rules) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+  int result = write_tokenizer(fp, vocab, rules);
+  if (fclose(fp) != 0)
+    result = -1;
+  return result;
+}
+
+int load_tokenizer(const char *path, Vocabulary *vocab_out, MergeRules *rules_out) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+  // Read the file in large blocks rather than stdio's default few KB.
+  setvbuf(fp, NULL, _IOFBF, 1 << 20);
+  int result = read_tokenizer(fp, vocab_out, rules_out);
+  fclose(fp);
+  return result;
+}
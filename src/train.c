@@ -1,47 +1,26 @@
 #include "train.h"
+#include "checkpoint.h"
+#include "trainer_state.h"
 #include "vocab.h"
 #include "sequence.h"
 #include "merge_rules.h"
-#include "pair_heap.h"
-#include "token.h"
+#include "pair_queue.h"
+#include "tokenizer_io.h"
+#include "train_stats.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdatomic.h>
 #include <time.h>
+#include <sys/resource.h>
 
-typedef struct SeqNode {
-  int token_id;
-  int prev;
-  int next;
-  int occ_index;
-  int active;
-} SeqNode;
-
-typedef struct PairOccurrence {
-  int pair_index;
-  int left_node;
-  int prev_occ;
-  int next_occ;
-  int active;
-} PairOccurrence;
-
-typedef struct {
-  PairOccurrence *items;
-  int size;
-  int capacity;
-  int free_head;
-} OccurrencePool;
-
-typedef struct {
-  uint64_t *keys;
-  int *values;
-  int capacity;
-  int size;
-} PairMap;
+#define MAX_MERGE_BATCH 256
+// Candidates offered to TrainOptions.check_pairs per merge.
+#define CHECK_CANDIDATES 8
 
 typedef struct {
   atomic_int merges_done;
@@ -76,494 +55,211 @@ static void* progress_thread_main(void *arg) {
   return NULL;
 }
 
-typedef struct {
-  SeqNode *nodes;
-  int node_count;
-  int head;
-  int live_count;
-
-  PairEntry *pairs;
-  int pair_count;
-  int pair_capacity;
-  int pair_free_head;
-
-  OccurrencePool occ_pool;
-  PairMap map;
-  PairHeap heap;
-} TrainerState;
-
-static void occ_pool_init(OccurrencePool *pool, int capacity) {
-  pool->items = malloc(sizeof(PairOccurrence) * capacity);
-  if (!pool->items && capacity > 0) {
-    fprintf(stderr, "Failed to allocate occurrence pool\n");
-    exit(1);
-  }
-  pool->capacity = pool->items ? capacity : 0;
-  pool->size = 0;
-  pool->free_head = -1;
-}
+static volatile sig_atomic_t stop_requested = 0;
 
-static void occ_pool_grow(OccurrencePool *pool) {
-  int new_cap = pool->capacity ? pool->capacity * 2 : 128;
-  PairOccurrence *new_items = realloc(pool->items, sizeof(PairOccurrence) * new_cap);
-  if (!new_items) {
-    fprintf(stderr, "Failed to grow occurrence pool\n");
-    exit(1);
-  }
-  pool->items = new_items;
-  pool->capacity = new_cap;
+static void request_stop(int signum) {
+  (void)signum;
+  stop_requested = 1;
 }
 
-static int occ_pool_acquire(OccurrencePool *pool) {
-  if (pool->free_head != -1) {
-    int index = pool->free_head;
-    PairOccurrence *occ = &pool->items[index];
-    pool->free_head = occ->next_occ;
-    occ->prev_occ = -1;
-    occ->next_occ = -1;
-    occ->active = 1;
-    return index;
-  }
-
-  if (pool->size >= pool->capacity)
-    occ_pool_grow(pool);
-
-  int index = pool->size++;
-  PairOccurrence *occ = &pool->items[index];
-  occ->pair_index = -1;
-  occ->left_node = -1;
-  occ->prev_occ = -1;
-  occ->next_occ = -1;
-  occ->active = 1;
-  return index;
+static void write_checkpoint(const TrainOptions *options, const Vocabulary *vocab, const MergeRules *rules,
+                             const TrainerState *state, int target_vocab_size, SeqIndex initial_length) {
+  if (save_checkpoint(options->checkpoint_path, vocab, rules, state, target_vocab_size, initial_length) != 0)
+    fprintf(stderr, "\nWarning: failed to write checkpoint %s\n", options->checkpoint_path);
 }
 
-static void occ_pool_release(OccurrencePool *pool, int index) {
-  PairOccurrence *occ = &pool->items[index];
-  occ->active = 0;
-  occ->next_occ = pool->free_head;
-  occ->prev_occ = -1;
-  pool->free_head = index;
-}
-
-static void occ_pool_free(OccurrencePool *pool) {
-  free(pool->items);
-  pool->items = NULL;
-  pool->capacity = 0;
-  pool->size = 0;
-  pool->free_head = -1;
-}
-
-static inline uint64_t make_pair_key(int left, int right) {
-  return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
-}
-
-static uint64_t hash64(uint64_t x) {
-  x ^= x >> 33;
-  x *= 0xff51afd7ed558ccdULL;
-  x ^= x >> 33;
-  x *= 0xc4ceb9fe1a85ec53ULL;
-  x ^= x >> 33;
-  return x;
-}
+// tok.bin -> tok-4096.bin
+static char *snapshot_file_name(const char *base, int size) {
+  size_t len = strlen(base);
+  const char *dot = strrchr(base, '.');
+  const char *slash = strrchr(base, '/');
+  size_t stem = (dot != NULL && dot != base && (slash == NULL || dot > slash + 1)) ? (size_t)(dot - base) : len;
 
-static int next_pow2(int n) {
-  int p = 1;
-  while (p < n) p <<= 1;
-  return p;
-}
-
-static void pair_map_init(PairMap *map, int capacity_hint) {
-  int cap = next_pow2(capacity_hint > 0 ? capacity_hint : 16);
-  map->capacity = cap;
-  map->size = 0;
-  map->keys = malloc(sizeof(uint64_t) * map->capacity);
-  map->values = malloc(sizeof(int) * map->capacity);
-  if (!map->keys || !map->values) {
-    fprintf(stderr, "Failed to allocate pair map\n");
+  char *name = malloc(len + 16);
+  if (name == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
     exit(1);
   }
-  for (int i = 0; i < map->capacity; i++)
-    map->values[i] = -1;
+  snprintf(name, len + 16, "%.*s-%d%s", (int)stem, base, size, base + stem);
+  return name;
 }
 
-static void pair_map_free(PairMap *map) {
-  free(map->keys);
-  free(map->values);
-  map->keys = NULL;
-  map->values = NULL;
-  map->capacity = 0;
-  map->size = 0;
-}
-
-static int pair_map_find_slot(PairMap *map, uint64_t key) {
-  int mask = map->capacity - 1;
-  int idx = (int)(hash64(key) & mask);
-  while (map->values[idx] != -1 && map->keys[idx] != key)
-    idx = (idx + 1) & mask;
-  return idx;
+static void write_snapshot(const char *base, const Vocabulary *vocab, const MergeRules *rules,
+                           SeqIndex live_count, SeqIndex initial_length) {
+  char *path = snapshot_file_name(base, vocab->size);
+  double compression = live_count > 0 ? (double)initial_length / live_count : 0.0;
+  if (save_tokenizer(path, vocab, rules) != 0)
+    fprintf(stderr, "\nWarning: failed to write snapshot %s\n", path);
+  else
+    printf("Snapshot at vocab size %d: %s (%lld tokens, compression %.2fx)\n", vocab->size, path,
+           (long long)live_count, compression);
+  free(path);
 }
 
-static void pair_map_rehash(PairMap *map, int new_capacity) {
-  PairMap tmp;
-  tmp.capacity = next_pow2(new_capacity);
-  tmp.size = 0;
-  tmp.keys = malloc(sizeof(uint64_t) * tmp.capacity);
-  tmp.values = malloc(sizeof(int) * tmp.capacity);
-  if (!tmp.keys || !tmp.values) {
-    fprintf(stderr, "Failed to grow pair map\n");
-    exit(1);
-  }
-  for (int i = 0; i < tmp.capacity; i++)
-    tmp.values[i] = -1;
-
-  int mask = tmp.capacity - 1;
-  for (int i = 0; i < map->capacity; i++) {
-    if (map->values[i] != -1) {
-      uint64_t key = map->keys[i];
-      int value = map->values[i];
-      int slot = (int)(hash64(key) & mask);
-      while (tmp.values[slot] != -1)
-        slot = (slot + 1) & mask;
-      tmp.keys[slot] = key;
-      tmp.values[slot] = value;
-      tmp.size++;
-    }
+static int batch_shares_token(const TrainerState *state, const int *batch, int size, const PairEntry *entry) {
+  for (int i = 0; i < size; i++) {
+    const PairEntry *member = &state->pairs[batch[i]];
+    if (member->token_left == entry->token_left || member->token_left == entry->token_right ||
+        member->token_right == entry->token_left || member->token_right == entry->token_right)
+      return 1;
   }
-
-  free(map->keys);
-  free(map->values);
-  *map = tmp;
+  return 0;
 }
 
-static void pair_map_set(PairMap *map, uint64_t key, int value) {
-  if ((map->size + 1) * 4 >= map->capacity * 3)
-    pair_map_rehash(map, map->capacity * 2);
-
-  int idx = pair_map_find_slot(map, key);
-  if (map->values[idx] == -1)
-    map->size++;
-  map->keys[idx] = key;
-  map->values[idx] = value;
-}
-
-static int pair_map_get(PairMap *map, uint64_t key) {
-  int idx = pair_map_find_slot(map, key);
-  return map->values[idx];
-}
+// Pops up to limit pairs that one-at-a-time training would merge next, in the
+// same order. Members share no tokens, so no member's merge changes another's
+// count. Every pair a merge creates gets at most the count of a neighbouring
+// pair that already ranked below all members, and its new token id loses any
+// tie. A self pair (a, a) breaks that bound, since (aa, a) comes from its own
+// occurrences, so it can only come last.
+static int pop_merge_batch(TrainerState *state, int *batch, int limit) {
+  int size = 0;
+  while (size < limit) {
+    int pair_index = pair_queue_pop_max(&state->queue, state->pairs);
+    if (pair_index == -1)
+      break;
 
-static void pair_map_remove(PairMap *map, uint64_t key) {
-  int mask = map->capacity - 1;
-  int idx = (int)(hash64(key) & mask);
-  while (map->values[idx] != -1 && map->keys[idx] != key)
-    idx = (idx + 1) & mask;
-  if (map->values[idx] == -1)
-    return;
-
-  map->values[idx] = -1;
-  map->size--;
-
-  int next = (idx + 1) & mask;
-  while (map->values[next] != -1) {
-    uint64_t rekey = map->keys[next];
-    int value = map->values[next];
-    map->values[next] = -1;
-
-    int slot = (int)(hash64(rekey) & mask);
-    while (map->values[slot] != -1)
-      slot = (slot + 1) & mask;
-    map->keys[slot] = rekey;
-    map->values[slot] = value;
-
-    next = (next + 1) & mask;
-  }
-}
+    PairEntry *entry = &state->pairs[pair_index];
+    if (!entry->in_use || entry->count == 0) {
+      pair_queue_remove(&state->queue, state->pairs, pair_index);
+      trainer_release_pair_entry(state, pair_index);
+      continue;
+    }
+    if (batch_shares_token(state, batch, size, entry)) {
+      pair_queue_update(&state->queue, state->pairs, pair_index);
+      break;
+    }
 
-static void trainer_pairs_grow(TrainerState *state) {
-  int new_cap = state->pair_capacity ? state->pair_capacity * 2 : 32;
-  PairEntry *new_pairs = realloc(state->pairs, sizeof(PairEntry) * new_cap);
-  if (!new_pairs) {
-    fprintf(stderr, "Failed to grow pair entries\n");
-    exit(1);
-  }
-  for (int i = state->pair_capacity; i < new_cap; i++) {
-    new_pairs[i].heap_index = -1;
-    new_pairs[i].occ_head = -1;
-    new_pairs[i].count = 0;
-    new_pairs[i].token_left = -1;
-    new_pairs[i].token_right = -1;
-    new_pairs[i].next_free = -1;
-    new_pairs[i].in_use = 0;
+    batch[size++] = pair_index;
+    if (entry->token_left == entry->token_right)
+      break;
   }
-  state->pairs = new_pairs;
-  state->pair_capacity = new_cap;
+  return size;
 }
 
-static void trainer_pairs_init(TrainerState *state, int capacity_hint) {
-  state->pair_capacity = capacity_hint > 0 ? capacity_hint : 32;
-  state->pair_count = 0;
-  state->pair_free_head = -1;
-  state->pairs = malloc(sizeof(PairEntry) * state->pair_capacity);
-  if (!state->pairs && state->pair_capacity > 0) {
-    fprintf(stderr, "Failed to allocate pair entries\n");
-    exit(1);
+// Pops the top candidates and merges the one the checker ranks first, or the
+// queue's own top one when it declines; the rest go back in the queue.
+static int pop_checked_merge(TrainerState *state, MergeRules *rules, const TrainOptions *options) {
+  int candidates[CHECK_CANDIDATES];
+  uint64_t keys[CHECK_CANDIDATES];
+  SeqIndex counts[CHECK_CANDIDATES];
+  SeqIndex exact[CHECK_CANDIDATES];
+  int n = 0;
+  while (n < CHECK_CANDIDATES) {
+    int pair_index = pair_queue_pop_max(&state->queue, state->pairs);
+    if (pair_index == -1)
+      break;
+    PairEntry *entry = &state->pairs[pair_index];
+    if (!entry->in_use || entry->count == 0) {
+      pair_queue_remove(&state->queue, state->pairs, pair_index);
+      trainer_release_pair_entry(state, pair_index);
+      continue;
+    }
+    candidates[n] = pair_index;
+    keys[n] = make_pair_key(entry->token_left, entry->token_right);
+    counts[n] = entry->count;
+    n++;
   }
-  for (int i = 0; i < state->pair_capacity; i++) {
-    state->pairs[i].heap_index = -1;
-    state->pairs[i].occ_head = -1;
-    state->pairs[i].count = 0;
-    state->pairs[i].token_left = -1;
-    state->pairs[i].token_right = -1;
-    state->pairs[i].next_free = -1;
-    state->pairs[i].in_use = 0;
+  if (n == 0)
+    return -1;
+
+  int best = 0;
+  if (n > 1 && options->check_pairs(options->check_ctx, rules, keys, counts, n, exact)) {
+    // Ties keep the queue's order.
+    for (int i = 1; i < n; i++) {
+      if (exact[i] > exact[best])
+        best = i;
+    }
   }
-}
-
-static int trainer_acquire_pair_entry(TrainerState *state) {
-  int idx;
-  if (state->pair_free_head != -1) {
-    idx = state->pair_free_head;
-    state->pair_free_head = state->pairs[idx].next_free;
-  } else {
-    if (state->pair_count >= state->pair_capacity)
-      trainer_pairs_grow(state);
-    idx = state->pair_count++;
+  for (int i = 0; i < n; i++) {
+    if (i != best)
+      pair_queue_update(&state->queue, state->pairs, candidates[i]);
   }
-
-  PairEntry *entry = &state->pairs[idx];
-  entry->heap_index = -1;
-  entry->occ_head = -1;
-  entry->count = 0;
-  entry->token_left = -1;
-  entry->token_right = -1;
-  entry->next_free = -1;
-  entry->in_use = 1;
-  return idx;
+  return candidates[best];
 }
 
-static void trainer_release_pair_entry(TrainerState *state, int index) {
-  PairEntry *entry = &state->pairs[index];
-  entry->in_use = 0;
-  entry->heap_index = -1;
-  entry->occ_head = -1;
-  entry->count = 0;
-  entry->token_left = -1;
-  entry->token_right = -1;
-  entry->next_free = state->pair_free_head;
-  state->pair_free_head = index;
+TrainOptions default_train_options(void) {
+  TrainOptions options;
+  options.pretokenize = 0;
+  options.threads = 1;
+  options.queue = PAIR_QUEUE_HEAP;
+  options.checkpoint_path = NULL;
+  options.checkpoint_every = 0;
+  options.checkpoint_seconds = 0;
+  options.resume = NULL;
+  options.snapshot_sizes = NULL;
+  options.snapshot_count = 0;
+  options.snapshot_path = NULL;
+  options.batch_merges = 1;
+  options.use_arena = 1;
+  options.document_ends = NULL;
+  options.document_count = 0;
+  options.check_pairs = NULL;
+  options.check_ctx = NULL;
+  options.stats = NULL;
+  options.merge_log_path = NULL;
+  return options;
 }
 
-static void trainer_sequence_init(TrainerState *state, TokenSequence *seq) {
-  state->node_count = seq->length;
-  state->live_count = seq->length;
-  if (state->node_count == 0) {
-    state->nodes = NULL;
-    state->head = -1;
-    return;
-  }
-
-  state->nodes = malloc(sizeof(SeqNode) * state->node_count);
-  if (!state->nodes) {
-    fprintf(stderr, "Failed to allocate sequence nodes\n");
+// out, when not NULL, receives the final tokens in corpus order.
+static int run_training(Vocabulary *vocab, const uint8_t *text, SeqIndex length, int target_vocab_size,
+                        MergeRules *merge_rules, const TrainOptions *options, TokenSequence *out) {
+  TrainOptions defaults = default_train_options();
+  if (options == NULL)
+    options = &defaults;
+
+  // Encoding has to cut the text where training did, so merges already in
+  // merge_rules fix the setting.
+  if (merge_rules->num_rules > 0 && merge_rules->pretokenize != options->pretokenize) {
+    fprintf(stderr, "Training has to match the --pretokenize setting of the merges it continues\n");
     exit(1);
   }
+  merge_rules->pretokenize = options->pretokenize;
 
-  for (int i = 0; i < state->node_count; i++) {
-    SeqNode *node = &state->nodes[i];
-    node->token_id = seq->tokens[i];
-    node->prev = (i == 0) ? -1 : i - 1;
-    node->next = (i == state->node_count - 1) ? -1 : i + 1;
-    node->occ_index = -1;
-    node->active = 1;
-  }
-
-  state->head = state->node_count > 0 ? 0 : -1;
-}
-
-static void pair_entry_remove_occurrence(TrainerState *state, int occ_index, int update_heap) {
-  PairOccurrence *occ = &state->occ_pool.items[occ_index];
-  if (!occ->active)
-    return;
-
-  int pair_index = occ->pair_index;
-  PairEntry *entry = &state->pairs[pair_index];
-
-  if (occ->prev_occ != -1)
-    state->occ_pool.items[occ->prev_occ].next_occ = occ->next_occ;
-  else
-    entry->occ_head = occ->next_occ;
-
-  if (occ->next_occ != -1)
-    state->occ_pool.items[occ->next_occ].prev_occ = occ->prev_occ;
-
-  if (state->nodes[occ->left_node].occ_index == occ_index)
-    state->nodes[occ->left_node].occ_index = -1;
-
-  occ->active = 0;
-  entry->count--;
-  if (entry->count < 0)
-    entry->count = 0;
-
-  occ_pool_release(&state->occ_pool, occ_index);
-
-  if (update_heap)
-    pair_heap_update(&state->heap, state->pairs, pair_index);
-}
-
-static void trainer_detach_occurrence_for_node(TrainerState *state, int node_index) {
-  if (node_index == -1)
-    return;
-  SeqNode *node = &state->nodes[node_index];
-  if (!node->active)
-    return;
-  if (node->occ_index != -1)
-    pair_entry_remove_occurrence(state, node->occ_index, 1);
-}
-
-static void trainer_add_pair_for_node(TrainerState *state, int node_index) {
-  if (node_index == -1)
-    return;
-
-  SeqNode *left = &state->nodes[node_index];
-  if (!left->active) {
-    left->occ_index = -1;
-    return;
-  }
+  printf("Starting BPE training...\n");
+  printf("Initial vocab size: %d\n", vocab->size);
+  printf("Target vocab size: %d\n", target_vocab_size);
 
-  int right_index = left->next;
-  if (right_index == -1) {
-    left->occ_index = -1;
-    return;
+  TrainStats *stats = options->stats;
+  double init_started = train_stats_clock();
+  int initial_vocab_size = vocab->size;
+  SeqIndex initial_length = length;
+  TrainerState state;
+  if (options->resume != NULL) {
+    initial_length = options->resume->initial_length;
+    trainer_state_restore(&state, options->resume, target_vocab_size, options);
+  } else {
+    trainer_state_init(&state, text, length, target_vocab_size, merge_rules, options);
   }
-
-  SeqNode *right = &state->nodes[right_index];
-  if (!right->active) {
-    left->occ_index = -1;
-    return;
+  if (stats != NULL) {
+    stats->sequence_init_seconds = train_stats_clock() - init_started - stats->pair_init_seconds;
+    // Every merge removes a net occurrence, so the pool peaks now.
+    for (SeqIndex i = 0; i < state.node_count; i++)
+      stats->occ_live_high_water += state.occ_pair[i] != -1;
   }
 
-  uint64_t key = make_pair_key(left->token_id, right->token_id);
-  int pair_index = pair_map_get(&state->map, key);
-  if (pair_index == -1) {
-    pair_index = trainer_acquire_pair_entry(state);
-    PairEntry *entry = &state->pairs[pair_index];
-    entry->token_left = left->token_id;
-    entry->token_right = right->token_id;
-    pair_map_set(&state->map, key, pair_index);
+  FILE *merge_log = NULL;
+  if (options->merge_log_path != NULL) {
+    merge_log = fopen(options->merge_log_path, "w");
+    if (merge_log == NULL)
+      fprintf(stderr, "Warning: unable to open merge log %s\n", options->merge_log_path);
   }
 
-  if (left->occ_index != -1)
-    pair_entry_remove_occurrence(state, left->occ_index, 1);
-
-  PairEntry *entry = &state->pairs[pair_index];
-  int occ_idx = occ_pool_acquire(&state->occ_pool);
-  PairOccurrence *occ = &state->occ_pool.items[occ_idx];
-  occ->pair_index = pair_index;
-  occ->left_node = node_index;
-  occ->prev_occ = -1;
-  occ->next_occ = entry->occ_head;
-  occ->active = 1;
-
-  if (entry->occ_head != -1)
-    state->occ_pool.items[entry->occ_head].prev_occ = occ_idx;
-
-  entry->occ_head = occ_idx;
-  entry->count++;
-  left->occ_index = occ_idx;
-
-  pair_heap_update(&state->heap, state->pairs, pair_index);
-}
-
-static void trainer_merge_pair(TrainerState *state, int pair_index, int new_token_id) {
-  PairEntry *entry = &state->pairs[pair_index];
-  int right_token = entry->token_right;
-
-  while (entry->occ_head != -1) {
-    int occ_idx = entry->occ_head;
-    PairOccurrence occ = state->occ_pool.items[occ_idx];
-
-    pair_entry_remove_occurrence(state, occ_idx, 0);
-
-    int left_idx = occ.left_node;
-    SeqNode *left = &state->nodes[left_idx];
-    if (!left->active)
-      continue;
-
-    int right_idx = left->next;
-    if (right_idx == -1)
-      continue;
-    SeqNode *right = &state->nodes[right_idx];
-    if (!right->active || right->token_id != right_token)
-      continue;
-
-    int prev_idx = left->prev;
-    int next_idx = right->next;
-
-    if (prev_idx != -1)
-      trainer_detach_occurrence_for_node(state, prev_idx);
-    trainer_detach_occurrence_for_node(state, right_idx);
-
-    left->token_id = new_token_id;
-
-    left->next = next_idx;
-    if (next_idx != -1)
-      state->nodes[next_idx].prev = left_idx;
-    if (prev_idx != -1)
-      state->nodes[prev_idx].next = left_idx;
-    else
-      state->head = left_idx;
-
-    right->active = 0;
-    right->prev = -1;
-    right->next = -1;
-    right->occ_index = -1;
-    state->live_count--;
-
-    if (prev_idx != -1)
-      trainer_add_pair_for_node(state, prev_idx);
-    trainer_add_pair_for_node(state, left_idx);
+  // Signals only ask the loop to stop; the checkpoint is written between
+  // merges, where the state is consistent.
+  void (*prev_sigint)(int) = SIG_DFL;
+  void (*prev_sigterm)(int) = SIG_DFL;
+  if (options->checkpoint_path != NULL) {
+    stop_requested = 0;
+    prev_sigint = signal(SIGINT, request_stop);
+    prev_sigterm = signal(SIGTERM, request_stop);
   }
-}
-
-static void trainer_state_init(TrainerState *state, TokenSequence *seq) {
-  memset(state, 0, sizeof(*state));
-  trainer_sequence_init(state, seq);
-
-  int hint = seq->length > 0 ? seq->length : 1;
-  occ_pool_init(&state->occ_pool, hint);
-  pair_map_init(&state->map, hint * 2);
-  trainer_pairs_init(state, hint);
-  pair_heap_init(&state->heap, hint);
-
-  for (int idx = state->head; idx != -1; idx = state->nodes[idx].next)
-    trainer_add_pair_for_node(state, idx);
-}
-
-static void trainer_state_free(TrainerState *state) {
-  free(state->nodes);
-  state->nodes = NULL;
-  state->node_count = 0;
-  state->head = -1;
-  state->live_count = 0;
-
-  occ_pool_free(&state->occ_pool);
-  pair_map_free(&state->map);
-  pair_heap_free(&state->heap);
-  free(state->pairs);
-  state->pairs = NULL;
-  state->pair_capacity = 0;
-  state->pair_count = 0;
-  state->pair_free_head = -1;
-}
-
-void train_bpe(Vocabulary *vocab, TokenSequence *seq, int target_vocab_size, MergeRules *merge_rules) {
-  printf("Starting BPE training...\n");
-  printf("Initial vocab size: %d\n", vocab->size);
-  printf("Target vocab size: %d\n", target_vocab_size);
-
-  int initial_length = seq->length;
-  TrainerState state;
-  trainer_state_init(&state, seq);
+  int next_snapshot = 0;
+  while (next_snapshot < options->snapshot_count && options->snapshot_sizes[next_snapshot] <= vocab->size)
+    next_snapshot++;
+  int merges_since_checkpoint = 0;
+  time_t last_checkpoint = time(NULL);
+  int interrupted = 0;
 
   int merges_goal = target_vocab_size > vocab->size ? (target_vocab_size - vocab->size) : 0;
   ProgressTracker tracker;
@@ -580,42 +276,91 @@ void train_bpe(Vocabulary *vocab, TokenSequence *seq, int target_vocab_size, Mer
     }
   }
 
+  int batch[MAX_MERGE_BATCH];
+  int batch_limit = options->batch_merges < 1 ? 1
+                  : options->batch_merges > MAX_MERGE_BATCH ? MAX_MERGE_BATCH : options->batch_merges;
+  double loop_started = train_stats_clock();
+  double last_rate_sample = 0.0;
+
   while (vocab->size < target_vocab_size) {
     if (state.live_count < 2) {
       printf("No more pairs to merge!\n");
       break;
     }
 
-    int pair_index = pair_heap_pop_max(&state.heap, state.pairs);
-    if (pair_index == -1) {
+    int remaining = target_vocab_size - vocab->size;
+    int batch_size;
+    if (options->check_pairs != NULL) {
+      batch[0] = pop_checked_merge(&state, merge_rules, options);
+      batch_size = batch[0] != -1;
+    } else {
+      batch_size = pop_merge_batch(&state, batch, remaining < batch_limit ? remaining : batch_limit);
+    }
+    if (batch_size == 0) {
       printf("No more pairs to merge!\n");
       break;
     }
 
-    PairEntry *entry = &state.pairs[pair_index];
-    if (!entry->in_use || entry->count == 0) {
-      pair_heap_remove(&state.heap, state.pairs, pair_index);
-      trainer_release_pair_entry(&state, pair_index);
-      continue;
-    }
+    for (int b = 0; b < batch_size; b++) {
+      int pair_index = batch[b];
+      PairEntry *entry = &state.pairs[pair_index];
+      int left_token = entry->token_left;
+      int right_token = entry->token_right;
+      SeqIndex count = entry->count;
 
-    int left_token = entry->token_left;
-    int right_token = entry->token_right;
+      int new_idx = add_merged_token(vocab, left_token, right_token);
+      add_merge_rule(merge_rules, left_token, right_token, new_idx);
 
-    Token merged = merge_tokens(&vocab->tokens[left_token],
-                                 &vocab->tokens[right_token]);
+      trainer_merge_pair(&state, pair_index, new_idx);
+      if (merge_log != NULL)
+        write_merge_log_entry(merge_log, merge_rules->num_rules, left_token, right_token, new_idx,
+                              vocab_token_bytes(vocab, new_idx), vocab_token_length(vocab, new_idx), count,
+                              train_stats_clock() - loop_started);
 
-    int new_idx = add_token(vocab, merged.bytes, merged.length);
-    add_merge_rule(merge_rules, left_token, right_token, new_idx);
-
-    trainer_merge_pair(&state, pair_index, new_idx);
+      pair_map_remove(&state.map, make_pair_key(left_token, right_token));
+      pair_queue_remove(&state.queue, state.pairs, pair_index);
+      trainer_release_pair_entry(&state, pair_index);
 
-    pair_map_remove(&state.map, make_pair_key(left_token, right_token));
-    pair_heap_remove(&state.heap, state.pairs, pair_index);
-    trainer_release_pair_entry(&state, pair_index);
+      // Each merge adds exactly one token, so every listed size is hit.
+      if (next_snapshot < options->snapshot_count && options->snapshot_sizes[next_snapshot] == vocab->size) {
+        write_snapshot(options->snapshot_path, vocab, merge_rules, state.live_count, initial_length);
+        next_snapshot++;
+      }
+    }
+    trainer_flush_counts(&state);
     if (progress_started)
-      atomic_fetch_add_explicit(&tracker.merges_done, 1, memory_order_relaxed);
-    free_token(&merged);
+      atomic_fetch_add_explicit(&tracker.merges_done, batch_size, memory_order_relaxed);
+    if (stats != NULL) {
+      double elapsed = train_stats_clock() - loop_started;
+      if (elapsed - last_rate_sample >= 1.0) {
+        train_stats_add_rate(stats, elapsed, vocab->size - initial_vocab_size);
+        last_rate_sample = elapsed;
+      }
+    }
+
+    if (options->checkpoint_path == NULL)
+      continue;
+    if (stop_requested) {
+      write_checkpoint(options, vocab, merge_rules, &state, target_vocab_size, initial_length);
+      interrupted = 1;
+      break;
+    }
+    merges_since_checkpoint += batch_size;
+    if ((options->checkpoint_every > 0 && merges_since_checkpoint >= options->checkpoint_every) ||
+        (options->checkpoint_seconds > 0 && time(NULL) - last_checkpoint >= options->checkpoint_seconds)) {
+      write_checkpoint(options, vocab, merge_rules, &state, target_vocab_size, initial_length);
+      merges_since_checkpoint = 0;
+      last_checkpoint = time(NULL);
+    }
+  }
+
+  double loop_finished = train_stats_clock();
+  if (merge_log != NULL)
+    fclose(merge_log);
+
+  if (options->checkpoint_path != NULL) {
+    signal(SIGINT, prev_sigint);
+    signal(SIGTERM, prev_sigterm);
   }
 
   if (progress_started) {
@@ -623,29 +368,101 @@ void train_bpe(Vocabulary *vocab, TokenSequence *seq, int target_vocab_size, Mer
     pthread_join(progress_thread, NULL);
   }
 
-  int pos = 0;
-  for (int idx = state.head; idx != -1; idx = state.nodes[idx].next) {
-    if (!state.nodes[idx].active)
-      continue;
-    seq->tokens[pos++] = state.nodes[idx].token_id;
+  if (!interrupted && next_snapshot < options->snapshot_count)
+    fprintf(stderr, "Warning: training stopped at vocab size %d; %d snapshot(s) not written\n", vocab->size,
+            options->snapshot_count - next_snapshot);
+
+  SeqIndex final_length = state.live_count;
+  if (out != NULL) {
+    SeqIndex pos = 0;
+    if (state.chunks.first_node != NULL) {
+      for (SeqIndex i = 0; i < state.chunks.order_len; i++) {
+        SeqIndex idx = state.chunks.first_node[state.chunks.order[i]];
+        for (; idx != -1; idx = state.next[idx])
+          out->tokens[pos++] = node_token(&state, idx);
+      }
+    } else {
+      for (SeqIndex idx = state.head; idx != -1; idx = state.next[idx])
+        out->tokens[pos++] = node_token(&state, idx);
+    }
+    out->length = pos;
+  }
+
+  if (stats != NULL) {
+    stats->merge_seconds = loop_finished - loop_started;
+    train_stats_add_rate(stats, stats->merge_seconds, vocab->size - initial_vocab_size);
+    stats->merges = vocab->size - initial_vocab_size;
+    stats->vocab_size = vocab->size;
+    stats->initial_length = initial_length;
+    stats->final_length = final_length;
+    stats->queue_pops = state.queue.pops;
+    stats->queue_updates = state.queue.updates;
+    stats->queue_removes = state.queue.removes;
+    stats->map_lookups = state.map.lookups;
+    stats->map_probes = state.map.probes;
+    stats->map_longest_probe = state.map.longest_probe;
+    stats->map_rehashes = state.map.rehashes;
+    stats->map_capacity = state.map.capacity;
+    stats->map_size = state.map.size;
+    stats->pair_entries_high_water = state.pair_count;
+    stats->pair_capacity = state.pair_capacity;
+    stats->occ_slots = state.node_count;
+    stats->merge_sites_high_water = state.merge_sites_peak;
   }
-  seq->length = pos;
 
   trainer_state_free(&state);
 
-  printf("\nTraining complete!\n");
+  if (stats != NULL) {
+    stats->writeback_seconds = train_stats_clock() - loop_finished;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+      stats->peak_rss_kb = usage.ru_maxrss;
+  }
+
+  if (interrupted)
+    printf("\nTraining interrupted, checkpoint written to %s\n", options->checkpoint_path);
+  else
+    printf("\nTraining complete!\n");
   printf("Final vocab size: %d\n", vocab->size);
-  printf("Final sequence length: %d\n", seq->length);
-  printf("Initial sequence length: %d tokens\n", initial_length);
+  printf("Final sequence length: %lld\n", (long long)final_length);
+  printf("Initial sequence length: %lld tokens\n", (long long)initial_length);
 
-  float compression = (seq->length > 0) ? (float)initial_length / seq->length : 0.0f;
-  int reduced = initial_length - seq->length;
+  float compression = (final_length > 0) ? (float)initial_length / final_length : 0.0f;
+  SeqIndex reduced = initial_length - final_length;
   float percent = (initial_length > 0) ? (100.0f * reduced) / initial_length : 0.0f;
 
-  if (seq->length > 0)
+  if (final_length > 0)
     printf("Compression ratio: %.2fx\n", compression);
   else
     printf("Compression ratio: N/A (sequence collapsed)\n");
 
-  printf("Tokens reduced by: %d (%.1f%%)\n", reduced, percent);
+  printf("Tokens reduced by: %lld (%.1f%%)\n", (long long)reduced, percent);
+  return interrupted;
+}
+
+int train_bpe(Vocabulary *vocab, TokenSequence *seq, int target_vocab_size, MergeRules *merge_rules,
+              const TrainOptions *options) {
+  uint8_t *bytes = NULL;
+  if (options == NULL || options->resume == NULL) {
+    bytes = malloc(seq->length > 0 ? (size_t)seq->length : 1);
+    if (!bytes) {
+      fprintf(stderr, "Failed to allocate training bytes\n");
+      exit(1);
+    }
+    for (SeqIndex i = 0; i < seq->length; i++) {
+      if (seq->tokens[i] < 0 || seq->tokens[i] > 255) {
+        fprintf(stderr, "train_bpe expects a byte-level sequence\n");
+        exit(1);
+      }
+      bytes[i] = (uint8_t)seq->tokens[i];
+    }
+  }
+  int interrupted = run_training(vocab, bytes, seq->length, target_vocab_size, merge_rules, options, seq);
+  free(bytes);
+  return interrupted;
+}
+
+int train_bpe_text(Vocabulary *vocab, const uint8_t *text, SeqIndex length, int target_vocab_size,
+                   MergeRules *merge_rules, const TrainOptions *options) {
+  return run_training(vocab, text, length, target_vocab_size, merge_rules, options, NULL);
 }
@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L
+#include "train_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void train_stats_init(TrainStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void free_train_stats(TrainStats *stats) {
+  free(stats->rate);
+  memset(stats, 0, sizeof(*stats));
+}
+
+double train_stats_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void train_stats_add_rate(TrainStats *stats, double seconds, int merges) {
+  if (stats->rate_count == stats->rate_capacity) {
+    int new_cap = stats->rate_capacity ? stats->rate_capacity * 2 : 64;
+    MergeRateSample *rate = realloc(stats->rate, sizeof(MergeRateSample) * (size_t)new_cap);
+    if (rate == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    stats->rate = rate;
+    stats->rate_capacity = new_cap;
+  }
+  stats->rate[stats->rate_count].seconds = seconds;
+  stats->rate[stats->rate_count].merges = merges;
+  stats->rate_count++;
+}
+
+static void write_json_bytes(FILE *out, const uint8_t *bytes, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    uint8_t c = bytes[i];
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c >= 0x20 && c < 0x7f)
+      fputc(c, out);
+    else
+      fprintf(out, "\\u%04x", c);
+  }
+  fputc('"', out);
+}
+
+void write_merge_log_entry(FILE *log, int rank, int left, int right, int token, const uint8_t *bytes,
+                           int length, SeqIndex count, double seconds) {
+  fprintf(log, "{\"rank\": %d, \"left\": %d, \"right\": %d, \"token\": %d, \"bytes\": ", rank, left, right,
+          token);
+  write_json_bytes(log, bytes, length);
+  fprintf(log, ", \"count\": %lld, \"seconds\": %.6f}\n", (long long)count, seconds);
+}
+
+int write_train_stats(const char *path, const TrainStats *stats) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return -1;
+
+  double total = stats->read_seconds + stats->sequence_init_seconds + stats->pair_init_seconds +
+                 stats->merge_seconds + stats->writeback_seconds;
+  fprintf(out, "{\n");
+  fprintf(out, "  \"phases\": {\n");
+  fprintf(out, "    \"read\": %.6f,\n", stats->read_seconds);
+  fprintf(out, "    \"sequence_init\": %.6f,\n", stats->sequence_init_seconds);
+  fprintf(out, "    \"pair_init\": %.6f,\n", stats->pair_init_seconds);
+  fprintf(out, "    \"merge_loop\": %.6f,\n", stats->merge_seconds);
+  fprintf(out, "    \"writeback\": %.6f,\n", stats->writeback_seconds);
+  fprintf(out, "    \"total\": %.6f\n", total);
+  fprintf(out, "  },\n");
+
+  fprintf(out, "  \"merges\": %d,\n", stats->merges);
+  fprintf(out, "  \"vocab_size\": %d,\n", stats->vocab_size);
+  fprintf(out, "  \"initial_length\": %lld,\n", (long long)stats->initial_length);
+  fprintf(out, "  \"final_length\": %lld,\n", (long long)stats->final_length);
+  fprintf(out, "  \"merges_per_second\": %.1f,\n",
+          stats->merge_seconds > 0 ? stats->merges / stats->merge_seconds : 0.0);
+
+  // Rate over each interval between samples.
+  fprintf(out, "  \"merge_rate\": [");
+  double last_seconds = 0.0;
+  int last_merges = 0;
+  for (int i = 0; i < stats->rate_count; i++) {
+    const MergeRateSample *sample = &stats->rate[i];
+    double span = sample->seconds - last_seconds;
+    fprintf(out, "%s\n    {\"seconds\": %.3f, \"merges\": %d, \"merges_per_second\": %.1f}", i ? "," : "",
+            sample->seconds, sample->merges, span > 0 ? (sample->merges - last_merges) / span : 0.0);
+    last_seconds = sample->seconds;
+    last_merges = sample->merges;
+  }
+  fprintf(out, "%s],\n", stats->rate_count ? "\n  " : "");
+
+  fprintf(out, "  \"queue\": {\"pops\": %llu, \"updates\": %llu, \"removes\": %llu, \"total\": %llu},\n",
+          (unsigned long long)stats->queue_pops, (unsigned long long)stats->queue_updates,
+          (unsigned long long)stats->queue_removes,
+          (unsigned long long)(stats->queue_pops + stats->queue_updates + stats->queue_removes));
+  fprintf(out, "  \"pair_map\": {\"lookups\": %llu, \"probes\": %llu, \"mean_probe\": %.3f, "
+               "\"longest_probe\": %d, \"rehashes\": %d, \"capacity\": %d, \"size\": %d},\n",
+          (unsigned long long)stats->map_lookups, (unsigned long long)stats->map_probes,
+          stats->map_lookups > 0 ? (double)stats->map_probes / stats->map_lookups : 0.0,
+          stats->map_longest_probe, stats->map_rehashes, stats->map_capacity, stats->map_size);
+  fprintf(out, "  \"pair_entries\": {\"high_water\": %d, \"capacity\": %d},\n", stats->pair_entries_high_water,
+          stats->pair_capacity);
+  fprintf(out, "  \"occurrences\": {\"slots\": %lld, \"live_high_water\": %lld, \"merge_sites_high_water\": %lld},\n",
+          (long long)stats->occ_slots, (long long)stats->occ_live_high_water,
+          (long long)stats->merge_sites_high_water);
+  fprintf(out, "  \"peak_rss_kb\": %ld\n", stats->peak_rss_kb);
+  fprintf(out, "}\n");
+
+  return fclose(out) == 0 ? 0 : -1;
+}
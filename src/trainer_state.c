@@ -0,0 +1,1141 @@
+#include "trainer_state.h"
+#include "pair_heap.h"
+#include "pair_queue.h"
+#include "parallel_merge.h"
+#include "pretokenize.h"
+#include "sequence.h"
+#include "train_stats.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Allocates the node columns. Tokens are stored in 16 bits when every id
+// below vocab_limit fits.
+static void trainer_nodes_alloc(TrainerState *state, SeqIndex count, int vocab_limit) {
+  size_t n = count > 0 ? (size_t)count : 1;
+  state->node_count = count;
+  if (vocab_limit <= UINT16_MAX + 1)
+    state->tokens16 = arena_alloc(&state->arena, sizeof(uint16_t) * n);
+  else
+    state->tokens32 = arena_alloc(&state->arena, sizeof(int) * n);
+  state->prev = arena_alloc(&state->arena, sizeof(SeqIndex) * n);
+  state->next = arena_alloc(&state->arena, sizeof(SeqIndex) * n);
+  if ((!state->tokens16 && !state->tokens32) || !state->prev || !state->next) {
+    fprintf(stderr, "Failed to allocate sequence nodes\n");
+    exit(1);
+  }
+}
+
+// A node is the left side of at most one adjacent pair, so occurrence slot i
+// always belongs to node i. No free list is needed and shards can fill their
+// own slots in place.
+static void trainer_occ_alloc(TrainerState *state) {
+  size_t n = state->node_count > 0 ? (size_t)state->node_count : 1;
+  state->occ_pair = arena_alloc(&state->arena, sizeof(int) * n);
+  state->occ_prev = arena_alloc(&state->arena, sizeof(SeqIndex) * n);
+  state->occ_next = arena_alloc(&state->arena, sizeof(SeqIndex) * n);
+  if (!state->occ_pair || !state->occ_prev || !state->occ_next) {
+    fprintf(stderr, "Failed to allocate occurrence pool\n");
+    exit(1);
+  }
+}
+
+static SeqIndex next_pow2(SeqIndex n) {
+  SeqIndex p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+static void pair_map_init(PairMap *map, int capacity_hint, Arena *arena) {
+  int cap = (int)next_pow2(capacity_hint > 0 ? capacity_hint : 16);
+  map->arena = arena;
+  map->capacity = cap;
+  map->size = 0;
+  map->lookups = 0;
+  map->probes = 0;
+  map->longest_probe = 0;
+  map->rehashes = 0;
+  map->keys = arena_alloc(arena, sizeof(uint64_t) * map->capacity);
+  map->values = arena_alloc(arena, sizeof(int) * map->capacity);
+  if (!map->keys || !map->values) {
+    fprintf(stderr, "Failed to allocate pair map\n");
+    exit(1);
+  }
+  for (int i = 0; i < map->capacity; i++)
+    map->values[i] = -1;
+}
+
+static void pair_map_free(PairMap *map) {
+  arena_release(map->arena, map->keys);
+  arena_release(map->arena, map->values);
+  map->keys = NULL;
+  map->values = NULL;
+  map->capacity = 0;
+  map->size = 0;
+}
+
+static int pair_map_find_slot(const PairMap *map, uint64_t key, int *probes) {
+  int mask = map->capacity - 1;
+  int idx = (int)(hash64(key) & mask);
+  int steps = 0;
+  while (map->values[idx] != -1 && map->keys[idx] != key) {
+    idx = (idx + 1) & mask;
+    steps++;
+  }
+  *probes = steps;
+  return idx;
+}
+
+static int pair_map_find_counted(PairMap *map, uint64_t key) {
+  int probes;
+  int idx = pair_map_find_slot(map, key, &probes);
+  map->lookups++;
+  map->probes += (uint64_t)probes;
+  if (probes > map->longest_probe)
+    map->longest_probe = probes;
+  return idx;
+}
+
+static void pair_map_rehash(PairMap *map, int new_capacity) {
+  if (new_capacity > INT_MAX / 2) {
+    fprintf(stderr, "Too many distinct pairs for the pair map\n");
+    exit(1);
+  }
+  PairMap tmp = *map;
+  tmp.capacity = (int)next_pow2(new_capacity);
+  tmp.size = 0;
+  tmp.keys = arena_alloc(tmp.arena, sizeof(uint64_t) * tmp.capacity);
+  tmp.values = arena_alloc(tmp.arena, sizeof(int) * tmp.capacity);
+  if (!tmp.keys || !tmp.values) {
+    fprintf(stderr, "Failed to grow pair map\n");
+    exit(1);
+  }
+  for (int i = 0; i < tmp.capacity; i++)
+    tmp.values[i] = -1;
+
+  int mask = tmp.capacity - 1;
+  for (int i = 0; i < map->capacity; i++) {
+    if (map->values[i] != -1) {
+      uint64_t key = map->keys[i];
+      int value = map->values[i];
+      int slot = (int)(hash64(key) & mask);
+      while (tmp.values[slot] != -1)
+        slot = (slot + 1) & mask;
+      tmp.keys[slot] = key;
+      tmp.values[slot] = value;
+      tmp.size++;
+    }
+  }
+
+  arena_release(map->arena, map->keys);
+  arena_release(map->arena, map->values);
+  tmp.rehashes++;
+  *map = tmp;
+}
+
+void pair_map_set(PairMap *map, uint64_t key, int value) {
+  if ((map->size + 1) * 4 >= map->capacity * 3)
+    pair_map_rehash(map, map->capacity * 2);
+
+  int idx = pair_map_find_counted(map, key);
+  if (map->values[idx] == -1)
+    map->size++;
+  map->keys[idx] = key;
+  map->values[idx] = value;
+}
+
+int pair_map_get(PairMap *map, uint64_t key) {
+  int idx = pair_map_find_counted(map, key);
+  return map->values[idx];
+}
+
+int pair_map_lookup(const PairMap *map, uint64_t key) {
+  int probes;
+  int idx = pair_map_find_slot(map, key, &probes);
+  return map->values[idx];
+}
+
+void pair_map_remove(PairMap *map, uint64_t key) {
+  int mask = map->capacity - 1;
+  int idx = pair_map_find_counted(map, key);
+  if (map->values[idx] == -1)
+    return;
+
+  map->values[idx] = -1;
+  map->size--;
+
+  int next = (idx + 1) & mask;
+  while (map->values[next] != -1) {
+    uint64_t rekey = map->keys[next];
+    int value = map->values[next];
+    map->values[next] = -1;
+
+    int slot = (int)(hash64(rekey) & mask);
+    while (map->values[slot] != -1)
+      slot = (slot + 1) & mask;
+    map->keys[slot] = rekey;
+    map->values[slot] = value;
+
+    next = (next + 1) & mask;
+  }
+}
+
+static void trainer_pending_grow(TrainerState *state, int old_cap, int new_cap) {
+  Arena *arena = &state->arena;
+  SeqIndex *count_delta = arena_realloc(arena, state->count_delta, sizeof(SeqIndex) * old_cap,
+                                        sizeof(SeqIndex) * new_cap);
+  uint8_t *dirty_mark = arena_realloc(arena, state->dirty_mark, old_cap, new_cap);
+  int *dirty = arena_realloc(arena, state->dirty, sizeof(int) * old_cap, sizeof(int) * new_cap);
+  if (!count_delta || !dirty_mark || !dirty) {
+    fprintf(stderr, "Failed to grow pending pair counts\n");
+    exit(1);
+  }
+  memset(count_delta + old_cap, 0, sizeof(SeqIndex) * (new_cap - old_cap));
+  memset(dirty_mark + old_cap, 0, new_cap - old_cap);
+  state->count_delta = count_delta;
+  state->dirty_mark = dirty_mark;
+  state->dirty = dirty;
+}
+
+static void trainer_pairs_grow(TrainerState *state) {
+  if (state->pair_capacity > INT_MAX / 2) {
+    fprintf(stderr, "Too many distinct pairs\n");
+    exit(1);
+  }
+  int new_cap = state->pair_capacity ? state->pair_capacity * 2 : 32;
+  PairEntry *new_pairs = arena_realloc(&state->arena, state->pairs, sizeof(PairEntry) * state->pair_capacity,
+                                       sizeof(PairEntry) * new_cap);
+  if (!new_pairs) {
+    fprintf(stderr, "Failed to grow pair entries\n");
+    exit(1);
+  }
+  for (int i = state->pair_capacity; i < new_cap; i++) {
+    new_pairs[i].heap_index = -1;
+    new_pairs[i].occ_head = -1;
+    new_pairs[i].count = 0;
+    new_pairs[i].token_left = -1;
+    new_pairs[i].token_right = -1;
+    new_pairs[i].next_free = -1;
+    new_pairs[i].in_use = 0;
+  }
+  trainer_pending_grow(state, state->pair_capacity, new_cap);
+  state->pairs = new_pairs;
+  state->pair_capacity = new_cap;
+}
+
+static void trainer_pairs_init(TrainerState *state, int capacity_hint) {
+  state->pair_capacity = capacity_hint > 0 ? capacity_hint : 32;
+  state->pair_count = 0;
+  state->pair_free_head = -1;
+  state->pairs = arena_alloc(&state->arena, sizeof(PairEntry) * state->pair_capacity);
+  if (!state->pairs && state->pair_capacity > 0) {
+    fprintf(stderr, "Failed to allocate pair entries\n");
+    exit(1);
+  }
+  for (int i = 0; i < state->pair_capacity; i++) {
+    state->pairs[i].heap_index = -1;
+    state->pairs[i].occ_head = -1;
+    state->pairs[i].count = 0;
+    state->pairs[i].token_left = -1;
+    state->pairs[i].token_right = -1;
+    state->pairs[i].next_free = -1;
+    state->pairs[i].in_use = 0;
+  }
+  trainer_pending_grow(state, 0, state->pair_capacity);
+}
+
+int trainer_acquire_pair_entry(TrainerState *state) {
+  int idx;
+  if (state->pair_free_head != -1) {
+    idx = state->pair_free_head;
+    state->pair_free_head = state->pairs[idx].next_free;
+  } else {
+    if (state->pair_count >= state->pair_capacity)
+      trainer_pairs_grow(state);
+    idx = state->pair_count++;
+  }
+
+  PairEntry *entry = &state->pairs[idx];
+  entry->heap_index = -1;
+  entry->occ_head = -1;
+  entry->count = 0;
+  entry->token_left = -1;
+  entry->token_right = -1;
+  entry->next_free = -1;
+  entry->in_use = 1;
+  return idx;
+}
+
+void trainer_release_pair_entry(TrainerState *state, int index) {
+  PairEntry *entry = &state->pairs[index];
+  entry->in_use = 0;
+  entry->heap_index = -1;
+  entry->occ_head = -1;
+  entry->count = 0;
+  entry->token_left = -1;
+  entry->token_right = -1;
+  entry->next_free = state->pair_free_head;
+  state->pair_free_head = index;
+  state->count_delta[index] = 0;
+}
+
+// Links n nodes into one list; the caller fills in their tokens.
+static void trainer_sequence_init(TrainerState *state, SeqIndex n, int vocab_limit) {
+  trainer_nodes_alloc(state, n, vocab_limit);
+  state->live_count = n;
+
+  for (SeqIndex i = 0; i < n; i++) {
+    state->prev[i] = i - 1;
+    state->next[i] = (i == n - 1) ? -1 : i + 1;
+  }
+
+  state->head = n > 0 ? 0 : -1;
+}
+
+typedef struct {
+  const uint8_t *bytes;
+  SeqIndex *offsets;
+  SeqIndex *lengths;
+  SeqIndex *weights;
+  SeqIndex count;
+  SeqIndex capacity;
+  SeqIndex *slots;
+  SeqIndex slot_capacity;
+} ChunkTable;
+
+static uint64_t hash_bytes(const uint8_t *bytes, SeqIndex len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (SeqIndex i = 0; i < len; i++) {
+    h ^= bytes[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static void chunk_table_init(ChunkTable *table, const uint8_t *bytes, SeqIndex capacity_hint) {
+  table->bytes = bytes;
+  table->count = 0;
+  table->capacity = capacity_hint > 0 ? capacity_hint : 16;
+  table->offsets = malloc(sizeof(SeqIndex) * table->capacity);
+  table->lengths = malloc(sizeof(SeqIndex) * table->capacity);
+  table->weights = malloc(sizeof(SeqIndex) * table->capacity);
+  table->slot_capacity = next_pow2(table->capacity * 2);
+  table->slots = malloc(sizeof(SeqIndex) * table->slot_capacity);
+  if (!table->offsets || !table->lengths || !table->weights || !table->slots) {
+    fprintf(stderr, "Failed to allocate chunk table\n");
+    exit(1);
+  }
+  for (SeqIndex i = 0; i < table->slot_capacity; i++)
+    table->slots[i] = -1;
+}
+
+static void chunk_table_free(ChunkTable *table) {
+  free(table->offsets);
+  free(table->lengths);
+  free(table->weights);
+  free(table->slots);
+  table->offsets = NULL;
+  table->lengths = NULL;
+  table->weights = NULL;
+  table->slots = NULL;
+  table->count = 0;
+  table->capacity = 0;
+  table->slot_capacity = 0;
+}
+
+static void chunk_table_rehash(ChunkTable *table) {
+  SeqIndex new_cap = table->slot_capacity * 2;
+  SeqIndex *slots = malloc(sizeof(SeqIndex) * (size_t)new_cap);
+  if (!slots) {
+    fprintf(stderr, "Failed to grow chunk table\n");
+    exit(1);
+  }
+  for (SeqIndex i = 0; i < new_cap; i++)
+    slots[i] = -1;
+
+  SeqIndex mask = new_cap - 1;
+  for (SeqIndex id = 0; id < table->count; id++) {
+    uint64_t h = hash_bytes(table->bytes + table->offsets[id], table->lengths[id]);
+    SeqIndex slot = (SeqIndex)(h & mask);
+    while (slots[slot] != -1)
+      slot = (slot + 1) & mask;
+    slots[slot] = id;
+  }
+
+  free(table->slots);
+  table->slots = slots;
+  table->slot_capacity = new_cap;
+}
+
+static SeqIndex chunk_table_intern(ChunkTable *table, SeqIndex offset, SeqIndex length) {
+  const uint8_t *chunk = table->bytes + offset;
+  SeqIndex mask = table->slot_capacity - 1;
+  SeqIndex slot = (SeqIndex)(hash_bytes(chunk, length) & mask);
+  while (table->slots[slot] != -1) {
+    SeqIndex id = table->slots[slot];
+    if (table->lengths[id] == length && memcmp(table->bytes + table->offsets[id], chunk, length) == 0) {
+      table->weights[id]++;
+      return id;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (table->count >= table->capacity) {
+    SeqIndex new_cap = table->capacity * 2;
+    SeqIndex *offsets = realloc(table->offsets, sizeof(SeqIndex) * (size_t)new_cap);
+    SeqIndex *lengths = realloc(table->lengths, sizeof(SeqIndex) * (size_t)new_cap);
+    SeqIndex *weights = realloc(table->weights, sizeof(SeqIndex) * (size_t)new_cap);
+    if (!offsets || !lengths || !weights) {
+      fprintf(stderr, "Failed to grow chunk table\n");
+      exit(1);
+    }
+    table->offsets = offsets;
+    table->lengths = lengths;
+    table->weights = weights;
+    table->capacity = new_cap;
+  }
+
+  SeqIndex id = table->count++;
+  table->offsets[id] = offset;
+  table->lengths[id] = length;
+  table->weights[id] = 1;
+  table->slots[slot] = id;
+
+  if (table->count * 4 >= table->slot_capacity * 3)
+    chunk_table_rehash(table);
+  return id;
+}
+
+// Lays the chunks out back to back and links each into its own list. Every
+// node of chunk id carries weights[id], or 1 without weights; callers fill in
+// the tokens.
+static void trainer_chunk_nodes_init(TrainerState *state, SeqIndex *lengths, SeqIndex *weights,
+                                     SeqIndex count, int vocab_limit) {
+  ChunkIndex *chunks = &state->chunks;
+  SeqIndex total_nodes = 0;
+  SeqIndex live = 0;
+  for (SeqIndex id = 0; id < count; id++) {
+    total_nodes += lengths[id];
+    live += lengths[id] * (weights ? weights[id] : 1);
+  }
+
+  trainer_nodes_alloc(state, total_nodes, vocab_limit);
+  state->live_count = live;
+  state->head = -1;
+  chunks->count = count;
+  chunks->first_node = malloc(sizeof(SeqIndex) * (count > 0 ? (size_t)count : 1));
+  if (weights != NULL)
+    state->weights = arena_alloc(&state->arena, sizeof(SeqIndex) * (total_nodes > 0 ? (size_t)total_nodes : 1));
+  if (!chunks->first_node || (weights != NULL && !state->weights)) {
+    fprintf(stderr, "Failed to allocate sequence nodes\n");
+    exit(1);
+  }
+
+  SeqIndex node = 0;
+  for (SeqIndex id = 0; id < count; id++) {
+    SeqIndex len = lengths[id];
+    chunks->first_node[id] = node;
+    for (SeqIndex j = 0; j < len; j++, node++) {
+      state->prev[node] = (j == 0) ? -1 : node - 1;
+      state->next[node] = (j == len - 1) ? -1 : node + 1;
+      if (weights != NULL)
+        state->weights[node] = weights[id];
+    }
+  }
+}
+
+static void trainer_bytes_init(TrainerState *state, const uint8_t *text, SeqIndex length, int vocab_limit) {
+  trainer_sequence_init(state, length, vocab_limit);
+  for (SeqIndex i = 0; i < length; i++)
+    node_set_token(state, i, text[i]);
+}
+
+// Continued training: the corpus starts out as the existing merges would
+// encode it rather than as raw bytes.
+static void trainer_seeded_sequence_init(TrainerState *state, const uint8_t *text, SeqIndex length,
+                                         int vocab_limit, MergeRules *seed_rules) {
+  TokenSequence encoded = encode(text, length, seed_rules);
+  printf("Seeded with %d existing merges: %lld bytes -> %lld tokens\n", seed_rules->num_rules,
+         (long long)length, (long long)encoded.length);
+  trainer_sequence_init(state, encoded.length, vocab_limit);
+  for (SeqIndex i = 0; i < encoded.length; i++)
+    node_set_token(state, i, encoded.tokens[i]);
+  free_sequence(&encoded);
+}
+
+// Documents keep their corpus order as chunks of weight 1, each linked into
+// its own list, so no pair ever spans two documents.
+static void trainer_documents_init(TrainerState *state, const uint8_t *text, SeqIndex length, int vocab_limit,
+                                   MergeRules *seed_rules, const SeqIndex *doc_ends, SeqIndex doc_count) {
+  SeqIndex *lengths = malloc(sizeof(SeqIndex) * (size_t)doc_count);
+  ChunkIndex *chunks = &state->chunks;
+  chunks->order = malloc(sizeof(SeqIndex) * (size_t)doc_count);
+  if (!lengths || !chunks->order) {
+    fprintf(stderr, "Failed to allocate documents\n");
+    exit(1);
+  }
+  chunks->order_len = doc_count;
+  for (SeqIndex d = 0; d < doc_count; d++) {
+    lengths[d] = doc_ends[d] - (d > 0 ? doc_ends[d - 1] : 0);
+    chunks->order[d] = d;
+  }
+
+  if (seed_rules == NULL || seed_rules->num_rules == 0) {
+    trainer_chunk_nodes_init(state, lengths, NULL, doc_count, vocab_limit);
+    for (SeqIndex i = 0; i < state->node_count; i++)
+      node_set_token(state, i, text[i]);
+  } else {
+    int *tokens = malloc(sizeof(int) * (length > 0 ? (size_t)length : 1));
+    if (!tokens) {
+      fprintf(stderr, "Failed to allocate seeded documents\n");
+      exit(1);
+    }
+    SeqIndex pos = 0;
+    for (SeqIndex d = 0; d < doc_count; d++) {
+      TokenSequence encoded = encode(text + doc_ends[d] - lengths[d], lengths[d], seed_rules);
+      memcpy(tokens + pos, encoded.tokens, sizeof(int) * (size_t)encoded.length);
+      lengths[d] = encoded.length;
+      pos += encoded.length;
+      free_sequence(&encoded);
+    }
+    printf("Seeded with %d existing merges: %lld bytes -> %lld tokens\n", seed_rules->num_rules,
+           (long long)length, (long long)pos);
+    trainer_chunk_nodes_init(state, lengths, NULL, doc_count, vocab_limit);
+    for (SeqIndex i = 0; i < state->node_count; i++)
+      node_set_token(state, i, tokens[i]);
+    free(tokens);
+  }
+  printf("Corpus documents: %lld\n", (long long)doc_count);
+  free(lengths);
+}
+
+// Merges never cross chunk or document boundaries, so with seed rules each
+// unique chunk is encoded on its own.
+static void trainer_chunks_init(TrainerState *state, const uint8_t *bytes, SeqIndex n, int vocab_limit,
+                                MergeRules *seed_rules, const SeqIndex *doc_ends, SeqIndex doc_count) {
+
+  ChunkTable table;
+  chunk_table_init(&table, bytes, 1024);
+
+  ChunkIndex *chunks = &state->chunks;
+  SeqIndex order_cap = 1024;
+  chunks->order = malloc(sizeof(SeqIndex) * order_cap);
+  chunks->order_len = 0;
+  if (!chunks->order) {
+    fprintf(stderr, "Failed to allocate chunk order\n");
+    exit(1);
+  }
+
+  SeqIndex doc = 0;
+  for (SeqIndex pos = 0; pos < n;) {
+    while (doc < doc_count && doc_ends[doc] <= pos)
+      doc++;
+    SeqIndex doc_start = doc > 0 ? doc_ends[doc - 1] : 0;
+    SeqIndex doc_end = doc < doc_count ? doc_ends[doc] : n;
+    SeqIndex end = doc_start + pretokenize_next(bytes + doc_start, doc_end - doc_start, pos - doc_start);
+    if (chunks->order_len >= order_cap) {
+      order_cap *= 2;
+      SeqIndex *order = realloc(chunks->order, sizeof(SeqIndex) * (size_t)order_cap);
+      if (!order) {
+        fprintf(stderr, "Failed to grow chunk order\n");
+        exit(1);
+      }
+      chunks->order = order;
+    }
+    chunks->order[chunks->order_len++] = chunk_table_intern(&table, pos, end - pos);
+    pos = end;
+  }
+
+  if (seed_rules == NULL || seed_rules->num_rules == 0) {
+    trainer_chunk_nodes_init(state, table.lengths, table.weights, table.count, vocab_limit);
+    for (SeqIndex id = 0; id < table.count; id++) {
+      const uint8_t *chunk = bytes + table.offsets[id];
+      SeqIndex node = chunks->first_node[id];
+      for (SeqIndex j = 0; j < table.lengths[id]; j++)
+        node_set_token(state, node + j, chunk[j]);
+    }
+    printf("Pre-tokenized corpus: %lld chunks, %lld unique (%lld bytes)\n",
+           (long long)chunks->order_len, (long long)chunks->count, (long long)state->node_count);
+  } else {
+    // An encoded chunk is never longer than its bytes.
+    SeqIndex total_bytes = 0;
+    for (SeqIndex id = 0; id < table.count; id++)
+      total_bytes += table.lengths[id];
+    int *tokens = malloc(sizeof(int) * (total_bytes > 0 ? (size_t)total_bytes : 1));
+    if (!tokens) {
+      fprintf(stderr, "Failed to allocate seeded chunks\n");
+      exit(1);
+    }
+    SeqIndex pos = 0;
+    for (SeqIndex id = 0; id < table.count; id++) {
+      TokenSequence encoded = encode(bytes + table.offsets[id], table.lengths[id], seed_rules);
+      memcpy(tokens + pos, encoded.tokens, sizeof(int) * (size_t)encoded.length);
+      table.lengths[id] = encoded.length;
+      pos += encoded.length;
+      free_sequence(&encoded);
+    }
+
+    trainer_chunk_nodes_init(state, table.lengths, table.weights, table.count, vocab_limit);
+    for (SeqIndex i = 0; i < state->node_count; i++)
+      node_set_token(state, i, tokens[i]);
+    free(tokens);
+    printf("Pre-tokenized corpus: %lld chunks, %lld unique (%lld bytes, %lld tokens after %d seed merges)\n",
+           (long long)chunks->order_len, (long long)chunks->count, (long long)total_bytes,
+           (long long)state->node_count, seed_rules->num_rules);
+  }
+
+  chunk_table_free(&table);
+}
+
+static void trainer_chunks_free(ChunkIndex *chunks) {
+  free(chunks->first_node);
+  free(chunks->order);
+  chunks->first_node = NULL;
+  chunks->order = NULL;
+  chunks->count = 0;
+  chunks->order_len = 0;
+}
+
+static void trainer_adjust_count(TrainerState *state, int pair_index, SeqIndex delta) {
+  if (!state->dirty_mark[pair_index]) {
+    state->dirty_mark[pair_index] = 1;
+    state->dirty[state->dirty_count++] = pair_index;
+  }
+  state->count_delta[pair_index] += delta;
+}
+
+// Counts change one pair at a time so each queue update sees an otherwise
+// valid queue. Released entries still on the list drop out of the queue.
+void trainer_flush_counts(TrainerState *state) {
+  for (int i = 0; i < state->dirty_count; i++) {
+    int pair_index = state->dirty[i];
+    PairEntry *entry = &state->pairs[pair_index];
+    entry->count += state->count_delta[pair_index];
+    if (entry->count < 0)
+      entry->count = 0;
+    state->count_delta[pair_index] = 0;
+    state->dirty_mark[pair_index] = 0;
+    pair_queue_update(&state->queue, state->pairs, pair_index);
+  }
+  state->dirty_count = 0;
+}
+
+static void pair_entry_remove_occurrence(TrainerState *state, SeqIndex occ_index) {
+  int pair_index = state->occ_pair[occ_index];
+  if (pair_index == -1)
+    return;
+
+  PairEntry *entry = &state->pairs[pair_index];
+  SeqIndex prev_occ = state->occ_prev[occ_index];
+  SeqIndex next_occ = state->occ_next[occ_index];
+
+  if (prev_occ != -1)
+    state->occ_next[prev_occ] = next_occ;
+  else
+    entry->occ_head = next_occ;
+
+  if (next_occ != -1)
+    state->occ_prev[next_occ] = prev_occ;
+
+  state->occ_pair[occ_index] = -1;
+  state->occ_prev[occ_index] = -1;
+  state->occ_next[occ_index] = -1;
+  trainer_adjust_count(state, pair_index, -node_weight(state, occ_index));
+}
+
+static void trainer_detach_occurrence_for_node(TrainerState *state, SeqIndex node_index) {
+  if (node_index == -1 || !node_active(state, node_index))
+    return;
+  pair_entry_remove_occurrence(state, node_index);
+}
+
+static void trainer_add_pair_for_node(TrainerState *state, SeqIndex node_index) {
+  if (node_index == -1 || !node_active(state, node_index))
+    return;
+
+  SeqIndex right_index = state->next[node_index];
+  if (right_index == -1)
+    return;
+
+  int left_token = node_token(state, node_index);
+  int right_token = node_token(state, right_index);
+  uint64_t key = make_pair_key(left_token, right_token);
+  int pair_index = pair_map_get(&state->map, key);
+  if (pair_index == -1) {
+    pair_index = trainer_acquire_pair_entry(state);
+    PairEntry *entry = &state->pairs[pair_index];
+    entry->token_left = left_token;
+    entry->token_right = right_token;
+    pair_map_set(&state->map, key, pair_index);
+  }
+
+  pair_entry_remove_occurrence(state, node_index);
+
+  PairEntry *entry = &state->pairs[pair_index];
+  state->occ_pair[node_index] = pair_index;
+  state->occ_prev[node_index] = -1;
+  state->occ_next[node_index] = entry->occ_head;
+
+  if (entry->occ_head != -1)
+    state->occ_prev[entry->occ_head] = node_index;
+
+  entry->occ_head = node_index;
+  trainer_adjust_count(state, pair_index, node_weight(state, node_index));
+}
+
+static void trainer_merge_occurrence(TrainerState *state, SeqIndex left_idx, int right_token, int new_token_id) {
+  if (!node_active(state, left_idx))
+    return;
+
+  SeqIndex right_idx = state->next[left_idx];
+  if (right_idx == -1 || node_token(state, right_idx) != right_token)
+    return;
+
+  SeqIndex prev_idx = state->prev[left_idx];
+  SeqIndex next_idx = state->next[right_idx];
+
+  if (prev_idx != -1)
+    trainer_detach_occurrence_for_node(state, prev_idx);
+  trainer_detach_occurrence_for_node(state, right_idx);
+
+  node_set_token(state, left_idx, new_token_id);
+
+  state->next[left_idx] = next_idx;
+  if (next_idx != -1)
+    state->prev[next_idx] = left_idx;
+  if (prev_idx == -1)
+    state->head = left_idx;
+
+  state->prev[right_idx] = NODE_DEAD;
+  state->next[right_idx] = -1;
+  state->live_count -= node_weight(state, right_idx);
+
+  if (prev_idx != -1)
+    trainer_add_pair_for_node(state, prev_idx);
+  trainer_add_pair_for_node(state, left_idx);
+}
+
+static int compare_indices(const void *a, const void *b) {
+  SeqIndex x = *(const SeqIndex*)a;
+  SeqIndex y = *(const SeqIndex*)b;
+  return (x > y) - (x < y);
+}
+
+// Copies the left nodes of every occurrence of the pair into merge_sites.
+static SeqIndex trainer_collect_sites(TrainerState *state, int pair_index) {
+  SeqIndex count = 0;
+  for (SeqIndex occ_idx = state->pairs[pair_index].occ_head; occ_idx != -1;
+       occ_idx = state->occ_next[occ_idx]) {
+    if (count >= state->merge_sites_capacity) {
+      SeqIndex new_cap = state->merge_sites_capacity ? state->merge_sites_capacity * 2 : 1024;
+      SeqIndex *sites = arena_realloc(&state->arena, state->merge_sites,
+                                      sizeof(SeqIndex) * (size_t)state->merge_sites_capacity,
+                                      sizeof(SeqIndex) * (size_t)new_cap);
+      if (!sites) {
+        fprintf(stderr, "Failed to grow merge sites\n");
+        exit(1);
+      }
+      state->merge_sites = sites;
+      state->merge_sites_capacity = new_cap;
+    }
+    state->merge_sites[count++] = occ_idx;
+  }
+  if (count > state->merge_sites_peak)
+    state->merge_sites_peak = count;
+  return count;
+}
+
+void trainer_merge_pair(TrainerState *state, int pair_index, int new_token_id) {
+  PairEntry *entry = &state->pairs[pair_index];
+  int right_token = entry->token_right;
+
+  SeqIndex site_count = trainer_collect_sites(state, pair_index);
+  SeqIndex *sites = state->merge_sites;
+
+  // Runs like "a a a" overlap with themselves; merge them left to right, as
+  // encode() does, so the result does not depend on occurrence list order.
+  if (entry->token_left == entry->token_right)
+    qsort(sites, (size_t)site_count, sizeof(SeqIndex), compare_indices);
+
+  if (state->workers != NULL && site_count >= PARALLEL_MERGE_MIN_SITES) {
+    parallel_merge_sites(state->workers, pair_index, new_token_id, sites, site_count);
+    return;
+  }
+
+  for (SeqIndex i = 0; i < site_count; i++) {
+    SeqIndex left_idx = sites[i];
+    if (state->occ_pair[left_idx] != pair_index)
+      continue;
+    pair_entry_remove_occurrence(state, left_idx);
+    trainer_merge_occurrence(state, left_idx, right_token, new_token_id);
+  }
+}
+
+// Shard-local view of the initial pair counts. Local ids are assigned in
+// first-seen order and first/last are the lowest and highest left node of
+// each pair inside the shard.
+typedef struct {
+  TrainerState *state;
+  SeqIndex begin;
+  SeqIndex end;
+
+  uint64_t *keys;
+  SeqIndex *first;
+  SeqIndex *last;
+  SeqIndex *counts;
+  int *global;
+  int count;
+  int capacity;
+
+  int *slots;
+  int slot_capacity;
+} PairShard;
+
+#define MIN_SHARD_NODES (1 << 16)
+#define PAIR_HINT_MAX (1 << 16)
+
+static void pair_shard_init(PairShard *shard, TrainerState *state, SeqIndex begin, SeqIndex end) {
+  shard->state = state;
+  shard->begin = begin;
+  shard->end = end;
+  shard->count = 0;
+  shard->capacity = 1024;
+  shard->keys = malloc(sizeof(uint64_t) * shard->capacity);
+  shard->first = malloc(sizeof(SeqIndex) * shard->capacity);
+  shard->last = malloc(sizeof(SeqIndex) * shard->capacity);
+  shard->counts = malloc(sizeof(SeqIndex) * shard->capacity);
+  shard->global = NULL;
+  shard->slot_capacity = shard->capacity * 2;
+  shard->slots = malloc(sizeof(int) * shard->slot_capacity);
+  if (!shard->keys || !shard->first || !shard->last || !shard->counts || !shard->slots) {
+    fprintf(stderr, "Failed to allocate pair shard\n");
+    exit(1);
+  }
+  for (int i = 0; i < shard->slot_capacity; i++)
+    shard->slots[i] = -1;
+}
+
+static void pair_shard_free(PairShard *shard) {
+  free(shard->keys);
+  free(shard->first);
+  free(shard->last);
+  free(shard->counts);
+  free(shard->global);
+  free(shard->slots);
+  memset(shard, 0, sizeof(*shard));
+}
+
+static void pair_shard_grow(PairShard *shard) {
+  int new_cap = shard->capacity * 2;
+  uint64_t *keys = realloc(shard->keys, sizeof(uint64_t) * new_cap);
+  SeqIndex *first = realloc(shard->first, sizeof(SeqIndex) * new_cap);
+  SeqIndex *last = realloc(shard->last, sizeof(SeqIndex) * new_cap);
+  SeqIndex *counts = realloc(shard->counts, sizeof(SeqIndex) * new_cap);
+  int *slots = malloc(sizeof(int) * new_cap * 2);
+  if (!keys || !first || !last || !counts || !slots) {
+    fprintf(stderr, "Failed to grow pair shard\n");
+    exit(1);
+  }
+  shard->keys = keys;
+  shard->first = first;
+  shard->last = last;
+  shard->counts = counts;
+  shard->capacity = new_cap;
+
+  free(shard->slots);
+  shard->slots = slots;
+  shard->slot_capacity = new_cap * 2;
+  int mask = shard->slot_capacity - 1;
+  for (int i = 0; i < shard->slot_capacity; i++)
+    shard->slots[i] = -1;
+  for (int id = 0; id < shard->count; id++) {
+    int slot = (int)(hash64(shard->keys[id]) & mask);
+    while (shard->slots[slot] != -1)
+      slot = (slot + 1) & mask;
+    shard->slots[slot] = id;
+  }
+}
+
+static int pair_shard_intern(PairShard *shard, uint64_t key) {
+  int mask = shard->slot_capacity - 1;
+  int slot = (int)(hash64(key) & mask);
+  while (shard->slots[slot] != -1) {
+    int id = shard->slots[slot];
+    if (shard->keys[id] == key)
+      return id;
+    slot = (slot + 1) & mask;
+  }
+
+  if (shard->count >= shard->capacity) {
+    pair_shard_grow(shard);
+    return pair_shard_intern(shard, key);
+  }
+
+  int id = shard->count++;
+  shard->keys[id] = key;
+  shard->first[id] = -1;
+  shard->last[id] = -1;
+  shard->counts[id] = 0;
+  shard->slots[slot] = id;
+  return id;
+}
+
+// Fills the occurrence slots of the shard's nodes and links each pair's
+// occurrences from the highest node down, as the serial path used to.
+static void *pair_shard_count(void *arg) {
+  PairShard *shard = (PairShard*)arg;
+  TrainerState *state = shard->state;
+
+  for (SeqIndex i = shard->begin; i < shard->end; i++) {
+    state->occ_prev[i] = -1;
+    state->occ_next[i] = -1;
+
+    SeqIndex right = state->next[i];
+    if (right == -1 || !node_active(state, i)) {
+      state->occ_pair[i] = -1;
+      continue;
+    }
+
+    int id = pair_shard_intern(shard, make_pair_key(node_token(state, i), node_token(state, right)));
+    state->occ_pair[i] = id;
+    state->occ_next[i] = shard->last[id];
+    if (shard->last[id] != -1)
+      state->occ_prev[shard->last[id]] = i;
+    else
+      shard->first[id] = i;
+    shard->last[id] = i;
+    shard->counts[id] += node_weight(state, i);
+  }
+  return NULL;
+}
+
+static void *pair_shard_remap(void *arg) {
+  PairShard *shard = (PairShard*)arg;
+  int *occ_pair = shard->state->occ_pair;
+  for (SeqIndex i = shard->begin; i < shard->end; i++) {
+    if (occ_pair[i] != -1)
+      occ_pair[i] = shard->global[occ_pair[i]];
+  }
+  return NULL;
+}
+
+static void run_shards(PairShard *shards, int count, void *(*fn)(void *)) {
+  pthread_t *threads = malloc(sizeof(pthread_t) * count);
+  int *started = calloc(count, sizeof(int));
+  if (!threads || !started) {
+    fprintf(stderr, "Failed to allocate shard threads\n");
+    exit(1);
+  }
+  for (int s = 1; s < count; s++)
+    started[s] = pthread_create(&threads[s], NULL, fn, &shards[s]) == 0;
+  fn(&shards[0]);
+  for (int s = 1; s < count; s++) {
+    if (started[s])
+      pthread_join(threads[s], NULL);
+    else
+      fn(&shards[s]);
+  }
+  free(threads);
+  free(started);
+}
+
+// Counts the initial pairs on contiguous node shards in parallel, then folds
+// the shards into the shared pair table in shard order. Pair indices and
+// occurrence list order come out exactly as a single pass would produce them.
+static void trainer_count_pairs(TrainerState *state, int threads) {
+  int shard_count = threads > 0 ? threads : 1;
+  SeqIndex max_shards = state->node_count / MIN_SHARD_NODES;
+  if (shard_count > max_shards)
+    shard_count = max_shards > 0 ? (int)max_shards : 1;
+
+  PairShard *shards = malloc(sizeof(PairShard) * shard_count);
+  if (!shards) {
+    fprintf(stderr, "Failed to allocate pair shards\n");
+    exit(1);
+  }
+  for (int s = 0; s < shard_count; s++) {
+    SeqIndex begin = (SeqIndex)((int64_t)state->node_count * s / shard_count);
+    SeqIndex end = (SeqIndex)((int64_t)state->node_count * (s + 1) / shard_count);
+    pair_shard_init(&shards[s], state, begin, end);
+  }
+
+  run_shards(shards, shard_count, pair_shard_count);
+
+  for (int s = 0; s < shard_count; s++) {
+    PairShard *shard = &shards[s];
+    shard->global = malloc(sizeof(int) * (shard->count > 0 ? shard->count : 1));
+    if (!shard->global) {
+      fprintf(stderr, "Failed to allocate pair shard\n");
+      exit(1);
+    }
+    for (int id = 0; id < shard->count; id++) {
+      uint64_t key = shard->keys[id];
+      int pair_index = pair_map_get(&state->map, key);
+      if (pair_index == -1) {
+        pair_index = trainer_acquire_pair_entry(state);
+        state->pairs[pair_index].token_left = (int)(key >> 32);
+        state->pairs[pair_index].token_right = (int)(uint32_t)key;
+        pair_map_set(&state->map, key, pair_index);
+      }
+
+      PairEntry *entry = &state->pairs[pair_index];
+      SeqIndex first = shard->first[id];
+      state->occ_next[first] = entry->occ_head;
+      if (entry->occ_head != -1)
+        state->occ_prev[entry->occ_head] = first;
+      entry->occ_head = shard->last[id];
+      entry->count += shard->counts[id];
+      shard->global[id] = pair_index;
+    }
+  }
+
+  run_shards(shards, shard_count, pair_shard_remap);
+
+  for (int s = 0; s < shard_count; s++)
+    pair_shard_free(&shards[s]);
+  free(shards);
+
+  pair_queue_build(&state->queue, state->pairs, state->pair_count);
+}
+
+static void trainer_arena_init(TrainerState *state, const TrainOptions *options) {
+  if (!options->use_arena)
+    return;
+  if (arena_init(&state->arena) != 0) {
+    fprintf(stderr, "Warning: unable to reserve trainer arena; using malloc\n");
+    return;
+  }
+  printf("Trainer arena: %d slices of %zu GB reserved\n", state->arena.slice_count,
+         state->arena.slice_bytes >> 30);
+}
+
+// Pair counting and queue setup shared by fresh and restored states.
+static void trainer_state_index(TrainerState *state, const TrainOptions *options) {
+  double started = train_stats_clock();
+  size_t node_bytes = (state->tokens16 ? sizeof(uint16_t) : sizeof(int)) + sizeof(int) +
+                      4 * sizeof(SeqIndex) + (state->weights ? sizeof(SeqIndex) : 0);
+  printf("Trainer nodes: %lld x %zu bytes (%.1f MB)\n", (long long)state->node_count, node_bytes,
+         (double)node_bytes * state->node_count / (1024.0 * 1024.0));
+
+  // Real corpora have far fewer distinct pairs than nodes. The pair tables
+  // grow on demand, so start them small.
+  int hint = state->node_count > PAIR_HINT_MAX ? PAIR_HINT_MAX
+           : state->node_count > 0 ? (int)state->node_count : 1;
+  trainer_occ_alloc(state);
+  pair_map_init(&state->map, hint * 2, &state->arena);
+  trainer_pairs_init(state, hint);
+  pair_queue_init(&state->queue, options->queue, hint, &state->arena);
+
+  trainer_count_pairs(state, options->threads);
+
+  if (options->threads > 1)
+    state->workers = merge_workers_create(state, options->threads);
+  if (options->stats != NULL)
+    options->stats->pair_init_seconds = train_stats_clock() - started;
+}
+
+void trainer_state_init(TrainerState *state, const uint8_t *text, SeqIndex length, int vocab_limit,
+                        MergeRules *seed_rules, const TrainOptions *options) {
+  memset(state, 0, sizeof(*state));
+  trainer_arena_init(state, options);
+  if (options->pretokenize)
+    trainer_chunks_init(state, text, length, vocab_limit, seed_rules, options->document_ends,
+                        options->document_count);
+  else if (options->document_count > 1)
+    trainer_documents_init(state, text, length, vocab_limit, seed_rules, options->document_ends,
+                           options->document_count);
+  else if (seed_rules != NULL && seed_rules->num_rules > 0)
+    trainer_seeded_sequence_init(state, text, length, vocab_limit, seed_rules);
+  else
+    trainer_bytes_init(state, text, length, vocab_limit);
+  trainer_state_index(state, options);
+}
+
+void trainer_state_restore(TrainerState *state, const TrainerSnapshot *snapshot, int vocab_limit,
+                           const TrainOptions *options) {
+  memset(state, 0, sizeof(*state));
+  trainer_arena_init(state, options);
+  if (snapshot->chunk_lengths == NULL) {
+    trainer_sequence_init(state, snapshot->token_count, vocab_limit);
+    for (SeqIndex i = 0; i < snapshot->token_count; i++)
+      node_set_token(state, i, snapshot->tokens[i]);
+  } else {
+    // Unweighted chunks (documents, or -p with no repeats) need no weights.
+    SeqIndex *weights = NULL;
+    for (SeqIndex id = 0; id < snapshot->chunk_count && weights == NULL; id++) {
+      if (snapshot->chunk_weights[id] != 1)
+        weights = snapshot->chunk_weights;
+    }
+    trainer_chunk_nodes_init(state, snapshot->chunk_lengths, weights, snapshot->chunk_count, vocab_limit);
+    for (SeqIndex i = 0; i < state->node_count; i++)
+      node_set_token(state, i, snapshot->tokens[i]);
+
+    ChunkIndex *chunks = &state->chunks;
+    chunks->order_len = snapshot->order_len;
+    chunks->order = malloc(sizeof(SeqIndex) * (snapshot->order_len > 0 ? (size_t)snapshot->order_len : 1));
+    if (!chunks->order) {
+      fprintf(stderr, "Failed to allocate chunk order\n");
+      exit(1);
+    }
+    memcpy(chunks->order, snapshot->order, sizeof(SeqIndex) * (size_t)snapshot->order_len);
+  }
+  trainer_state_index(state, options);
+}
+
+void free_trainer_snapshot(TrainerSnapshot *snapshot) {
+  free(snapshot->tokens);
+  free(snapshot->chunk_lengths);
+  free(snapshot->chunk_weights);
+  free(snapshot->order);
+  memset(snapshot, 0, sizeof(*snapshot));
+}
+
+void trainer_state_free(TrainerState *state) {
+  if (state->workers != NULL)
+    merge_workers_free(state->workers);
+  state->workers = NULL;
+  arena_release(&state->arena, state->merge_sites);
+  state->merge_sites = NULL;
+  state->merge_sites_capacity = 0;
+
+  arena_release(&state->arena, state->tokens16);
+  arena_release(&state->arena, state->tokens32);
+  arena_release(&state->arena, state->prev);
+  arena_release(&state->arena, state->next);
+  arena_release(&state->arena, state->weights);
+  arena_release(&state->arena, state->occ_pair);
+  arena_release(&state->arena, state->occ_prev);
+  arena_release(&state->arena, state->occ_next);
+  state->tokens16 = NULL;
+  state->tokens32 = NULL;
+  state->prev = NULL;
+  state->next = NULL;
+  state->weights = NULL;
+  state->occ_pair = NULL;
+  state->occ_prev = NULL;
+  state->occ_next = NULL;
+  state->node_count = 0;
+  trainer_chunks_free(&state->chunks);
+  state->head = -1;
+  state->live_count = 0;
+
+  pair_map_free(&state->map);
+  pair_queue_free(&state->queue);
+  arena_release(&state->arena, state->pairs);
+  arena_release(&state->arena, state->count_delta);
+  arena_release(&state->arena, state->dirty_mark);
+  arena_release(&state->arena, state->dirty);
+  state->pairs = NULL;
+  state->count_delta = NULL;
+  state->dirty_mark = NULL;
+  state->dirty = NULL;
+  state->dirty_count = 0;
+  state->pair_capacity = 0;
+  state->pair_count = 0;
+  state->pair_free_head = -1;
+  arena_free(&state->arena);
+}
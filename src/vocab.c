@@ -1,15 +1,18 @@
 #include "vocab.h"
-#include "token.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 Vocabulary create_vocab(int max_size) {
   Vocabulary vocab;
   vocab.size = 0;
   vocab.capacity = max_size;
-  vocab.tokens = malloc(sizeof(Token) * max_size);
-  if (vocab.tokens == NULL) {
+  vocab.entries = malloc(sizeof(VocabEntry) * (max_size > 0 ? (size_t)max_size : 1));
+  vocab.bytes = NULL;
+  vocab.bytes_used = 0;
+  vocab.bytes_capacity = 0;
+  if (vocab.entries == NULL) {
     fprintf(stderr, "Memory allocation failed\n");
     exit(1);
   }
@@ -17,25 +20,95 @@ Vocabulary create_vocab(int max_size) {
 }
 
 void free_vocab(Vocabulary *vocab) {
-  for (int i = 0; i < vocab->size; i++)
-    free_token(&vocab->tokens[i]);
-  free(vocab->tokens);
-  vocab->tokens = NULL;
+  free(vocab->entries);
+  free(vocab->bytes);
+  vocab->entries = NULL;
+  vocab->bytes = NULL;
+  vocab->bytes_used = 0;
+  vocab->bytes_capacity = 0;
   vocab->size = 0;
   vocab->capacity = 0;
 }
 
-int add_token(Vocabulary *vocab, uint8_t *bytes, int length) {
+// Grows the shared buffer to hold at least needed bytes.
+static void reserve_vocab_bytes(Vocabulary *vocab, size_t needed) {
+  if (needed > UINT32_MAX) {
+    fprintf(stderr, "Vocabulary tokens exceed 4 GiB\n");
+    exit(1);
+  }
+  if (needed <= vocab->bytes_capacity)
+    return;
+  size_t capacity = vocab->bytes_capacity ? vocab->bytes_capacity * 2 : 4096;
+  while (capacity < needed)
+    capacity *= 2;
+  uint8_t *grown = realloc(vocab->bytes, capacity);
+  if (grown == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  vocab->bytes = grown;
+  vocab->bytes_capacity = capacity;
+}
+
+uint8_t *append_token(Vocabulary *vocab, int length) {
   if (vocab->size >= vocab->capacity) {
     fprintf(stderr, "Vocabulary is full! Cannot add more tokens.\n");
     exit(1);
   }
+  VocabEntry *entry = &vocab->entries[vocab->size++];
+  entry->length = (uint32_t)length;
+  if (length <= VOCAB_INLINE_BYTES)
+    return entry->bytes;
 
-  vocab->tokens[vocab->size] = create_token(bytes, length);
-  vocab->size++;
+  reserve_vocab_bytes(vocab, vocab->bytes_used + (size_t)length);
+  entry->offset = (uint32_t)vocab->bytes_used;
+  vocab->bytes_used += (size_t)length;
+  return vocab->bytes + entry->offset;
+}
+
+int add_token(Vocabulary *vocab, const uint8_t *bytes, int length) {
+  uint8_t *dst = append_token(vocab, length);
+  if (length > 0)
+    memcpy(dst, bytes, (size_t)length);
   return vocab->size - 1;
 }
 
+void add_tokens(Vocabulary *vocab, const uint32_t *lengths, int count, const uint8_t *bytes) {
+  size_t long_bytes = 0;
+  for (int i = 0; i < count; i++) {
+    if (lengths[i] > VOCAB_INLINE_BYTES)
+      long_bytes += lengths[i];
+  }
+  reserve_vocab(vocab, vocab->size + count);
+  reserve_vocab_bytes(vocab, vocab->bytes_used + long_bytes);
+  for (int i = 0; i < count; i++) {
+    add_token(vocab, bytes, (int)lengths[i]);
+    bytes += lengths[i];
+  }
+}
+
+int add_merged_token(Vocabulary *vocab, int left, int right) {
+  int left_length = vocab_token_length(vocab, left);
+  int right_length = vocab_token_length(vocab, right);
+  // Appending can move the shared buffer, so the halves are found after.
+  uint8_t *dst = append_token(vocab, left_length + right_length);
+  memcpy(dst, vocab_token_bytes(vocab, left), (size_t)left_length);
+  memcpy(dst + left_length, vocab_token_bytes(vocab, right), (size_t)right_length);
+  return vocab->size - 1;
+}
+
+void reserve_vocab(Vocabulary *vocab, int capacity) {
+  if (capacity <= vocab->capacity)
+    return;
+  VocabEntry *entries = realloc(vocab->entries, sizeof(VocabEntry) * capacity);
+  if (entries == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  vocab->entries = entries;
+  vocab->capacity = capacity;
+}
+
 void init_base_vocab(Vocabulary *vocab) {
   for (int i = 0; i < 256; i++) {
     uint8_t byte = (uint8_t)i;
@@ -43,3 +116,42 @@ void init_base_vocab(Vocabulary *vocab) {
   }
   printf("Initialized vocabulary with %d base tokens\n", vocab->size);
 }
+
+static size_t format_bytes(const uint8_t *bytes, int length, char *out) {
+  static const char hex[] = "0123456789abcdef";
+  char *p = out;
+  for (int i = 0; i < length; i++) {
+    uint8_t byte = bytes[i];
+    if (byte >= 32 && byte < 127) {
+      // Printable ASCII
+      *p++ = (char)byte;
+    } else {
+      // Non-printable - show as hex
+      *p++ = '\\';
+      *p++ = 'x';
+      *p++ = hex[byte >> 4];
+      *p++ = hex[byte & 15];
+    }
+  }
+  return (size_t)(p - out);
+}
+
+size_t format_token(const Vocabulary *vocab, int token, char *out) {
+  size_t written = format_bytes(vocab_token_bytes(vocab, token), vocab_token_length(vocab, token), out + 1);
+  out[0] = '[';
+  out[written + 1] = ']';
+  return written + 2;
+}
+
+// Long tokens are printed a slice at a time through a stack buffer.
+void print_token(const Vocabulary *vocab, int token) {
+  char text[4 * 64];
+  const uint8_t *bytes = vocab_token_bytes(vocab, token);
+  int length = vocab_token_length(vocab, token);
+  putchar('[');
+  for (int i = 0; i < length; i += 64) {
+    int slice = length - i < 64 ? length - i : 64;
+    fwrite(text, 1, format_bytes(bytes + i, slice, text), stdout);
+  }
+  putchar(']');
+}